@@ -0,0 +1,128 @@
+#include "rpcbufferpool.h"
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <pthread.h>
+
+typedef struct BufferPoolObj {
+  uint64_t size;
+  uint64_t alignment;
+  uint64_t capacity;
+  uint64_t num_free;
+  uint8_t **buffers;
+  pthread_mutex_t mutex;
+} BufferPoolObj;
+
+// Input: count - the number of buffers to keep in the pool
+// Input: size - the size of each buffer in bytes
+// Input: alignment - the alignment of each buffer, a power of two
+// Output: the newly created buffer pool
+//
+// Create a pool of aligned buffers
+BufferPool create_buffer_pool(uint64_t count, uint64_t size,
+                              uint64_t alignment) {
+  BufferPool pool = (BufferPoolObj *)malloc(sizeof(BufferPoolObj));
+  if (pool != NULL) {
+    pool->size = size;
+    pool->alignment = alignment;
+    pool->capacity = count;
+    pool->num_free = 0;
+    pool->buffers = (uint8_t **)calloc(count > 0 ? count : 1, sizeof(uint8_t *));
+    pthread_mutex_init(&(pool->mutex), NULL);
+    if (pool->buffers == NULL) {
+      pthread_mutex_destroy(&(pool->mutex));
+      free(pool);
+      return NULL;
+    }
+    // Allocate the buffers up front so that transfers do not have to
+    while (pool->num_free < count &&
+           posix_memalign((void **)&(pool->buffers[pool->num_free]),
+                          alignment, size) == 0) {
+      pool->num_free++;
+    }
+  }
+  return pool;
+}
+
+// Input: ptr - pointer to a buffer pool
+// Output: (0) if the pool was deleted successfully, EINVAL (22) if the
+// pointer or contents of the pool do not exist
+//
+// Delete a buffer pool and the buffers that have been returned to it
+uint8_t delete_buffer_pool(BufferPool *ptr) {
+  if (ptr != NULL && *ptr != NULL) {
+    BufferPool pool = *ptr;
+    while (pool->num_free > 0) {
+      free(pool->buffers[--pool->num_free]);
+    }
+    pthread_mutex_destroy(&(pool->mutex));
+    free(pool->buffers);
+    free(pool);
+    *ptr = NULL;
+    return 0;
+  } else {
+    return EINVAL;
+  }
+}
+
+// Input: pool - the buffer pool
+// Output: the size of each buffer in bytes
+//
+// Get the size of the buffers handed out by a pool
+uint64_t buffer_pool_buffer_size(BufferPool pool) {
+  return pool != NULL ? pool->size : 0;
+}
+
+// Input: pool - the buffer pool
+// Output: the alignment of each buffer in bytes
+//
+// Get the alignment of the buffers handed out by a pool
+uint64_t buffer_pool_alignment(BufferPool pool) {
+  return pool != NULL ? pool->alignment : 0;
+}
+
+// Input: pool - the buffer pool
+// Output: an aligned buffer or NULL if none could be allocated
+//
+// Take a buffer from a pool, allocating a new one if the pool is empty
+uint8_t *buffer_pool_get(BufferPool pool) {
+  uint8_t *buffer = NULL;
+
+  if (pool == NULL) {
+    return NULL;
+  }
+
+  pthread_mutex_lock(&(pool->mutex)); // Lock the buffer pool mutex
+  if (pool->num_free > 0) {
+    buffer = pool->buffers[--pool->num_free];
+  }
+  pthread_mutex_unlock(&(pool->mutex)); // Unlock the buffer pool mutex
+
+  if (buffer == NULL &&
+      posix_memalign((void **)&buffer, pool->alignment, pool->size) != 0) {
+    buffer = NULL;
+  }
+
+  return buffer;
+}
+
+// Input: pool - the buffer pool
+// Input: buffer - a buffer returned by buffer_pool_get()
+// Output: none
+//
+// Return a buffer to a pool, freeing it if the pool is already full
+void buffer_pool_put(BufferPool pool, uint8_t *buffer) {
+  if (pool == NULL || buffer == NULL) {
+    return;
+  }
+
+  pthread_mutex_lock(&(pool->mutex)); // Lock the buffer pool mutex
+  if (pool->num_free < pool->capacity) {
+    pool->buffers[pool->num_free++] = buffer;
+    buffer = NULL;
+  }
+  pthread_mutex_unlock(&(pool->mutex)); // Unlock the buffer pool mutex
+
+  free(buffer);
+  return;
+}
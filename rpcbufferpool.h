@@ -0,0 +1,20 @@
+#ifndef __RPCBUFFERPOOL_H__
+#define __RPCBUFFERPOOL_H__
+
+#include <cstdint>
+
+typedef struct BufferPoolObj *BufferPool;
+
+BufferPool create_buffer_pool(uint64_t count, uint64_t size, uint64_t alignment);
+
+uint8_t delete_buffer_pool(BufferPool *ptr);
+
+uint64_t buffer_pool_buffer_size(BufferPool pool);
+
+uint64_t buffer_pool_alignment(BufferPool pool);
+
+uint8_t *buffer_pool_get(BufferPool pool);
+
+void buffer_pool_put(BufferPool pool, uint8_t *buffer);
+
+#endif
@@ -0,0 +1,200 @@
+#include "rpccompress.h"
+#include <cstdint>
+#include <cstring>
+
+// Blocks use the LZ4 block format so that clients can use any LZ4 library
+#define MIN_MATCH 4
+#define LAST_LITERALS 5 // The last bytes of a block are always literals
+#define MATCH_LIMIT 12  // No match may start this close to the end
+#define MAX_OFFSET 65535
+#define HASH_BITS 12
+
+// Read four bytes from a possibly unaligned address
+static inline uint32_t read_uint32(const uint8_t *ptr) {
+  uint32_t value;
+  memcpy(&value, ptr, sizeof(value));
+  return value;
+}
+
+// Hash the four bytes at a position into the match table
+static inline uint32_t hash_uint32(uint32_t value) {
+  return (value * 2654435761U) >> (32 - HASH_BITS);
+}
+
+// Write a length of 15 or more as a run of extension bytes
+static inline uint8_t *write_length(uint8_t *op, uint64_t length) {
+  while (length >= 255) {
+    *op++ = 255;
+    length -= 255;
+  }
+  *op++ = (uint8_t)length;
+  return op;
+}
+
+// Input: length - the number of bytes to be compressed
+// Output: the largest size compress_block() can produce for that many bytes
+//
+// Get the size of the output buffer needed to compress a block
+uint64_t compress_bound(uint64_t length) { return length + length / 255 + 16; }
+
+// Input: src - the bytes to compress
+// Input: length - the number of bytes to compress
+// Input: dst - the buffer for the compressed block
+// Input: capacity - the size of the output buffer
+// Output: the size of the compressed block, or (0) if it does not fit
+//
+// Compress a block with a single pass of greedy hash matching, trading ratio
+// for speed. Callers send the block uncompressed when it does not shrink.
+uint64_t compress_block(const uint8_t *src, uint64_t length, uint8_t *dst,
+                        uint64_t capacity) {
+  uint32_t table[1 << HASH_BITS];
+  const uint8_t *ip = src;
+  const uint8_t *anchor = src;
+  const uint8_t *end = src + length;
+  // Pointing before src is undefined, so blocks too short for a match get a
+  // limit that no match can reach
+  const uint8_t *match_limit =
+      src + (length > LAST_LITERALS ? length - LAST_LITERALS : 0);
+  const uint8_t *ref;
+  uint8_t *op = dst;
+  uint8_t *token;
+  uint64_t literals;
+  uint64_t match;
+
+  if (capacity < compress_bound(length)) {
+    return 0;
+  }
+
+  memset(table, 0, sizeof(table));
+
+  while (length > MATCH_LIMIT && ip < end - MATCH_LIMIT) {
+    uint32_t sequence = read_uint32(ip);
+    uint32_t hash = hash_uint32(sequence);
+    ref = src + table[hash];
+    table[hash] = ip - src;
+
+    if (ref >= ip || ip - ref > MAX_OFFSET || read_uint32(ref) != sequence) {
+      ip++;
+      continue;
+    }
+
+    // Extend the match as far as the block allows
+    match = MIN_MATCH;
+    while (ip + match < match_limit && ref[match] == ip[match]) {
+      match++;
+    }
+
+    literals = ip - anchor;
+    token = op++;
+    *token = (literals >= 15 ? 15 : literals) << 4;
+    if (literals >= 15) {
+      op = write_length(op, literals - 15);
+    }
+    memcpy(op, anchor, literals);
+    op += literals;
+
+    *op++ = (uint8_t)(ip - ref);
+    *op++ = (uint8_t)((ip - ref) >> 8);
+
+    if (match - MIN_MATCH >= 15) {
+      *token |= 15;
+      op = write_length(op, match - MIN_MATCH - 15);
+    } else {
+      *token |= match - MIN_MATCH;
+    }
+
+    ip += match;
+    anchor = ip;
+  }
+
+  // Finish with the remaining bytes as literals
+  literals = end - anchor;
+  token = op++;
+  *token = (literals >= 15 ? 15 : literals) << 4;
+  if (literals >= 15) {
+    op = write_length(op, literals - 15);
+  }
+  memcpy(op, anchor, literals);
+  op += literals;
+
+  return op - dst;
+}
+
+// Input: src - the compressed block
+// Input: length - the size of the compressed block
+// Input: dst - the buffer for the decompressed bytes
+// Input: capacity - the size of the output buffer
+// Output: the number of bytes decompressed, or (-1) if the block is corrupt
+//
+// Decompress a block, checking every length and offset against the buffers
+// since the block came from the network
+int64_t decompress_block(const uint8_t *src, uint64_t length, uint8_t *dst,
+                         uint64_t capacity) {
+  const uint8_t *ip = src;
+  const uint8_t *end = src + length;
+  uint8_t *op = dst;
+  uint8_t *op_end = dst + capacity;
+  uint64_t literals;
+  uint64_t match;
+  uint64_t offset;
+  uint8_t token;
+  uint8_t byte;
+
+  while (ip < end) {
+    token = *ip++;
+
+    literals = token >> 4;
+    if (literals == 15) {
+      do {
+        if (ip >= end) {
+          return -1;
+        }
+        byte = *ip++;
+        literals += byte;
+      } while (byte == 255);
+    }
+
+    if (literals > (uint64_t)(end - ip) || literals > (uint64_t)(op_end - op)) {
+      return -1;
+    }
+    memcpy(op, ip, literals);
+    ip += literals;
+    op += literals;
+
+    if (ip == end) {
+      break; // The last sequence has no match
+    }
+
+    if (end - ip < 2) {
+      return -1;
+    }
+    offset = ip[0] | (ip[1] << 8);
+    ip += 2;
+    if (offset == 0 || offset > (uint64_t)(op - dst)) {
+      return -1;
+    }
+
+    match = token & 15;
+    if (match == 15) {
+      do {
+        if (ip >= end) {
+          return -1;
+        }
+        byte = *ip++;
+        match += byte;
+      } while (byte == 255);
+    }
+    match += MIN_MATCH;
+
+    if (match > (uint64_t)(op_end - op)) {
+      return -1;
+    }
+
+    // Copy a byte at a time since the match may overlap its own output
+    for (const uint8_t *ref = op - offset; match > 0; match--) {
+      *op++ = *ref++;
+    }
+  }
+
+  return op - dst;
+}
@@ -0,0 +1,14 @@
+#ifndef __RPCCOMPRESS_H__
+#define __RPCCOMPRESS_H__
+
+#include <cstdint>
+
+#define COMPRESS_BLOCK_SIZE (64 << 10)
+
+uint64_t compress_bound(uint64_t length);
+
+uint64_t compress_block(const uint8_t *src, uint64_t length, uint8_t *dst, uint64_t capacity);
+
+int64_t decompress_block(const uint8_t *src, uint64_t length, uint8_t *dst, uint64_t capacity);
+
+#endif
@@ -0,0 +1,177 @@
+#include "rpccrc32c.h"
+#include <cstdint>
+#include <cstring>
+#include <pthread.h>
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+#define CRC32C_POLYNOMIAL 0x82f63b78 // Castagnoli, bit-reversed
+#define CRC32C_LANE 512 // Bytes each of three interleaved lanes covers
+
+typedef uint32_t (*Crc32cFunction)(uint32_t, const uint8_t *, uint64_t);
+
+static uint32_t crc32c_table[8][256];
+static uint32_t crc32c_shift_table[4][256];
+static Crc32cFunction crc32c_function = NULL;
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+// Input: crc - the checksum so far, inverted
+// Input: data - the bytes to add to the checksum
+// Input: length - the number of bytes
+// Output: the updated checksum, inverted
+//
+// Compute a CRC32C eight bytes at a time with lookup tables
+uint32_t crc32c_software(uint32_t crc, const uint8_t *data, uint64_t length) {
+  uint64_t word;
+
+  while (length > 0 && ((uintptr_t)data & 7) != 0) {
+    crc = crc32c_table[0][(crc ^ *data++) & 0xFF] ^ (crc >> 8);
+    length--;
+  }
+
+  while (length >= 8) {
+    memcpy(&word, data, 8);
+    word ^= crc;
+    crc = crc32c_table[7][word & 0xFF] ^ crc32c_table[6][(word >> 8) & 0xFF] ^
+          crc32c_table[5][(word >> 16) & 0xFF] ^
+          crc32c_table[4][(word >> 24) & 0xFF] ^
+          crc32c_table[3][(word >> 32) & 0xFF] ^
+          crc32c_table[2][(word >> 40) & 0xFF] ^
+          crc32c_table[1][(word >> 48) & 0xFF] ^ crc32c_table[0][word >> 56];
+    data += 8;
+    length -= 8;
+  }
+
+  while (length > 0) {
+    crc = crc32c_table[0][(crc ^ *data++) & 0xFF] ^ (crc >> 8);
+    length--;
+  }
+
+  return crc;
+}
+
+// Input: crc - a checksum, inverted
+// Output: the checksum extended by CRC32C_LANE zero bytes, inverted
+//
+// Move a checksum past a lane of bytes so that the checksum of the next lane
+// can be added to it
+uint32_t crc32c_shift(uint32_t crc) {
+  return crc32c_shift_table[0][crc & 0xFF] ^
+         crc32c_shift_table[1][(crc >> 8) & 0xFF] ^
+         crc32c_shift_table[2][(crc >> 16) & 0xFF] ^
+         crc32c_shift_table[3][crc >> 24];
+}
+
+#if defined(__x86_64__)
+// Input: crc - the checksum so far, inverted
+// Input: data - the bytes to add to the checksum
+// Input: length - the number of bytes
+// Output: the updated checksum, inverted
+//
+// Compute a CRC32C with the SSE4.2 crc32 instruction
+// The instruction takes three cycles but can start every cycle, so three
+// lanes are checksummed side by side and then joined with crc32c_shift()
+__attribute__((target("sse4.2"))) uint32_t
+crc32c_sse42(uint32_t crc, const uint8_t *data, uint64_t length) {
+  uint64_t crc64 = crc;
+  uint64_t crc1;
+  uint64_t crc2;
+  uint64_t word;
+
+  while (length > 0 && ((uintptr_t)data & 7) != 0) {
+    crc64 = _mm_crc32_u8((uint32_t)crc64, *data++);
+    length--;
+  }
+
+  while (length >= 3 * CRC32C_LANE) {
+    crc1 = 0;
+    crc2 = 0;
+    for (const uint8_t *end = data + CRC32C_LANE; data < end; data += 8) {
+      memcpy(&word, data, 8);
+      crc64 = _mm_crc32_u64(crc64, word);
+      memcpy(&word, data + CRC32C_LANE, 8);
+      crc1 = _mm_crc32_u64(crc1, word);
+      memcpy(&word, data + 2 * CRC32C_LANE, 8);
+      crc2 = _mm_crc32_u64(crc2, word);
+    }
+    crc64 = crc32c_shift(crc32c_shift((uint32_t)crc64) ^ (uint32_t)crc1) ^
+            (uint32_t)crc2;
+    data += 2 * CRC32C_LANE;
+    length -= 3 * CRC32C_LANE;
+  }
+
+  while (length >= 8) {
+    memcpy(&word, data, 8);
+    crc64 = _mm_crc32_u64(crc64, word);
+    data += 8;
+    length -= 8;
+  }
+
+  while (length > 0) {
+    crc64 = _mm_crc32_u8((uint32_t)crc64, *data++);
+    length--;
+  }
+
+  return (uint32_t)crc64;
+}
+#endif
+
+// Build the lookup tables and pick the fastest kernel the CPU supports
+void crc32c_init() {
+  for (uint32_t i = 0; i < 256; i++) {
+    uint32_t crc = i;
+    for (uint8_t bit = 0; bit < 8; bit++) {
+      crc = (crc >> 1) ^ (crc & 1 ? CRC32C_POLYNOMIAL : 0);
+    }
+    crc32c_table[0][i] = crc;
+  }
+
+  for (uint32_t i = 0; i < 256; i++) {
+    for (uint8_t slice = 1; slice < 8; slice++) {
+      uint32_t crc = crc32c_table[slice - 1][i];
+      crc32c_table[slice][i] = crc32c_table[0][crc & 0xFF] ^ (crc >> 8);
+    }
+  }
+
+  // A checksum is linear in its starting value, so the shift of any value is
+  // the sum of the shifts of its bits
+  uint8_t zeros[CRC32C_LANE] = {0};
+  uint32_t bits[32];
+  for (uint8_t bit = 0; bit < 32; bit++) {
+    bits[bit] = crc32c_software(1U << bit, zeros, CRC32C_LANE);
+  }
+  for (uint8_t slice = 0; slice < 4; slice++) {
+    for (uint32_t i = 0; i < 256; i++) {
+      uint32_t crc = 0;
+      for (uint8_t bit = 0; bit < 8; bit++) {
+        if (i & (1U << bit)) {
+          crc ^= bits[slice * 8 + bit];
+        }
+      }
+      crc32c_shift_table[slice][i] = crc;
+    }
+  }
+
+  crc32c_function = crc32c_software;
+
+#if defined(__x86_64__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("sse4.2")) {
+    crc32c_function = crc32c_sse42;
+  }
+#endif
+
+  return;
+}
+
+// Input: crc - the checksum of the bytes so far, (0) to start a new one
+// Input: data - the bytes to add to the checksum
+// Input: length - the number of bytes
+// Output: the CRC32C of the bytes so far followed by these bytes
+//
+// Compute or extend a CRC32C (Castagnoli) checksum
+uint32_t crc32c(uint32_t crc, const uint8_t *data, uint64_t length) {
+  pthread_once(&crc32c_once, crc32c_init);
+  return ~crc32c_function(~crc, data, length);
+}
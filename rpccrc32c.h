@@ -0,0 +1,8 @@
+#ifndef __RPCCRC32C_H__
+#define __RPCCRC32C_H__
+
+#include <cstdint>
+
+uint32_t crc32c(uint32_t crc, const uint8_t *data, uint64_t length);
+
+#endif
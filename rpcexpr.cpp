@@ -0,0 +1,355 @@
+#include "rpcexpr.h"
+#include "rpcconvert.h"
+#include "rpcmath.h"
+#include <cctype>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+// Instructions of the register bytecode
+#define OP_LITERAL 0x00  // registers[dst] = value
+#define OP_VARIABLE 0x08 // registers[dst] = variables[value]
+// OP_ADD through OP_MOD are the node tags,
+// registers[dst] = registers[dst] op registers[dst + 1]
+
+typedef struct InstructionObj {
+  uint8_t op;
+  uint8_t dst;
+  int64_t value;
+} InstructionObj;
+
+typedef struct ProgramObj {
+  uint8_t *source;
+  uint16_t source_length;
+  uint64_t hash;
+  InstructionObj *code;
+  uint16_t num_instructions;
+  uint8_t names[MAX_PROGRAM_VARIABLES][32];
+  uint16_t num_variables;
+} ProgramObj;
+
+typedef struct ProgramCacheObj {
+  uint64_t size;
+  Program *programs;
+} ProgramCacheObj;
+
+// Input: source - the bytes to hash
+// Input: length - the number of bytes
+// Output: the FNV-1a hash of the bytes
+//
+// Hash the source of an expression
+uint64_t program_hash(uint8_t *source, uint16_t length) {
+  uint64_t hash = 0xcbf29ce484222325L;
+  for (uint16_t i = 0; i < length; i++) {
+    hash ^= source[i];
+    hash *= 0x100000001b3L;
+  }
+  return hash;
+}
+
+// Input: op - the operation, NODE_ADD through NODE_MOD
+// Input: a - the first operand
+// Input: b - the second operand
+// Input: result - set to the result of the operation
+// Output: (0) or the error of the operation
+//
+// Apply one operation with the same checks as the 0x01XX functions
+inline uint8_t program_run_operation(uint8_t op, int64_t a, int64_t b,
+                                     int64_t *result) {
+  switch (op) {
+  case NODE_ADD:
+    return checked_add(a, b, result);
+  case NODE_SUB:
+    return checked_sub(a, b, result);
+  case NODE_MUL:
+    return checked_mul(a, b, result);
+  case NODE_DIVIDE:
+    return checked_divide(a, b, result);
+  default:
+    return checked_mod(a, b, result);
+  }
+}
+
+// Input: program - the program being compiled
+// Input: source - the source of the expression
+// Input: length - the number of bytes in the source
+// Input: position - the position of the next node, moved past it
+// Input: reg - the register the value of the node goes in
+// Output: (0) if the node was compiled, EINVAL (22) if it is malformed, uses
+// an invalid name or needs too many registers or variables
+//
+// Compile a node and its children so that its value ends up in a register
+// The left child of an operation shares its register and the right child
+// uses the next one, so the number of registers is the depth of the tree
+uint8_t compile_node(Program program, uint8_t *source, uint16_t length,
+                     uint16_t *position, uint8_t reg) {
+  if (*position >= length || reg >= MAX_PROGRAM_REGISTERS) {
+    return EINVAL;
+  }
+
+  uint8_t tag = source[(*position)++];
+  InstructionObj *instruction = &(program->code[program->num_instructions]);
+  uint8_t status = 0;
+
+  if (tag == NODE_LITERAL) {
+    if (length - *position < 8) {
+      return EINVAL;
+    }
+    instruction->op = OP_LITERAL;
+    instruction->dst = reg;
+    instruction->value = wire_to_uint64(source, *position, *position + 7);
+    *position += 8;
+    program->num_instructions++;
+  } else if (tag == NODE_VARIABLE) {
+    if (*position >= length) {
+      return EINVAL;
+    }
+    uint8_t name_length = source[(*position)++];
+    if (name_length < 1 || name_length > 31 || length - *position < name_length ||
+        !isalpha(source[*position])) {
+      return EINVAL;
+    }
+    for (uint8_t i = 1; i < name_length; i++) {
+      if (!isalnum(source[*position + i]) && source[*position + i] != '_') {
+        return EINVAL;
+      }
+    }
+
+    // Each variable is resolved once however often it appears
+    uint16_t index = 0;
+    while (index < program->num_variables &&
+           (strlen((char *)program->names[index]) != name_length ||
+            memcmp(program->names[index], source + *position, name_length))) {
+      index++;
+    }
+    if (index == program->num_variables) {
+      if (index == MAX_PROGRAM_VARIABLES) {
+        return EINVAL;
+      }
+      memcpy(program->names[index], source + *position, name_length);
+      program->names[index][name_length] = 0;
+      program->num_variables++;
+    }
+
+    instruction->op = OP_VARIABLE;
+    instruction->dst = reg;
+    instruction->value = index;
+    *position += name_length;
+    program->num_instructions++;
+  } else if (tag >= NODE_ADD && tag <= NODE_MOD) {
+    if ((status = compile_node(program, source, length, position, reg)) != 0 ||
+        (status = compile_node(program, source, length, position, reg + 1)) !=
+            0) {
+      return status;
+    }
+
+    // Fold an operation on two literals unless it fails, in which case the
+    // error is left to be reported when the program runs
+    InstructionObj *left = &(program->code[program->num_instructions - 2]);
+    InstructionObj *right = &(program->code[program->num_instructions - 1]);
+    int64_t value = 0;
+    if (left->op == OP_LITERAL && left->dst == reg &&
+        right->op == OP_LITERAL && right->dst == reg + 1 &&
+        program_run_operation(tag, left->value, right->value, &value) == 0) {
+      left->value = value;
+      program->num_instructions--;
+      return 0;
+    }
+
+    instruction = &(program->code[program->num_instructions]);
+    instruction->op = tag;
+    instruction->dst = reg;
+    instruction->value = 0;
+    program->num_instructions++;
+  } else {
+    return EINVAL;
+  }
+
+  return 0;
+}
+
+// Input: source - the expression in prefix order
+// Input: length - the number of bytes in the source
+// Input: ptr - set to the newly compiled program
+// Output: (0) if the program was compiled, EINVAL (22) if the expression is
+// malformed or has bytes left over, ENOMEM (12) if it could not be allocated
+//
+// Compile an expression to a program
+uint8_t compile_program(uint8_t *source, uint16_t length, Program *ptr) {
+  Program program = (ProgramObj *)calloc(1, sizeof(ProgramObj));
+  uint16_t position = 0;
+  uint8_t status = 0;
+
+  *ptr = NULL;
+
+  if (program == NULL) {
+    return ENOMEM;
+  }
+
+  // Every node is at least one byte long and makes at most one instruction
+  program->source = (uint8_t *)malloc(length > 0 ? length : 1);
+  program->code = (InstructionObj *)calloc(length > 0 ? length : 1,
+                                           sizeof(InstructionObj));
+  if (program->source == NULL || program->code == NULL) {
+    delete_program(&program);
+    return ENOMEM;
+  }
+
+  memcpy(program->source, source, length);
+  program->source_length = length;
+  program->hash = program_hash(source, length);
+
+  status = compile_node(program, source, length, &position, 0);
+  if (status == 0 && position != length) {
+    status = EINVAL;
+  }
+
+  if (status != 0) {
+    delete_program(&program);
+    return status;
+  }
+
+  *ptr = program;
+  return 0;
+}
+
+// Input: ptr - pointer to a program
+// Output: (0) if the program was deleted successfully, EINVAL (22) if the
+// pointer or contents of the program do not exist
+//
+// Delete a program
+uint8_t delete_program(Program *ptr) {
+  if (ptr != NULL && *ptr != NULL) {
+    free((*ptr)->source);
+    free((*ptr)->code);
+    free(*ptr);
+    *ptr = NULL;
+    return 0;
+  } else {
+    return EINVAL;
+  }
+}
+
+// Input: program - the program
+// Output: the number of distinct variables the program reads
+//
+// Get the number of variables of a program
+uint16_t program_num_variables(Program program) {
+  return program->num_variables;
+}
+
+// Input: program - the program
+// Input: index - the index of the variable
+// Output: the name of the variable
+//
+// Get the name of a variable of a program
+uint8_t *program_variable(Program program, uint16_t index) {
+  return program->names[index];
+}
+
+// Input: program - the program
+// Input: variables - the value of each variable of the program, in order
+// Input: result - set to the value of the expression
+// Output: (0) if the expression was evaluated, otherwise the error of the
+// first operation that failed
+//
+// Run a program
+uint8_t program_run(Program program, int64_t *variables, int64_t *result) {
+  int64_t registers[MAX_PROGRAM_REGISTERS];
+  InstructionObj *instruction = program->code;
+  InstructionObj *end = program->code + program->num_instructions;
+  uint8_t status = 0;
+
+  for (; instruction < end; instruction++) {
+    uint8_t dst = instruction->dst;
+    switch (instruction->op) {
+    case OP_LITERAL:
+      registers[dst] = instruction->value;
+      break;
+    case OP_VARIABLE:
+      registers[dst] = variables[instruction->value];
+      break;
+    default:
+      status = program_run_operation(instruction->op, registers[dst],
+                                     registers[dst + 1], &(registers[dst]));
+      if (status != 0) {
+        return status;
+      }
+    }
+  }
+
+  *result = registers[0];
+  return 0;
+}
+
+// Input: size - the number of programs to keep
+// Output: the newly created program cache
+//
+// Create a cache of compiled programs keyed by the hash of their source
+ProgramCache create_program_cache(uint64_t size) {
+  ProgramCache cache = (ProgramCacheObj *)malloc(sizeof(ProgramCacheObj));
+  if (cache != NULL) {
+    cache->size = size > 0 ? size : 1;
+    cache->programs = (Program *)calloc(cache->size, sizeof(Program));
+    if (cache->programs == NULL) {
+      free(cache);
+      return NULL;
+    }
+  }
+  return cache;
+}
+
+// Input: ptr - pointer to a program cache
+// Output: (0) if the cache was deleted successfully, EINVAL (22) if the
+// pointer or contents of the cache do not exist
+//
+// Delete a program cache and the programs in it
+uint8_t delete_program_cache(ProgramCache *ptr) {
+  if (ptr != NULL && *ptr != NULL) {
+    for (uint64_t i = 0; i < (*ptr)->size; i++) {
+      delete_program(&((*ptr)->programs[i]));
+    }
+    free((*ptr)->programs);
+    free(*ptr);
+    *ptr = NULL;
+    return 0;
+  } else {
+    return EINVAL;
+  }
+}
+
+// Input: cache - the program cache
+// Input: source - the expression in prefix order
+// Input: length - the number of bytes in the source
+// Input: ptr - set to the compiled program, which belongs to the cache until
+// the next lookup
+// Output: (0) if the program was found or compiled, otherwise the error from
+// compiling it
+//
+// Find the compiled program of an expression, compiling it on a miss
+// Each slot holds one program and a new program replaces the old one
+uint8_t program_cache_lookup(ProgramCache cache, uint8_t *source,
+                             uint16_t length, Program *ptr) {
+  uint64_t hash = program_hash(source, length);
+  uint64_t slot = hash % cache->size;
+  Program program = cache->programs[slot];
+  uint8_t status = 0;
+
+  if (program != NULL && program->hash == hash &&
+      program->source_length == length &&
+      memcmp(program->source, source, length) == 0) {
+    *ptr = program;
+    return 0;
+  }
+
+  if ((status = compile_program(source, length, &program)) != 0) {
+    *ptr = NULL;
+    return status;
+  }
+
+  delete_program(&(cache->programs[slot]));
+  cache->programs[slot] = program;
+  *ptr = program;
+  return 0;
+}
@@ -0,0 +1,45 @@
+#ifndef __RPCEXPR_H__
+#define __RPCEXPR_H__
+
+#include <cstdint>
+
+// Node tags of an expression, written in prefix order
+// The operations use the same numbers as the 0x01XX functions
+#define NODE_LITERAL 0x00 // Followed by an i64
+#define NODE_ADD 0x01     // Followed by two nodes
+#define NODE_SUB 0x02
+#define NODE_MUL 0x03
+#define NODE_DIVIDE 0x04
+#define NODE_MOD 0x05
+#define NODE_VARIABLE 0x08 // Followed by a u8 length and the name
+
+#define EXPRESSION_RESULT 0x40    // Store the result in a variable
+#define EXPRESSION_RECURSIVE 0x80 // Follow variables that hold other names
+#define EXPRESSION_FLAGS (EXPRESSION_RESULT | EXPRESSION_RECURSIVE)
+
+#define MAX_EXPRESSION_SIZE 4096
+#define MAX_PROGRAM_REGISTERS 64
+#define MAX_PROGRAM_VARIABLES 64
+#define DEFAULT_PROGRAM_CACHE_SIZE 64
+
+typedef struct ProgramObj *Program;
+
+typedef struct ProgramCacheObj *ProgramCache;
+
+uint8_t compile_program(uint8_t *source, uint16_t length, Program *ptr);
+
+uint8_t delete_program(Program *ptr);
+
+uint16_t program_num_variables(Program program);
+
+uint8_t *program_variable(Program program, uint16_t index);
+
+uint8_t program_run(Program program, int64_t *variables, int64_t *result);
+
+ProgramCache create_program_cache(uint64_t size);
+
+uint8_t delete_program_cache(ProgramCache *ptr);
+
+uint8_t program_cache_lookup(ProgramCache cache, uint8_t *source, uint16_t length, Program *ptr);
+
+#endif
@@ -1,86 +1,1099 @@
 #include "rpcfile.h"
+#include "rpcbufferpool.h"
+#include "rpccompress.h"
 #include "rpcconvert.h"
+#include "rpccrc32c.h"
+#include "rpcfilecache.h"
 #include "rpcio.h"
 #include <cerrno>
 #include <cstdint>
+#include <cstdlib>
+#include <cstring>
 #include <err.h>
 #include <fcntl.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 #define BUFFER_SIZE 4096
+#define PIPE_SIZE (1 << 20)
+#define SPLICE_THRESHOLD (16 << 10)
 
 // Read bufsize bytes at a specific offset from a file into a buffer
-int64_t read(char *filename, uint64_t offset, uint16_t bufsize,
+int64_t read(FileCache cache, char *filename, uint64_t offset, uint16_t bufsize,
              uint8_t *buffer) {
-  int fd;
-  struct stat st;
-  stat(filename, &st);
+  FileEntry entry;
   int64_t bytes_read = 0;
+  int64_t status = file_cache_acquire(cache, filename, &entry);
 
-  if ((fd = open(filename, O_RDONLY, 0)) == -1) { // Open file filename
-    warn("%s", filename);
-    return -errno;
+  if (status < 0) { // Get an open descriptor for file filename
+    return status;
   }
 
-  // Check if an error occurred while getting the size of the file
-  if (st.st_size == -1) {
-    warn("%s", filename);
-    return -errno;
+  if (!file_entry_readable(entry)) {
+    file_cache_release(cache, entry);
+    return -EACCES;
   }
 
   // Check if the offset is greater than the filesize of the file
-  if (offset > (uint64_t)st.st_size) {
+  if (offset > file_entry_size(entry)) {
+    file_cache_release(cache, entry);
     return -EINVAL;
   }
 
-  if (lseek(fd, offset, SEEK_SET) == -1) { // Change the file offset
-    warn("%s", filename);
-    return -errno;
+  if (file_cache_lock(cache, entry, offset, bufsize, 0) != 0) {
+    file_cache_release(cache, entry);
+    return -ENOMEM;
   }
 
   // Read bufsize bytes from the file into the buffer
-  if ((bytes_read = read(fd, buffer, bufsize)) == -1) {
+  if ((bytes_read = pread(file_entry_fd(entry), buffer, bufsize, offset)) ==
+      -1) {
+    bytes_read = -errno;
     warn("%s", filename);
-    return -errno;
   }
 
-  if (close(fd) == -1) { // Close file filename
-    warn("%s", filename);
-    return -errno;
-  }
+  file_cache_unlock(cache, entry, offset, bufsize, 0);
+  file_cache_release(cache, entry);
 
   return bytes_read;
 }
 
 // Write bufsize bytes at a specific offset to a file from a buffer
-int64_t write(char *filename, uint64_t offset, uint16_t bufsize,
-              uint8_t *buffer) {
-  int fd;
+int64_t write(FileCache cache, char *filename, uint64_t offset,
+              uint16_t bufsize, uint8_t *buffer) {
+  FileEntry entry;
   int64_t bytes_written = 0;
+  int64_t status = file_cache_acquire(cache, filename, &entry);
 
-  if ((fd = open(filename, O_WRONLY)) == -1) { // Open file filename
+  if (status < 0) { // Get an open descriptor for file filename
+    return status;
+  }
+
+  if (!file_entry_writable(entry)) {
+    file_cache_release(cache, entry);
+    return -EACCES;
+  }
+
+  if (file_cache_lock(cache, entry, offset, bufsize, 1) != 0) {
+    file_cache_release(cache, entry);
+    return -ENOMEM;
+  }
+
+  // Write bufsize bytes from the buffer to the file
+  if ((bytes_written =
+           pwrite(file_entry_fd(entry), buffer, bufsize, offset)) == -1) {
+    bytes_written = -errno;
     warn("%s", filename);
-    return -errno;
   }
 
-  if (lseek(fd, offset, SEEK_SET) == -1) { // Change the file offset
+  file_cache_unlock(cache, entry, offset, bufsize, 1);
+  file_cache_release(cache, entry);
+
+  return bytes_written;
+}
+
+// Send the header and count bytes of a file from a mapped window of the file
+// in a single system call. Returns the number of bytes sent including the
+// header, or -1 if nothing was sent and the caller should read the file
+// instead. A file truncated underneath the mapping makes sendmsg() fail with
+// EFAULT rather than raise SIGBUS.
+int64_t send_mapped(FileCache cache, FileEntry entry, int connfd,
+                    uint64_t offset, uint64_t count, uint8_t *header,
+                    uint16_t header_length) {
+  uint8_t *data;
+  FileWindow window = file_cache_map(cache, entry, offset, count, &data);
+  struct iovec iov[2];
+  struct msghdr msg;
+  uint64_t total = 0;
+  ssize_t bytes_sent;
+
+  if (window == NULL) {
+    return -1;
+  }
+
+  iov[0].iov_base = header;
+  iov[0].iov_len = header_length;
+  iov[1].iov_base = data;
+  iov[1].iov_len = count;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = iov;
+  msg.msg_iovlen = 2;
+
+  if (file_cache_lock(cache, entry, offset, count, 0) != 0) {
+    file_cache_unmap(cache, window);
+    return -1;
+  }
+
+  while (total < header_length + count) {
+    bytes_sent = sendmsg(connfd, &msg, 0);
+
+    if (bytes_sent == -1 && errno == EINTR) {
+      continue;
+    }
+
+    if (bytes_sent <= 0) {
+      break;
+    }
+
+    total += bytes_sent;
+
+    // Skip past whatever went out before sending the rest
+    while (msg.msg_iovlen > 0 && (size_t)bytes_sent >= msg.msg_iov->iov_len) {
+      bytes_sent -= msg.msg_iov->iov_len;
+      msg.msg_iov++;
+      msg.msg_iovlen--;
+    }
+    if (msg.msg_iovlen > 0) {
+      msg.msg_iov->iov_base = (uint8_t *)msg.msg_iov->iov_base + bytes_sent;
+      msg.msg_iov->iov_len -= bytes_sent;
+    }
+  }
+
+  file_cache_unlock(cache, entry, offset, count, 0);
+  file_cache_unmap(cache, window);
+
+  return total > 0 ? (int64_t)total : -1;
+}
+
+// Send count bytes at a specific offset from a file straight to a socket,
+// at most chunk bytes per system call.
+// The header is sent ahead of the file data once the file has been checked,
+// so a negative errno return means nothing was sent at all.
+// If checksum is not NULL the data is copied through a buffer instead and
+// the CRC32C of the bytes sent is added to *checksum.
+int64_t send_file(FileCache cache, char *filename, int connfd, uint64_t offset,
+                  uint64_t count, uint64_t chunk, uint8_t *header,
+                  uint16_t header_length, uint32_t *checksum) {
+  FileEntry entry;
+  int64_t status = file_cache_acquire(cache, filename, &entry);
+  uint8_t buffer[BUFFER_SIZE];
+  uint8_t *data = buffer;
+  uint64_t size = BUFFER_SIZE;
+  uint64_t bytes_remaining = count;
+  uint64_t length;
+  off_t position = offset;
+  off_t start;
+  ssize_t bytes_sent = 0;
+
+  if (status < 0) { // Get an open descriptor for file filename
+    return status;
+  }
+
+  if (!file_entry_readable(entry)) {
+    file_cache_release(cache, entry);
+    return -EACCES;
+  }
+
+  // Check if the offset is greater than the filesize of the file
+  if (offset > file_entry_size(entry)) {
+    file_cache_release(cache, entry);
+    return -EINVAL;
+  }
+
+  // Small reads of hot files are sent straight from a mapping of the file
+  if (checksum == NULL && count > 0 && count <= MMAP_READ_SIZE &&
+      (status = send_mapped(cache, entry, connfd, offset, count, header,
+                            header_length)) >= 0) {
+    if (status < header_length) {
+      file_cache_release(cache, entry);
+      return 0; // The connection broke part way through the header
+    }
+    bytes_remaining -= status - header_length;
+    position += status - header_length;
+  } else if (send_loop(connfd, header, header_length,
+                       count > 0 ? MSG_MORE : 0) == -1) {
+    // Hold the header back until the file data follows it
+    status = -errno;
+    file_cache_release(cache, entry);
+    return status;
+  }
+
+  // Let the kernel move the data from the page cache to the socket
+  // Each chunk is locked on its own so that a slow client cannot hold off
+  // writers to the rest of the range
+  while (checksum == NULL && bytes_remaining > 0) {
+    length = bytes_remaining > chunk ? chunk : bytes_remaining;
+    start = position;
+    file_cache_advise(cache, entry, connfd, start, length);
+    if (file_cache_lock(cache, entry, start, length, 0) != 0) {
+      errno = ENOMEM;
+      bytes_sent = -1;
+      break;
+    }
+    bytes_sent = sendfile(connfd, file_entry_fd(entry), &position, length);
+    file_cache_unlock(cache, entry, start, length, 0);
+
+    if (bytes_sent == -1 && errno == EINTR) {
+      continue;
+    }
+
+    if (bytes_sent <= 0) {
+      break;
+    }
+
+    // Do not let one bulk copy evict the pages everyone else is reading
+    if (count >= BULK_READ_SIZE) {
+      file_cache_drop_behind(cache, entry, start, bytes_sent);
+    }
+
+    bytes_remaining -= bytes_sent;
+  }
+
+  // Copy through a buffer if the file does not support sendfile() or the
+  // bytes have to be checksummed on the way out
+  if (checksum != NULL ||
+      (bytes_sent == -1 && (errno == EINVAL || errno == ENOSYS) &&
+       bytes_remaining == count)) {
+    if (checksum != NULL && count > BUFFER_SIZE) {
+      size = count < chunk ? count : chunk;
+      size = size < DEFAULT_CHUNK_SIZE ? size : DEFAULT_CHUNK_SIZE;
+      if ((data = (uint8_t *)malloc(size)) == NULL) {
+        data = buffer;
+        size = BUFFER_SIZE;
+      }
+    }
+
+    while (bytes_remaining > 0) {
+      length = bytes_remaining > size ? size : bytes_remaining;
+      file_cache_advise(cache, entry, connfd, position, length);
+      if (file_cache_lock(cache, entry, position, length, 0) != 0) {
+        errno = ENOMEM;
+        bytes_sent = -1;
+        break;
+      }
+      bytes_sent = pread(file_entry_fd(entry), data, length, position);
+      file_cache_unlock(cache, entry, position, length, 0);
+
+      // A short send would leave the checksum covering bytes never sent
+      if (bytes_sent <= 0 ||
+          send_loop(connfd, data, bytes_sent,
+                    (uint64_t)bytes_sent < bytes_remaining ? MSG_MORE : 0) ==
+              -1) {
+        break;
+      }
+
+      if (checksum != NULL) {
+        *checksum = crc32c(*checksum, data, bytes_sent);
+      }
+
+      bytes_remaining -= bytes_sent;
+      position += bytes_sent;
+    }
+
+    if (data != buffer) {
+      free(data);
+    }
+  }
+
+  if (bytes_sent == -1) {
     warn("%s", filename);
-    return -errno;
   }
 
-  // Write bufsize bytes from the buffer to the file
-  if ((bytes_written = write(fd, buffer, bufsize)) == -1) {
+  file_cache_release(cache, entry);
+
+  return count - bytes_remaining;
+}
+
+// Move bytes from a socket to a file through a pipe without copying them
+// into user space. remaining is reduced by the number of bytes taken off the
+// socket. Returns (0) when splice() is not supported so that the caller can
+// receive the rest through a buffer. The caller holds the range locked.
+int64_t splice_file(FileEntry entry, char *filename, int connfd,
+                    uint64_t offset, uint64_t count, uint64_t chunk,
+                    uint64_t *remaining) {
+  uint8_t scratch[BUFFER_SIZE];
+  int64_t status = 0;
+  ssize_t bytes_in = 0;
+  ssize_t bytes_out = 0;
+  loff_t position;
+  int pipefd[2];
+
+  if (pipe(pipefd) == -1) {
+    return 0;
+  }
+
+  // Let each splice() carry up to a chunk; the kernel keeps the old size if
+  // the request is above its limit
+  if (chunk > PIPE_SIZE) {
+    chunk = PIPE_SIZE;
+  }
+  fcntl(pipefd[1], F_SETPIPE_SZ, chunk);
+
+  while (*remaining > 0) {
+    bytes_in = splice(connfd, NULL, pipefd[1], NULL,
+                      *remaining > chunk ? chunk : *remaining,
+                      SPLICE_F_MOVE | SPLICE_F_MORE);
+
+    if (bytes_in == -1 && errno == EINTR) {
+      continue;
+    }
+
+    if (bytes_in == -1 && (errno == EINVAL || errno == ENOSYS) &&
+        *remaining == count) {
+      break; // Not supported for this socket or file
+    }
+
+    if (bytes_in <= 0) {
+      status = bytes_in == 0 ? -ECONNRESET : -errno;
+      break;
+    }
+
+    position = offset + count - *remaining;
+    *remaining -= bytes_in;
+
+    while (bytes_in > 0) {
+      bytes_out = splice(pipefd[0], NULL, file_entry_fd(entry), &position,
+                         bytes_in, SPLICE_F_MOVE);
+
+      if (bytes_out == -1 && errno == EINTR) {
+        continue;
+      }
+
+      if (bytes_out <= 0) {
+        status = bytes_out == 0 ? -EIO : -errno;
+        warn("%s", filename);
+        break;
+      }
+
+      bytes_in -= bytes_out;
+    }
+
+    if (status < 0) {
+      // Empty the pipe so that the rest of the payload can still be drained
+      while (bytes_in > 0 &&
+             (bytes_out = read(pipefd[0], scratch,
+                               bytes_in > BUFFER_SIZE ? BUFFER_SIZE
+                                                      : bytes_in)) > 0) {
+        bytes_in -= bytes_out;
+      }
+      break;
+    }
+  }
+
+  close(pipefd[0]);
+  close(pipefd[1]);
+
+  return status;
+}
+
+// Receive count bytes from a socket and write them to a file at a specific
+// offset, at most chunk bytes at a time.
+// The whole range stays locked until the last byte is written, so overlapping
+// writes land one after the other instead of interleaving.
+// All count bytes are consumed from the socket even if the write fails, so
+// the connection stays in step with the client.
+// If checksum is not NULL the CRC32C of the bytes received is added to it.
+int64_t recv_file(FileCache cache, char *filename, int connfd, uint64_t offset,
+                  uint64_t count, uint64_t chunk, uint32_t *checksum) {
+  FileEntry entry = NULL;
+  int64_t status = file_cache_acquire(cache, filename, &entry);
+  uint64_t length = count > chunk ? chunk : count;
+  uint8_t scratch[BUFFER_SIZE];
+  uint8_t *data = scratch;
+  uint64_t bytes_remaining = count;
+  uint64_t start;
+  int64_t bytes_received = 0;
+  int64_t bytes_written = 0;
+  uint8_t locked;
+
+  if (status == 0 && !file_entry_writable(entry)) {
+    status = -EACCES;
+  }
+
+  if (status == 0 && file_cache_lock(cache, entry, offset, count, 1) != 0) {
+    status = -ENOMEM;
+  }
+  locked = status == 0;
+
+  // Large payloads go from the socket to the file through a pipe unless the
+  // bytes have to be seen to be checksummed
+  if (status == 0 && count >= SPLICE_THRESHOLD && checksum == NULL) {
+    status = splice_file(entry, filename, connfd, offset, count, chunk,
+                         &bytes_remaining);
+  }
+
+  if (bytes_remaining < length) {
+    length = bytes_remaining;
+  }
+
+  // Receive anything left over straight into an aligned buffer
+  if (status != 0 || length <= BUFFER_SIZE ||
+      posix_memalign((void **)&data, BUFFER_SIZE, length) != 0) {
+    data = scratch;
+    length = BUFFER_SIZE;
+  }
+
+  while (bytes_remaining > 0) {
+    if (length > bytes_remaining) {
+      length = bytes_remaining;
+    }
+
+    bytes_received = recv_loop(connfd, data, length);
+
+    if (bytes_received <= 0) {
+      if (status == 0) {
+        status = -ECONNRESET;
+      }
+      break;
+    }
+
+    if (checksum != NULL) {
+      *checksum = crc32c(*checksum, data, bytes_received);
+    }
+
+    // Keep draining the socket once the write has failed
+    if (status == 0) {
+      start = offset + count - bytes_remaining;
+
+      for (int64_t total = 0; status == 0 && total < bytes_received;
+           total += bytes_written) {
+        bytes_written = pwrite(file_entry_fd(entry), data + total,
+                               bytes_received - total, start + total);
+
+        if (bytes_written == -1) {
+          status = -errno;
+          warn("%s", filename);
+        }
+      }
+    }
+
+    bytes_remaining -= bytes_received;
+
+    if ((uint64_t)bytes_received < length) {
+      if (status == 0) {
+        status = -ECONNRESET;
+      }
+      break;
+    }
+  }
+
+  if (data != scratch) {
+    free(data);
+  }
+
+  if (locked) {
+    file_cache_unlock(cache, entry, offset, count, 1);
+  }
+
+  if (entry != NULL) {
+    file_cache_release(cache, entry);
+  }
+
+  if (status < 0) {
+    return status;
+  }
+
+  return count - bytes_remaining;
+}
+
+// Send count bytes at a specific offset from a file to a socket, reading the
+// file with O_DIRECT into an aligned buffer so that the page cache is left
+// alone. Unaligned offsets are read from the start of their block and the
+// extra bytes are skipped. Falls back to send_file() if the file system or
+// the buffer pool cannot do direct I/O.
+int64_t send_file_direct(FileCache cache, BufferPool pool, char *filename,
+                         int connfd, uint64_t offset, uint64_t count,
+                         uint64_t chunk, uint8_t *header,
+                         uint16_t header_length, uint32_t *checksum) {
+  FileEntry entry;
+  int64_t status = file_cache_acquire(cache, filename, &entry);
+  uint64_t align = buffer_pool_alignment(pool);
+  uint64_t limit = buffer_pool_buffer_size(pool);
+  uint64_t bytes_remaining = count;
+  uint64_t position;
+  uint64_t start;
+  uint64_t skip;
+  uint64_t length;
+  uint64_t wanted;
+  ssize_t bytes_read = 0;
+  ssize_t bytes_sent = 0;
+  uint8_t *buffer;
+  int fd;
+
+  if (status < 0) { // Get an open descriptor for file filename
+    return status;
+  }
+
+  if (!file_entry_readable(entry)) {
+    file_cache_release(cache, entry);
+    return -EACCES;
+  }
+
+  if (offset > file_entry_size(entry)) {
+    file_cache_release(cache, entry);
+    return -EINVAL;
+  }
+
+  fd = file_entry_direct_fd(cache, entry);
+  buffer = fd >= 0 && align > 0 ? buffer_pool_get(pool) : NULL;
+
+  if (buffer == NULL) {
+    file_cache_release(cache, entry);
+    return send_file(cache, filename, connfd, offset, count, chunk, header,
+                     header_length, checksum);
+  }
+
+  if (chunk < limit) {
+    limit = chunk;
+  }
+  limit &= ~(align - 1);
+
+  // Hold the header back until the file data follows it
+  if (send_loop(connfd, header, header_length, count > 0 ? MSG_MORE : 0) ==
+      -1) {
+    status = -errno;
+    buffer_pool_put(pool, buffer);
+    file_cache_release(cache, entry);
+    return status;
+  }
+
+  while (bytes_remaining > 0) {
+    position = offset + count - bytes_remaining;
+    start = position & ~(align - 1);
+    skip = position - start;
+    length = bytes_remaining + skip < limit ? bytes_remaining + skip : limit;
+    length = (length + align - 1) & ~(align - 1);
+    wanted = length - skip < bytes_remaining ? length - skip : bytes_remaining;
+
+    if (file_cache_lock(cache, entry, position, wanted, 0) != 0) {
+      errno = ENOMEM;
+      bytes_read = -1;
+      break;
+    }
+    bytes_read = pread(fd, buffer, length, start);
+    if (bytes_read == -1 && errno == EINVAL) {
+      bytes_read = pread(file_entry_fd(entry), buffer, length, start);
+    }
+    file_cache_unlock(cache, entry, position, wanted, 0);
+
+    if (bytes_read == -1 && errno == EINTR) {
+      continue;
+    }
+
+    if (bytes_read <= (ssize_t)skip) {
+      break; // Read error or the file shrank
+    }
+
+    if ((uint64_t)bytes_read - skip < wanted) {
+      wanted = bytes_read - skip;
+    }
+
+    for (uint64_t total = 0; total < wanted; total += bytes_sent) {
+      bytes_sent = send(connfd, buffer + skip + total, wanted - total,
+                        bytes_remaining > wanted ? MSG_MORE : 0);
+      if (bytes_sent == -1 && errno == EINTR) {
+        bytes_sent = 0;
+      } else if (bytes_sent <= 0) {
+        break;
+      }
+    }
+
+    if (bytes_sent <= 0) {
+      break;
+    }
+
+    if (checksum != NULL) {
+      *checksum = crc32c(*checksum, buffer + skip, wanted);
+    }
+
+    bytes_remaining -= wanted;
+  }
+
+  if (bytes_read == -1) {
     warn("%s", filename);
-    return -errno;
   }
 
-  if (close(fd) == -1) { // Close file filename
+  buffer_pool_put(pool, buffer);
+  file_cache_release(cache, entry);
+
+  return count - bytes_remaining;
+}
+
+// Receive count bytes from a socket and write them to a file at a specific
+// offset with O_DIRECT, bypassing the page cache. The aligned middle of the
+// range goes through an aligned buffer and the descriptor opened with
+// O_DIRECT, while an unaligned head or tail is written through the ordinary
+// descriptor. Falls back to recv_file() if direct I/O is not available.
+int64_t recv_file_direct(FileCache cache, BufferPool pool, char *filename,
+                         int connfd, uint64_t offset, uint64_t count,
+                         uint64_t chunk, uint32_t *checksum) {
+  FileEntry entry = NULL;
+  int64_t status = file_cache_acquire(cache, filename, &entry);
+  uint64_t align = buffer_pool_alignment(pool);
+  uint64_t limit = buffer_pool_buffer_size(pool);
+  uint64_t bytes_remaining = count;
+  uint64_t position;
+  uint64_t length;
+  int64_t bytes_written = 0;
+  uint8_t *buffer = NULL;
+  uint8_t locked;
+  int target;
+  int fd = -1;
+
+  if (status == 0 && file_entry_writable(entry)) {
+    fd = file_entry_direct_fd(cache, entry);
+    buffer = fd >= 0 && align > 0 ? buffer_pool_get(pool) : NULL;
+  }
+
+  // recv_file() reports the error and drains the socket if anything is wrong
+  if (buffer == NULL) {
+    if (entry != NULL) {
+      file_cache_release(cache, entry);
+    }
+    return recv_file(cache, filename, connfd, offset, count, chunk, checksum);
+  }
+
+  if (chunk < limit) {
+    limit = chunk;
+  }
+  limit &= ~(align - 1);
+
+  // Hold the whole range until the last byte is written, as recv_file() does
+  if (file_cache_lock(cache, entry, offset, count, 1) != 0) {
+    status = -ENOMEM;
+  }
+  locked = status == 0;
+
+  while (bytes_remaining > 0) {
+    position = offset + count - bytes_remaining;
+
+    if (position & (align - 1)) { // Unaligned head
+      length = align - (position & (align - 1));
+      if (length > bytes_remaining) {
+        length = bytes_remaining;
+      }
+      target = file_entry_fd(entry);
+    } else if (bytes_remaining >= align) { // Aligned middle
+      length = bytes_remaining < limit ? bytes_remaining : limit;
+      length &= ~(align - 1);
+      target = fd;
+    } else { // Unaligned tail
+      length = bytes_remaining;
+      target = file_entry_fd(entry);
+    }
+
+    if (recv_loop(connfd, buffer, length) != (int)length) {
+      if (status == 0) {
+        status = -ECONNRESET;
+      }
+      break;
+    }
+
+    if (checksum != NULL) {
+      *checksum = crc32c(*checksum, buffer, length);
+    }
+
+    // Keep draining the socket once the write has failed
+    if (status == 0) {
+      for (uint64_t total = 0; status == 0 && total < length;
+           total += bytes_written) {
+        bytes_written = pwrite(target, buffer + total, length - total,
+                               position + total);
+
+        if (bytes_written == -1 && errno == EINVAL && target == fd) {
+          target = file_entry_fd(entry); // Not aligned enough for the device
+          bytes_written = 0;
+        } else if (bytes_written == -1) {
+          status = -errno;
+          warn("%s", filename);
+        }
+      }
+    }
+
+    bytes_remaining -= length;
+  }
+
+  if (locked) {
+    file_cache_unlock(cache, entry, offset, count, 1);
+  }
+
+  buffer_pool_put(pool, buffer);
+  file_cache_release(cache, entry);
+
+  if (status < 0) {
+    return status;
+  }
+
+  return count - bytes_remaining;
+}
+
+// Lock the source and destination ranges of one copy step, always taking the
+// lower file and offset first so that two copies in opposite directions
+// cannot wait on each other. Returns ENOMEM with neither range held if a lock
+// could not be taken.
+uint8_t copy_lock(FileCache cache, FileEntry source, uint64_t source_offset,
+                  FileEntry destination, uint64_t destination_offset,
+                  uint64_t length, uint8_t unlock) {
+  int8_t order = file_entry_compare(source, destination);
+  uint8_t source_first =
+      order < 0 || (order == 0 && source_offset < destination_offset);
+
+  if (unlock) {
+    file_cache_unlock(cache, source, source_offset, length, 0);
+    file_cache_unlock(cache, destination, destination_offset, length, 1);
+  } else if (source_first) {
+    if (file_cache_lock(cache, source, source_offset, length, 0) != 0) {
+      return ENOMEM;
+    }
+    if (file_cache_lock(cache, destination, destination_offset, length, 1) !=
+        0) {
+      file_cache_unlock(cache, source, source_offset, length, 0);
+      return ENOMEM;
+    }
+  } else {
+    if (file_cache_lock(cache, destination, destination_offset, length, 1) !=
+        0) {
+      return ENOMEM;
+    }
+    if (file_cache_lock(cache, source, source_offset, length, 0) != 0) {
+      file_cache_unlock(cache, destination, destination_offset, length, 1);
+      return ENOMEM;
+    }
+  }
+  return 0;
+}
+
+// Copy count bytes between two files on the server without passing them
+// through user space, at most chunk bytes per step. copy_file_range() lets
+// file systems that support it share the extents instead of copying them.
+// The copy stops early at the end of the source file.
+int64_t copy_file(FileCache cache, char *source, char *destination,
+                  uint64_t source_offset, uint64_t destination_offset,
+                  uint64_t count, uint64_t chunk) {
+  FileEntry in = NULL;
+  FileEntry out = NULL;
+  uint8_t buffer[BUFFER_SIZE];
+  uint64_t bytes_remaining;
+  uint64_t length;
+  uint64_t start;
+  loff_t in_position;
+  loff_t out_position;
+  ssize_t bytes_copied = 0;
+  ssize_t bytes_written = 0;
+  uint8_t emulate = 0;
+  int64_t status = file_cache_acquire(cache, source, &in);
+
+  if (status < 0) { // Get an open descriptor for the source file
+    return status;
+  }
+
+  if ((status = file_cache_acquire(cache, destination, &out)) < 0) {
+    file_cache_release(cache, in);
+    return status;
+  }
+
+  if (!file_entry_readable(in) || !file_entry_writable(out)) {
+    status = -EACCES;
+  } else if (source_offset > file_entry_size(in)) {
+    status = -EINVAL;
+  } else if (count > file_entry_size(in) - source_offset) {
+    count = file_entry_size(in) - source_offset;
+  }
+
+  // A file cannot be copied onto an overlapping range of itself
+  if (status == 0 && file_entry_compare(in, out) == 0 &&
+      source_offset < destination_offset + count &&
+      destination_offset < source_offset + count) {
+    status = -EINVAL;
+  }
+
+  bytes_remaining = status == 0 ? count : 0;
+
+  while (bytes_remaining > 0) {
+    length = bytes_remaining > chunk ? chunk : bytes_remaining;
+    start = count - bytes_remaining;
+    in_position = source_offset + start;
+    out_position = destination_offset + start;
+    if (copy_lock(cache, in, source_offset + start, out,
+                  destination_offset + start, length, 0) != 0) {
+      status = -ENOMEM;
+      break;
+    }
+
+    if (!emulate) {
+      bytes_copied = copy_file_range(file_entry_fd(in), &in_position,
+                                     file_entry_fd(out), &out_position, length,
+                                     0);
+
+      // Copy through a buffer between file systems that cannot do it
+      if (bytes_copied == -1 &&
+          (errno == EXDEV || errno == ENOSYS || errno == EOPNOTSUPP ||
+           errno == EINVAL)) {
+        emulate = 1;
+      }
+    }
+
+    if (emulate) {
+      bytes_copied = pread(file_entry_fd(in), buffer,
+                           length > BUFFER_SIZE ? BUFFER_SIZE : length,
+                           in_position);
+
+      for (ssize_t total = 0; bytes_copied > 0 && total < bytes_copied;
+           total += bytes_written) {
+        bytes_written = pwrite(file_entry_fd(out), buffer + total,
+                               bytes_copied - total, out_position + total);
+        if (bytes_written == -1) {
+          bytes_copied = -1;
+        }
+      }
+    }
+
+    status = bytes_copied == -1 ? -errno : 0;
+    copy_lock(cache, in, source_offset + start, out, destination_offset + start,
+              length, 1);
+
+    if (status == -EINTR) {
+      status = 0;
+      continue;
+    }
+
+    if (status < 0) {
+      errno = -status;
+      warn("%s", destination);
+      break;
+    }
+
+    if (bytes_copied == 0) {
+      break; // The source file shrank
+    }
+
+    bytes_remaining -= bytes_copied;
+  }
+
+  file_cache_release(cache, out);
+  file_cache_release(cache, in);
+
+  if (status < 0) {
+    return status;
+  }
+
+  return count - bytes_remaining;
+}
+
+// Send count bytes at a specific offset from a file to a socket as a series
+// of compressed frames. Each frame is a u32 compressed length, a u32 raw
+// length and the block. Blocks that do not shrink are sent as they are with
+// FRAME_STORED set in the compressed length.
+// If checksum is not NULL the CRC32C of the raw bytes is added to it.
+int64_t send_file_compressed(FileCache cache, char *filename, int connfd,
+                             uint64_t offset, uint64_t count, uint8_t *header,
+                             uint16_t header_length, uint32_t *checksum) {
+  FileEntry entry;
+  int64_t status = file_cache_acquire(cache, filename, &entry);
+  uint64_t capacity = compress_bound(COMPRESS_BLOCK_SIZE);
+  uint64_t bytes_remaining = count;
+  uint64_t position = offset;
+  uint64_t length;
+  uint64_t packed_length;
+  ssize_t bytes_read = 0;
+  uint8_t frame[8];
+  uint8_t *raw;
+  uint8_t *packed;
+  uint8_t *payload;
+
+  if (status < 0) { // Get an open descriptor for file filename
+    return status;
+  }
+
+  if (!file_entry_readable(entry)) {
+    file_cache_release(cache, entry);
+    return -EACCES;
+  }
+
+  if (offset > file_entry_size(entry)) {
+    file_cache_release(cache, entry);
+    return -EINVAL;
+  }
+
+  raw = (uint8_t *)malloc(COMPRESS_BLOCK_SIZE);
+  packed = (uint8_t *)malloc(capacity);
+
+  if (raw == NULL || packed == NULL ||
+      send_loop(connfd, header, header_length, count > 0 ? MSG_MORE : 0) ==
+          -1) {
+    status = raw == NULL || packed == NULL ? -ENOMEM : -errno;
+    free(raw);
+    free(packed);
+    file_cache_release(cache, entry);
+    return status;
+  }
+
+  while (bytes_remaining > 0) {
+    length = bytes_remaining > COMPRESS_BLOCK_SIZE ? COMPRESS_BLOCK_SIZE
+                                                   : bytes_remaining;
+    file_cache_advise(cache, entry, connfd, position, length);
+    if (file_cache_lock(cache, entry, position, length, 0) != 0) {
+      errno = ENOMEM;
+      bytes_read = -1;
+      break;
+    }
+    bytes_read = pread(file_entry_fd(entry), raw, length, position);
+    file_cache_unlock(cache, entry, position, length, 0);
+
+    if (bytes_read == -1 && errno == EINTR) {
+      continue;
+    }
+
+    if (bytes_read <= 0) {
+      break;
+    }
+
+    if (checksum != NULL) {
+      *checksum = crc32c(*checksum, raw, bytes_read);
+    }
+
+    packed_length = compress_block(raw, bytes_read, packed, capacity);
+
+    if (packed_length == 0 || packed_length >= (uint64_t)bytes_read) {
+      uint32_to_wire(frame, 0, 3, bytes_read | FRAME_STORED);
+      payload = raw;
+      packed_length = bytes_read;
+    } else {
+      uint32_to_wire(frame, 0, 3, packed_length);
+      payload = packed;
+    }
+    uint32_to_wire(frame, 4, 7, bytes_read);
+
+    if (send_loop(connfd, frame, 8, MSG_MORE) == -1 ||
+        send_loop(connfd, payload, packed_length,
+                  (uint64_t)bytes_read < bytes_remaining ? MSG_MORE : 0) ==
+            -1) {
+      break;
+    }
+
+    bytes_remaining -= bytes_read;
+    position += bytes_read;
+  }
+
+  if (bytes_read == -1) {
     warn("%s", filename);
-    return -errno;
   }
 
-  return bytes_written;
+  free(raw);
+  free(packed);
+  file_cache_release(cache, entry);
+
+  return count - bytes_remaining;
+}
+
+// Receive count bytes as compressed frames from a socket, as sent by
+// send_file_compressed(), and write them to a file at a specific offset.
+// Frames keep being consumed after the write fails, so the connection stays
+// in step with the client. Returns -EPROTO if a frame header is malformed,
+// after which the connection cannot be trusted.
+// If checksum is not NULL the CRC32C of the raw bytes is added to it.
+int64_t recv_file_compressed(FileCache cache, char *filename, int connfd,
+                             uint64_t offset, uint64_t count,
+                             uint32_t *checksum) {
+  FileEntry entry = NULL;
+  int64_t status = file_cache_acquire(cache, filename, &entry);
+  uint64_t capacity = compress_bound(COMPRESS_BLOCK_SIZE);
+  uint64_t bytes_remaining = count;
+  uint64_t position;
+  uint32_t packed_length;
+  uint32_t length;
+  uint8_t stored;
+  int64_t bytes_written = 0;
+  uint8_t frame[8];
+  uint8_t *raw = (uint8_t *)malloc(COMPRESS_BLOCK_SIZE);
+  uint8_t *packed = (uint8_t *)malloc(capacity);
+  uint8_t locked;
+
+  if (status == 0 && !file_entry_writable(entry)) {
+    status = -EACCES;
+  }
+
+  if (status == 0 && (raw == NULL || packed == NULL)) {
+    status = -ENOMEM;
+  }
+
+  // Hold the whole range until the last byte is written, as recv_file() does
+  if (status == 0 && file_cache_lock(cache, entry, offset, count, 1) != 0) {
+    status = -ENOMEM;
+  }
+  locked = status == 0;
+
+  while (bytes_remaining > 0) {
+    if (recv_loop(connfd, frame, 8) != 8) {
+      status = -ECONNRESET;
+      break;
+    }
+
+    packed_length = wire_to_uint32(frame, 0, 3);
+    length = wire_to_uint32(frame, 4, 7);
+    stored = (packed_length & FRAME_STORED) != 0;
+    packed_length &= ~FRAME_STORED;
+
+    if (length == 0 || length > COMPRESS_BLOCK_SIZE ||
+        length > bytes_remaining ||
+        (stored ? packed_length != length
+                : packed_length > compress_bound(length))) {
+      status = -EPROTO;
+      break;
+    }
+
+    // Keep draining the socket once the write has failed
+    if (status != 0) {
+      if (recv_discard(connfd, packed_length) != packed_length) {
+        status = -ECONNRESET;
+        break;
+      }
+      bytes_remaining -= length;
+      continue;
+    }
+
+    if (recv_loop(connfd, stored ? raw : packed, packed_length) !=
+        (int)packed_length) {
+      status = -ECONNRESET;
+      break;
+    }
+
+    if (!stored &&
+        decompress_block(packed, packed_length, raw, length) != length) {
+      status = -EINVAL;
+      bytes_remaining -= length;
+      continue;
+    }
+
+    if (checksum != NULL) {
+      *checksum = crc32c(*checksum, raw, length);
+    }
+
+    position = offset + count - bytes_remaining;
+
+    for (uint32_t total = 0; status == 0 && total < length;
+         total += bytes_written) {
+      bytes_written = pwrite(file_entry_fd(entry), raw + total, length - total,
+                             position + total);
+
+      if (bytes_written == -1) {
+        status = -errno;
+        warn("%s", filename);
+      }
+    }
+
+    bytes_remaining -= length;
+  }
+
+  if (locked) {
+    file_cache_unlock(cache, entry, offset, count, 1);
+  }
+
+  free(raw);
+  free(packed);
+
+  if (entry != NULL) {
+    file_cache_release(cache, entry);
+  }
+
+  if (status < 0) {
+    return status;
+  }
+
+  return count - bytes_remaining;
 }
 
 // Create a new file
@@ -101,27 +1114,63 @@ int64_t create(char *filename) {
   return 0;
 }
 
-// Get the size of a file
-int64_t filesize(char *filename) {
+// Create a new file and reserve size bytes of disk space for it up front so
+// that the writes which fill it in land in contiguous extents.
+// With CREATE_KEEP_SIZE the space is reserved past the end of an empty file.
+// The file is removed again if the space cannot be reserved.
+int64_t create_preallocated(char *filename, uint64_t size, uint8_t flags) {
   int fd;
-  struct stat st;
-  stat(filename, &st);
+  int status = 0;
+
+  if ((flags & ~CREATE_KEEP_SIZE) != 0 || size > INT64_MAX) {
+    return EINVAL;
+  }
 
-  if ((fd = open(filename, O_RDONLY, 0)) == -1) { // Open file filename
+  if ((fd = open(filename, O_CREAT | O_EXCL | O_WRONLY, 0644)) == -1) {
     warn("%s", filename);
-    return -errno;
+    return errno;
   }
 
-  // Check if an error occurred while getting the size of the file
-  if (st.st_size == -1) {
+  if (size > 0 &&
+      fallocate(fd, (flags & CREATE_KEEP_SIZE) ? FALLOC_FL_KEEP_SIZE : 0, 0,
+                size) == -1) {
+    status = errno;
+
+    // Reserving space is only a hint, so a file system that cannot do it
+    // still gets a file of the requested size
+    if (status == EOPNOTSUPP) {
+      status = 0;
+      if (!(flags & CREATE_KEEP_SIZE) && ftruncate(fd, size) == -1) {
+        status = errno;
+      }
+    }
+  }
+
+  if (status != 0) {
     warn("%s", filename);
-    return -errno;
+    unlink(filename);
   }
 
-  if (close(fd) == -1) { // Close file filename
+  if (close(fd) == -1 && status == 0) { // Close file filename
+    status = errno;
     warn("%s", filename);
-    return -errno;
   }
 
-  return st.st_size;
+  return status;
+}
+
+// Get the size of a file
+int64_t filesize(FileCache cache, char *filename) {
+  FileEntry entry;
+  int64_t status = file_cache_acquire(cache, filename, &entry);
+
+  if (status < 0) { // Get an open descriptor for file filename
+    return status;
+  }
+
+  int64_t size = file_entry_size(entry);
+
+  file_cache_release(cache, entry);
+
+  return size;
 }
@@ -1,14 +1,49 @@
 #ifndef __RPCFILE_H__
 #define __RPCFILE_H__
 
+#include "rpcbufferpool.h"
+#include "rpcfilecache.h"
 #include <cstdint>
 
-int64_t read(char *filename, uint64_t offset, uint16_t bufsize, uint8_t *buffer);
+#define DEFAULT_CHUNK_SIZE (1 << 20)
+#define MAX_CHUNK_SIZE (64 << 20)
+#define DEFAULT_READAHEAD (2 << 20)
+#define BULK_READ_SIZE (64 << 20)
+#define MMAP_READ_SIZE (64 << 10)
+#define DEFAULT_FILE_WINDOWS 16
+#define DIRECT_ALIGNMENT 4096
 
-int64_t write(char *filename, uint64_t offset, uint16_t bufsize, uint8_t *buffer);
+#define TRANSFER_DIRECT 0x01
+#define TRANSFER_CHECKSUM 0x02
+#define TRANSFER_COMPRESS 0x04
+#define TRANSFER_FLAGS (TRANSFER_DIRECT | TRANSFER_CHECKSUM | TRANSFER_COMPRESS)
+
+#define FRAME_STORED 0x80000000
+
+#define CREATE_KEEP_SIZE 0x01
+
+int64_t read(FileCache cache, char *filename, uint64_t offset, uint16_t bufsize, uint8_t *buffer);
+
+int64_t write(FileCache cache, char *filename, uint64_t offset, uint16_t bufsize, uint8_t *buffer);
+
+int64_t send_file(FileCache cache, char *filename, int connfd, uint64_t offset, uint64_t count, uint64_t chunk, uint8_t *header, uint16_t header_length, uint32_t *checksum);
+
+int64_t recv_file(FileCache cache, char *filename, int connfd, uint64_t offset, uint64_t count, uint64_t chunk, uint32_t *checksum);
+
+int64_t send_file_direct(FileCache cache, BufferPool pool, char *filename, int connfd, uint64_t offset, uint64_t count, uint64_t chunk, uint8_t *header, uint16_t header_length, uint32_t *checksum);
+
+int64_t recv_file_direct(FileCache cache, BufferPool pool, char *filename, int connfd, uint64_t offset, uint64_t count, uint64_t chunk, uint32_t *checksum);
+
+int64_t send_file_compressed(FileCache cache, char *filename, int connfd, uint64_t offset, uint64_t count, uint8_t *header, uint16_t header_length, uint32_t *checksum);
+
+int64_t recv_file_compressed(FileCache cache, char *filename, int connfd, uint64_t offset, uint64_t count, uint32_t *checksum);
+
+int64_t copy_file(FileCache cache, char *source, char *destination, uint64_t source_offset, uint64_t destination_offset, uint64_t count, uint64_t chunk);
 
 int64_t create(char *filename);
 
-int64_t filesize(char *filename);
+int64_t create_preallocated(char *filename, uint64_t size, uint8_t flags);
+
+int64_t filesize(FileCache cache, char *filename);
 
 #endif
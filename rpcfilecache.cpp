@@ -0,0 +1,933 @@
+#include "rpcfilecache.h"
+#include "rpcrangelock.h"
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <err.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define FILE_STREAMS 4
+#define FILE_WINDOW_SIZE (2 << 20) // One huge page on x86-64
+#define FILE_WINDOW_HITS 4 // Small reads of a window before it is mapped
+
+typedef struct FileStreamObj {
+  uint64_t client;
+  uint64_t next;
+  uint64_t run;
+  uint64_t readahead;
+} FileStreamObj;
+
+typedef struct FileWindowObj {
+  uint8_t *base;
+  uint64_t offset;
+  uint64_t length;
+  uint64_t refs;
+  uint8_t stale;
+  struct FileEntryObj *entry;
+  struct FileWindowObj *lru_prev;
+  struct FileWindowObj *lru_next;
+} FileWindowObj;
+
+typedef struct FileEntryObj {
+  char *path;
+  int fd;
+  int direct_fd;
+  uint8_t readable;
+  uint8_t writable;
+  uint8_t stale;
+  uint64_t refs;
+  dev_t dev;
+  ino_t ino;
+  uint64_t size;
+  struct timespec mtime;
+  uint8_t sequential;
+  uint8_t next_stream;
+  FileStreamObj streams[FILE_STREAMS];
+  FileWindow window;
+  uint64_t hot_window;
+  uint64_t hot_hits;
+  struct FileEntryObj *next;
+  struct FileEntryObj *lru_prev;
+  struct FileEntryObj *lru_next;
+} FileEntryObj;
+
+typedef struct FileCacheObj {
+  uint64_t size;
+  uint64_t num_entries;
+  uint64_t num_buckets;
+  FileEntry *buckets;
+  FileEntry head;
+  FileEntry tail;
+  uint64_t readahead;
+  uint64_t max_windows;
+  uint64_t num_windows;
+  FileWindow window_head;
+  FileWindow window_tail;
+  RangeLocks locks;
+  pthread_mutex_t mutex;
+} FileCacheObj;
+
+// Hash a path name into one of size buckets
+uint64_t path_hash(char *path, uint64_t size) {
+  uint64_t result = 0;
+
+  while (*path) {
+    result ^= (uint8_t)*path++;
+    result ^= result >> 33;
+    result *= 0xff51afd7ed558ccdL;
+    result ^= result >> 33;
+    result *= 0xc4ceb9fe1a85ec53L;
+    result ^= result >> 33;
+  }
+
+  return result % size;
+}
+
+// Input: path - the path the file was opened with
+// Input: fd - the open file descriptor
+// Input: readable - (1) if the descriptor was opened for reading
+// Input: writable - (1) if the descriptor was opened for writing
+// Input: st - the attributes of the open file
+// Output: entry - the newly created entry
+//
+// Create a new file cache entry
+FileEntry create_file_entry(char *path, int fd, uint8_t readable,
+                            uint8_t writable, struct stat *st) {
+  FileEntry entry = (FileEntryObj *)malloc(sizeof(FileEntryObj));
+  if (entry != NULL) {
+    entry->path = strdup(path);
+    if (entry->path == NULL) {
+      free(entry);
+      return NULL;
+    }
+    entry->fd = fd;
+    entry->direct_fd = -2;
+    entry->readable = readable;
+    entry->writable = writable;
+    entry->stale = 0;
+    entry->refs = 0;
+    entry->dev = st->st_dev;
+    entry->ino = st->st_ino;
+    entry->size = st->st_size;
+    entry->mtime = st->st_mtim;
+    entry->sequential = 0;
+    entry->next_stream = 0;
+    memset(entry->streams, 0, sizeof(entry->streams));
+    entry->window = NULL;
+    entry->hot_window = UINT64_MAX;
+    entry->hot_hits = 0;
+    entry->next = NULL;
+    entry->lru_prev = NULL;
+    entry->lru_next = NULL;
+  }
+  return entry;
+}
+
+// Input: ptr - pointer to the entry to be deleted
+// Output: none
+//
+// Close the file descriptor held by an entry and delete the entry
+void delete_file_entry(FileEntry *ptr) {
+  if (ptr != NULL && *ptr != NULL) {
+    FileEntry entry = *ptr;
+    if (close(entry->fd) == -1) {
+      warn("%s", entry->path);
+    }
+    if (entry->direct_fd >= 0 && close(entry->direct_fd) == -1) {
+      warn("%s", entry->path);
+    }
+    free(entry->path);
+    free(entry);
+    *ptr = NULL;
+  }
+  return;
+}
+
+// Input: cache - the file cache
+// Input: path - the path to search for
+// Output: the entry that was found or NULL
+//
+// Find the entry for a specific path in a file cache
+FileEntry file_cache_find(FileCache cache, char *path) {
+  FileEntry entry = cache->buckets[path_hash(path, cache->num_buckets)];
+  while (entry != NULL) {
+    if (strcmp(entry->path, path) == 0) {
+      return entry;
+    }
+    entry = entry->next;
+  }
+  return entry;
+}
+
+// Input: cache - the file cache
+// Input: entry - the entry to insert
+// Output: none
+//
+// Insert an entry into the hash table and at the front of the LRU list
+void file_cache_link(FileCache cache, FileEntry entry) {
+  uint64_t index = path_hash(entry->path, cache->num_buckets);
+  entry->next = cache->buckets[index];
+  cache->buckets[index] = entry;
+  entry->lru_prev = NULL;
+  entry->lru_next = cache->head;
+  if (cache->head != NULL) {
+    cache->head->lru_prev = entry;
+  }
+  cache->head = entry;
+  if (cache->tail == NULL) {
+    cache->tail = entry;
+  }
+  cache->num_entries++;
+  return;
+}
+
+// Input: cache - the file cache
+// Input: entry - the entry to remove
+// Output: none
+//
+// Remove an entry from the hash table and the LRU list
+void file_cache_unlink(FileCache cache, FileEntry entry) {
+  FileEntry *link = &(cache->buckets[path_hash(entry->path,
+                                               cache->num_buckets)]);
+  while (*link != NULL && *link != entry) {
+    link = &((*link)->next);
+  }
+  if (*link != NULL) {
+    *link = entry->next;
+  }
+  if (entry->lru_prev != NULL) {
+    entry->lru_prev->lru_next = entry->lru_next;
+  } else {
+    cache->head = entry->lru_next;
+  }
+  if (entry->lru_next != NULL) {
+    entry->lru_next->lru_prev = entry->lru_prev;
+  } else {
+    cache->tail = entry->lru_prev;
+  }
+  entry->next = NULL;
+  entry->lru_prev = NULL;
+  entry->lru_next = NULL;
+  cache->num_entries--;
+  return;
+}
+
+// Input: cache - the file cache
+// Input: entry - the entry that was used
+// Output: none
+//
+// Move an entry to the front of the LRU list
+void file_cache_touch(FileCache cache, FileEntry entry) {
+  if (cache->head == entry) {
+    return;
+  }
+  entry->lru_prev->lru_next = entry->lru_next;
+  if (entry->lru_next != NULL) {
+    entry->lru_next->lru_prev = entry->lru_prev;
+  } else {
+    cache->tail = entry->lru_prev;
+  }
+  entry->lru_prev = NULL;
+  entry->lru_next = cache->head;
+  cache->head->lru_prev = entry;
+  cache->head = entry;
+  return;
+}
+
+// Input: cache - the file cache
+// Input: window - the mapped window to take away from its entry
+// Output: none
+//
+// Remove a window from its entry and the window LRU list. The mapping is
+// undone now, or by the last reader still sending from it.
+void file_cache_detach(FileCache cache, FileWindow window) {
+  if (window->lru_prev != NULL) {
+    window->lru_prev->lru_next = window->lru_next;
+  } else {
+    cache->window_head = window->lru_next;
+  }
+  if (window->lru_next != NULL) {
+    window->lru_next->lru_prev = window->lru_prev;
+  } else {
+    cache->window_tail = window->lru_prev;
+  }
+  window->lru_prev = NULL;
+  window->lru_next = NULL;
+  window->entry->window = NULL;
+  window->entry = NULL;
+  cache->num_windows--;
+
+  if (window->refs == 0) {
+    munmap(window->base, window->length);
+    free(window);
+  } else {
+    window->stale = 1;
+  }
+  return;
+}
+
+// Input: cache - the file cache
+// Input: entry - an entry that has been removed from the cache
+// Output: none
+//
+// Delete a removed entry, or mark it stale if it is still in use
+void file_cache_drop(FileCache cache, FileEntry entry) {
+  if (entry->window != NULL) {
+    file_cache_detach(cache, entry->window);
+  }
+  file_cache_unlink(cache, entry);
+  if (entry->refs == 0) {
+    delete_file_entry(&entry);
+  } else {
+    entry->stale = 1;
+  }
+  return;
+}
+
+// Input: cache - the file cache
+// Output: none
+//
+// Close least recently used descriptors until the cache is within its limit
+void file_cache_evict(FileCache cache) {
+  FileEntry entry = cache->tail;
+  while (cache->num_entries > cache->size && entry != NULL) {
+    FileEntry prev = entry->lru_prev;
+    if (entry->refs == 0) {
+      file_cache_drop(cache, entry);
+    }
+    entry = prev;
+  }
+  return;
+}
+
+// Input: filename - the file to open
+// Input: readable - set to (1) if the file was opened for reading
+// Input: writable - set to (1) if the file was opened for writing
+// Output: the file descriptor or -1 if the file could not be opened
+//
+// Open a file with the widest access mode that the permissions allow
+int file_cache_open(char *filename, uint8_t *readable, uint8_t *writable) {
+  int fd;
+
+  *readable = 1;
+  *writable = 1;
+
+  if ((fd = open(filename, O_RDWR)) != -1) {
+    return fd;
+  }
+
+  if (errno != EACCES && errno != EISDIR && errno != EROFS &&
+      errno != ETXTBSY) {
+    return -1;
+  }
+
+  *writable = 0;
+
+  if ((fd = open(filename, O_RDONLY, 0)) != -1 || errno != EACCES) {
+    return fd;
+  }
+
+  *readable = 0;
+  *writable = 1;
+
+  return open(filename, O_WRONLY);
+}
+
+// Input: size - the maximum number of open file descriptors to keep
+// Input: readahead - the number of bytes to read ahead of a sequential reader
+// Input: windows - the maximum number of file windows to keep mapped
+// Output: the newly created file cache
+//
+// Create a file cache
+FileCache create_file_cache(uint64_t size, uint64_t readahead,
+                            uint64_t windows) {
+  FileCache cache = (FileCacheObj *)malloc(sizeof(FileCacheObj));
+  if (cache != NULL) {
+    cache->size = size;
+    cache->readahead = readahead;
+    cache->max_windows = windows;
+    cache->num_windows = 0;
+    cache->window_head = NULL;
+    cache->window_tail = NULL;
+    cache->num_entries = 0;
+    cache->num_buckets = size > 0 ? size * 2 : 1;
+    cache->buckets = (FileEntry *)calloc(cache->num_buckets, sizeof(FileEntry));
+    cache->head = NULL;
+    cache->tail = NULL;
+    cache->locks = create_range_locks(cache->num_buckets);
+    pthread_mutex_init(&(cache->mutex), NULL);
+    if (cache->buckets == NULL || cache->locks == NULL) {
+      delete_range_locks(&(cache->locks));
+      free(cache->buckets);
+      free(cache);
+      return NULL;
+    }
+  }
+  return cache;
+}
+
+// Input: ptr - pointer to a file cache
+// Output: (0) if the file cache was deleted successfully, EINVAL (22) if the
+// pointer or contents of the file cache do not exist
+//
+// Close every cached descriptor and delete a file cache
+uint8_t delete_file_cache(FileCache *ptr) {
+  if (ptr != NULL && *ptr != NULL) {
+    FileCache cache = *ptr;
+    while (cache->head != NULL) {
+      file_cache_drop(cache, cache->head);
+    }
+    pthread_mutex_destroy(&(cache->mutex));
+    delete_range_locks(&(cache->locks));
+    free(cache->buckets);
+    free(cache);
+    *ptr = NULL;
+    return 0;
+  } else {
+    return EINVAL;
+  }
+}
+
+// Input: cache - the file cache
+// Output: the number of open file descriptors held by the cache
+//
+// Get the number of entries in a file cache
+uint64_t file_cache_num_entries(FileCache cache) {
+  if (cache == NULL) {
+    return 0;
+  }
+  pthread_mutex_lock(&(cache->mutex));
+  uint64_t num_entries = cache->num_entries;
+  pthread_mutex_unlock(&(cache->mutex));
+  return num_entries;
+}
+
+// Input: cache - the file cache
+// Output: the number of file windows currently mapped
+//
+// Get the number of mapped windows in a file cache
+uint64_t file_cache_num_windows(FileCache cache) {
+  if (cache == NULL) {
+    return 0;
+  }
+  pthread_mutex_lock(&(cache->mutex));
+  uint64_t num_windows = cache->num_windows;
+  pthread_mutex_unlock(&(cache->mutex));
+  return num_windows;
+}
+
+// Input: cache - the file cache
+// Input: filename - the file to look up
+// Input: ptr - set to the entry holding an open descriptor for the file
+// Output: (0) if the entry was acquired or a negative errno value
+//
+// Get an open descriptor for a file, reusing a cached one when the path still
+// refers to the same inode. The entry must be handed back with
+// file_cache_release().
+int64_t file_cache_acquire(FileCache cache, char *filename, FileEntry *ptr) {
+  if (cache == NULL || filename == NULL || ptr == NULL) {
+    return -EINVAL;
+  }
+
+  FileEntry entry;
+  FileEntry found;
+  struct stat st;
+  uint8_t readable;
+  uint8_t writable;
+  int64_t status;
+  int fd;
+
+  *ptr = NULL;
+
+  if (stat(filename, &st) == -1) {
+    status = -errno;
+    warn("%s", filename);
+
+    pthread_mutex_lock(&(cache->mutex)); // Lock the file cache mutex
+    if ((entry = file_cache_find(cache, filename)) != NULL) {
+      file_cache_drop(cache, entry); // The file is gone
+    }
+    pthread_mutex_unlock(&(cache->mutex)); // Unlock the file cache mutex
+
+    return status;
+  }
+
+  pthread_mutex_lock(&(cache->mutex)); // Lock the file cache mutex
+  // --------------------------------------------------------------------------
+  // Begin critical section
+
+  if ((entry = file_cache_find(cache, filename)) != NULL) {
+    if (entry->dev == st.st_dev && entry->ino == st.st_ino) {
+      // Same inode, so the descriptor is still valid. Refresh the attributes
+      // if the file was modified since they were recorded.
+      if (entry->mtime.tv_sec != st.st_mtim.tv_sec ||
+          entry->mtime.tv_nsec != st.st_mtim.tv_nsec ||
+          entry->size != (uint64_t)st.st_size) {
+        // Stop serving pages that may now be past the end of the file
+        if (entry->window != NULL && (uint64_t)st.st_size < entry->size) {
+          file_cache_detach(cache, entry->window);
+        }
+        entry->mtime = st.st_mtim;
+        __atomic_store_n(&(entry->size), st.st_size, __ATOMIC_RELAXED);
+      }
+      file_cache_touch(cache, entry);
+      entry->refs++;
+      pthread_mutex_unlock(&(cache->mutex)); // Unlock the file cache mutex
+      *ptr = entry;
+      return 0;
+    }
+
+    file_cache_drop(cache, entry); // The path now names a different file
+  }
+
+  // End critical section
+  // --------------------------------------------------------------------------
+  pthread_mutex_unlock(&(cache->mutex)); // Unlock the file cache mutex
+
+  if ((fd = file_cache_open(filename, &readable, &writable)) == -1) {
+    status = -errno;
+    warn("%s", filename);
+    return status;
+  }
+
+  if (fstat(fd, &st) == -1) {
+    status = -errno;
+    warn("%s", filename);
+    close(fd);
+    return status;
+  }
+
+  if ((entry = create_file_entry(filename, fd, readable, writable, &st)) ==
+      NULL) {
+    close(fd);
+    return -ENOMEM;
+  }
+
+  pthread_mutex_lock(&(cache->mutex)); // Lock the file cache mutex
+  // --------------------------------------------------------------------------
+  // Begin critical section
+
+  found = file_cache_find(cache, filename);
+
+  if (found != NULL && found->dev == entry->dev && found->ino == entry->ino) {
+    // Another thread opened the same file first
+    delete_file_entry(&entry);
+    entry = found;
+    file_cache_touch(cache, entry);
+  } else {
+    if (found != NULL) {
+      file_cache_drop(cache, found);
+    }
+    file_cache_link(cache, entry);
+  }
+
+  entry->refs++;
+  file_cache_evict(cache);
+
+  // End critical section
+  // --------------------------------------------------------------------------
+  pthread_mutex_unlock(&(cache->mutex)); // Unlock the file cache mutex
+
+  *ptr = entry;
+  return 0;
+}
+
+// Input: cache - the file cache
+// Input: entry - an entry returned by file_cache_acquire()
+// Output: none
+//
+// Hand an entry back to the file cache
+void file_cache_release(FileCache cache, FileEntry entry) {
+  if (cache == NULL || entry == NULL) {
+    return;
+  }
+
+  pthread_mutex_lock(&(cache->mutex)); // Lock the file cache mutex
+  entry->refs--;
+  if (entry->refs == 0) {
+    if (entry->stale) {
+      delete_file_entry(&entry);
+    } else {
+      file_cache_evict(cache);
+    }
+  }
+  pthread_mutex_unlock(&(cache->mutex)); // Unlock the file cache mutex
+  return;
+}
+
+// Input: cache - the file cache
+// Input: entry - an entry returned by file_cache_acquire()
+// Input: offset - the first byte of the range
+// Input: length - the number of bytes in the range
+// Input: exclusive - (1) to lock the range for writing, (0) for reading
+// Output: (0) if the range was locked or ENOMEM (12) if it could not be
+//
+// Lock a byte range of the file held by an entry. Ranges are keyed by inode,
+// so every path that names the file shares the same locks.
+uint8_t file_cache_lock(FileCache cache, FileEntry entry, uint64_t offset,
+                        uint64_t length, uint8_t exclusive) {
+  return range_lock(cache->locks, entry->dev, entry->ino, offset, length,
+                    exclusive);
+}
+
+// Input: cache - the file cache
+// Input: entry - an entry returned by file_cache_acquire()
+// Input: offset - the first byte of the range
+// Input: length - the number of bytes in the range
+// Input: exclusive - the mode the range was locked with
+// Output: none
+//
+// Unlock a byte range that was locked with file_cache_lock()
+void file_cache_unlock(FileCache cache, FileEntry entry, uint64_t offset,
+                       uint64_t length, uint8_t exclusive) {
+  range_unlock(cache->locks, entry->dev, entry->ino, offset, length,
+               exclusive);
+  return;
+}
+
+// Input: cache - the file cache
+// Input: entry - an entry returned by file_cache_acquire()
+// Input: client - identifies the reader, such as its connection
+// Input: offset - the first byte about to be read
+// Input: length - the number of bytes about to be read
+// Output: none
+//
+// Track where a client is reading a file and, once it is reading
+// sequentially, ask the kernel to read ahead of it
+// The file goes back to normal advice once none of its readers is sequential,
+// so that one sequential run does not leave later random readers with
+// aggressive kernel read-ahead
+void file_cache_advise(FileCache cache, FileEntry entry, uint64_t client,
+                       uint64_t offset, uint64_t length) {
+  if (cache == NULL || entry == NULL || cache->readahead == 0) {
+    return;
+  }
+
+  FileStreamObj *stream = NULL;
+  uint8_t sequential = 0;
+  uint8_t normal = 0;
+  uint64_t start = 0;
+  uint64_t end = 0;
+
+  pthread_mutex_lock(&(cache->mutex)); // Lock the file cache mutex
+  // --------------------------------------------------------------------------
+  // Begin critical section
+
+  for (uint8_t i = 0; i < FILE_STREAMS; i++) {
+    if (entry->streams[i].client == client) {
+      stream = &(entry->streams[i]);
+      break;
+    }
+  }
+
+  if (stream == NULL) { // Take over the oldest stream slot
+    stream = &(entry->streams[entry->next_stream]);
+    entry->next_stream = (entry->next_stream + 1) % FILE_STREAMS;
+    stream->client = client;
+    stream->next = UINT64_MAX;
+    stream->run = 0;
+    stream->readahead = 0;
+  }
+
+  if (stream->next == offset) {
+    stream->run++;
+  } else {
+    stream->run = 0;
+    stream->readahead = 0;
+  }
+
+  stream->next = offset + length;
+
+  if (stream->run > 0) {
+    if (!entry->sequential) {
+      entry->sequential = 1;
+      sequential = 1;
+    }
+
+    // Stay a full window ahead once the reader is half way through the last
+    if (stream->next + cache->readahead / 2 > stream->readahead) {
+      start = stream->readahead > stream->next ? stream->readahead
+                                                : stream->next;
+      end = stream->next + cache->readahead;
+      stream->readahead = end;
+    }
+  } else if (entry->sequential) {
+    uint8_t i = 0;
+    while (i < FILE_STREAMS && entry->streams[i].run == 0) {
+      i++;
+    }
+    if (i == FILE_STREAMS) {
+      entry->sequential = 0;
+      normal = 1;
+    }
+  }
+
+  // End critical section
+  // --------------------------------------------------------------------------
+  pthread_mutex_unlock(&(cache->mutex)); // Unlock the file cache mutex
+
+  if (sequential) {
+    posix_fadvise(entry->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+  } else if (normal) {
+    posix_fadvise(entry->fd, 0, 0, POSIX_FADV_NORMAL);
+  }
+
+  if (end > start) {
+    readahead(entry->fd, start, end - start);
+  }
+
+  return;
+}
+
+// Input: cache - the file cache
+// Input: entry - an entry returned by file_cache_acquire()
+// Input: offset - the first byte that was read
+// Input: length - the number of bytes that were read
+// Output: none
+//
+// Let the kernel drop pages that a bulk read has finished with so that one
+// large copy does not push the hot working set out of the page cache
+// This does not depend on read-ahead, which -R 0 turns off on its own
+void file_cache_drop_behind(FileCache cache, FileEntry entry, uint64_t offset,
+                            uint64_t length) {
+  if (cache == NULL || entry == NULL) {
+    return;
+  }
+
+  posix_fadvise(entry->fd, offset, length, POSIX_FADV_DONTNEED);
+  return;
+}
+
+// Input: cache - the file cache
+// Input: entry - an entry returned by file_cache_acquire()
+// Input: offset - the first byte to be read
+// Input: length - the number of bytes to be read
+// Input: data - set to the address of the first byte in the mapping
+// Output: the window holding the range, or NULL if it cannot be mapped
+//
+// Map the window of a file that holds a range so that it can be sent
+// without reading it into a buffer first. Each entry keeps the window it
+// last used and the cache unmaps the least recently used windows beyond
+// its limit. The window must be handed back with file_cache_unmap().
+// A window is only mapped once FILE_WINDOW_HITS small reads in a row have
+// fallen into it, so cold random reads do not churn the mappings
+FileWindow file_cache_map(FileCache cache, FileEntry entry, uint64_t offset,
+                          uint64_t length, uint8_t **data) {
+  uint64_t start = offset & ~((uint64_t)FILE_WINDOW_SIZE - 1);
+  uint64_t size = file_entry_size(entry);
+  uint64_t page = sysconf(_SC_PAGESIZE);
+  FileWindow window;
+  uint8_t *base;
+
+  if (cache == NULL || cache->max_windows == 0 || length == 0 ||
+      !entry->readable || offset + length > start + FILE_WINDOW_SIZE ||
+      offset + length > size) {
+    return NULL;
+  }
+
+  pthread_mutex_lock(&(cache->mutex)); // Lock the file cache mutex
+  window = entry->window;
+  if (window != NULL && window->offset == start &&
+      offset + length <= start + window->length) {
+    window->refs++;
+    if (window->lru_prev != NULL) { // Move it to the front of the LRU list
+      window->lru_prev->lru_next = window->lru_next;
+      if (window->lru_next != NULL) {
+        window->lru_next->lru_prev = window->lru_prev;
+      } else {
+        cache->window_tail = window->lru_prev;
+      }
+      window->lru_prev = NULL;
+      window->lru_next = cache->window_head;
+      cache->window_head->lru_prev = window;
+      cache->window_head = window;
+    }
+    pthread_mutex_unlock(&(cache->mutex)); // Unlock the file cache mutex
+    *data = window->base + (offset - start);
+    return window;
+  }
+  if (entry->hot_window != start) {
+    entry->hot_window = start;
+    entry->hot_hits = 0;
+  }
+  if (++entry->hot_hits < FILE_WINDOW_HITS) {
+    pthread_mutex_unlock(&(cache->mutex)); // Unlock the file cache mutex
+    return NULL;
+  }
+  pthread_mutex_unlock(&(cache->mutex)); // Unlock the file cache mutex
+
+  // Map no further than the last page of the file
+  size = size - start < FILE_WINDOW_SIZE ? size - start : FILE_WINDOW_SIZE;
+  size = (size + page - 1) & ~(page - 1);
+
+  if ((base = (uint8_t *)mmap(NULL, size, PROT_READ, MAP_SHARED, entry->fd,
+                              start)) == MAP_FAILED) {
+    return NULL;
+  }
+
+  // Let the kernel back full windows with a huge page if it can
+  if (size == FILE_WINDOW_SIZE) {
+    madvise(base, size, MADV_HUGEPAGE);
+  }
+
+  if ((window = (FileWindowObj *)malloc(sizeof(FileWindowObj))) == NULL) {
+    munmap(base, size);
+    return NULL;
+  }
+
+  window->base = base;
+  window->offset = start;
+  window->length = size;
+  window->refs = 1;
+  window->stale = 0;
+  window->entry = entry;
+  window->lru_prev = NULL;
+
+  pthread_mutex_lock(&(cache->mutex)); // Lock the file cache mutex
+  // --------------------------------------------------------------------------
+  // Begin critical section
+
+  if (entry->window != NULL) {
+    file_cache_detach(cache, entry->window);
+  }
+
+  entry->window = window;
+  window->lru_next = cache->window_head;
+  if (cache->window_head != NULL) {
+    cache->window_head->lru_prev = window;
+  }
+  cache->window_head = window;
+  if (cache->window_tail == NULL) {
+    cache->window_tail = window;
+  }
+  cache->num_windows++;
+
+  while (cache->num_windows > cache->max_windows) {
+    file_cache_detach(cache, cache->window_tail);
+  }
+
+  // End critical section
+  // --------------------------------------------------------------------------
+  pthread_mutex_unlock(&(cache->mutex)); // Unlock the file cache mutex
+
+  *data = base + (offset - start);
+  return window;
+}
+
+// Input: cache - the file cache
+// Input: window - a window returned by file_cache_map()
+// Output: none
+//
+// Hand a mapped window back to the file cache
+void file_cache_unmap(FileCache cache, FileWindow window) {
+  if (cache == NULL || window == NULL) {
+    return;
+  }
+
+  pthread_mutex_lock(&(cache->mutex)); // Lock the file cache mutex
+  window->refs--;
+  if (window->refs == 0 && window->stale) {
+    munmap(window->base, window->length);
+    free(window);
+  }
+  pthread_mutex_unlock(&(cache->mutex)); // Unlock the file cache mutex
+  return;
+}
+
+// Get the byte-range lock table shared by the files in a file cache
+RangeLocks file_cache_range_locks(FileCache cache) {
+  if (cache == NULL) {
+    return NULL;
+  }
+  return cache->locks;
+}
+
+// Get the open file descriptor held by an entry
+int file_entry_fd(FileEntry entry) { return entry->fd; }
+
+// Input: cache - the file cache
+// Input: entry - an entry returned by file_cache_acquire()
+// Output: a descriptor for the file opened with O_DIRECT, or -1 if the file
+// system does not support direct I/O or the file could not be reopened
+//
+// Get a second descriptor for a file that bypasses the page cache, opening
+// it the first time it is asked for
+// The descriptor the entry holds is reopened rather than its path, so direct
+// transfers reach the same file as the entry and its range locks even if the
+// path was renamed or replaced. Only a file system without direct I/O is
+// remembered, other failures are tried again on the next request.
+int file_entry_direct_fd(FileCache cache, FileEntry entry) {
+  int flags = entry->readable && entry->writable ? O_RDWR
+              : entry->writable                  ? O_WRONLY
+                                                 : O_RDONLY;
+  char path[32];
+  struct stat st;
+  int fd;
+
+  pthread_mutex_lock(&(cache->mutex)); // Lock the file cache mutex
+  fd = entry->direct_fd;
+  pthread_mutex_unlock(&(cache->mutex)); // Unlock the file cache mutex
+
+  if (fd != -2) {
+    return fd;
+  }
+
+  snprintf(path, sizeof(path), "/proc/self/fd/%d", entry->fd);
+  fd = open(path, flags | O_DIRECT);
+  if (fd == -1) {
+    if (errno == EINVAL) {
+      pthread_mutex_lock(&(cache->mutex)); // Lock the file cache mutex
+      if (entry->direct_fd == -2) {
+        entry->direct_fd = -1;
+      }
+      pthread_mutex_unlock(&(cache->mutex)); // Unlock the file cache mutex
+    }
+    return -1;
+  }
+
+  if (fstat(fd, &st) == -1 || st.st_dev != entry->dev ||
+      st.st_ino != entry->ino) {
+    close(fd);
+    return -1;
+  }
+
+  // Another thread may have opened one in the meantime
+  pthread_mutex_lock(&(cache->mutex)); // Lock the file cache mutex
+  if (entry->direct_fd == -2) {
+    entry->direct_fd = fd;
+  } else {
+    close(fd);
+    fd = entry->direct_fd;
+  }
+  pthread_mutex_unlock(&(cache->mutex)); // Unlock the file cache mutex
+
+  return fd;
+}
+
+// Order two entries by the file they refer to, (0) if it is the same file
+int8_t file_entry_compare(FileEntry a, FileEntry b) {
+  if (a->dev != b->dev) {
+    return a->dev < b->dev ? -1 : 1;
+  }
+  if (a->ino != b->ino) {
+    return a->ino < b->ino ? -1 : 1;
+  }
+  return 0;
+}
+
+// Check if the descriptor held by an entry was opened for reading
+uint8_t file_entry_readable(FileEntry entry) { return entry->readable; }
+
+// Check if the descriptor held by an entry was opened for writing
+uint8_t file_entry_writable(FileEntry entry) { return entry->writable; }
+
+// Get the size of a file as of the last time its entry was acquired
+uint64_t file_entry_size(FileEntry entry) {
+  return __atomic_load_n(&(entry->size), __ATOMIC_RELAXED);
+}
@@ -0,0 +1,51 @@
+#ifndef __RPCFILECACHE_H__
+#define __RPCFILECACHE_H__
+
+#include "rpcrangelock.h"
+#include <cstdint>
+
+typedef struct FileCacheObj *FileCache;
+
+typedef struct FileEntryObj *FileEntry;
+
+typedef struct FileWindowObj *FileWindow;
+
+FileCache create_file_cache(uint64_t size, uint64_t readahead, uint64_t windows);
+
+uint8_t delete_file_cache(FileCache *ptr);
+
+uint64_t file_cache_num_entries(FileCache cache);
+
+uint64_t file_cache_num_windows(FileCache cache);
+
+int64_t file_cache_acquire(FileCache cache, char *filename, FileEntry *ptr);
+
+void file_cache_release(FileCache cache, FileEntry entry);
+
+uint8_t file_cache_lock(FileCache cache, FileEntry entry, uint64_t offset, uint64_t length, uint8_t exclusive);
+
+void file_cache_unlock(FileCache cache, FileEntry entry, uint64_t offset, uint64_t length, uint8_t exclusive);
+
+void file_cache_advise(FileCache cache, FileEntry entry, uint64_t client, uint64_t offset, uint64_t length);
+
+void file_cache_drop_behind(FileCache cache, FileEntry entry, uint64_t offset, uint64_t length);
+
+FileWindow file_cache_map(FileCache cache, FileEntry entry, uint64_t offset, uint64_t length, uint8_t **data);
+
+void file_cache_unmap(FileCache cache, FileWindow window);
+
+RangeLocks file_cache_range_locks(FileCache cache);
+
+int file_entry_fd(FileEntry entry);
+
+int file_entry_direct_fd(FileCache cache, FileEntry entry);
+
+int8_t file_entry_compare(FileEntry a, FileEntry b);
+
+uint8_t file_entry_readable(FileEntry entry);
+
+uint8_t file_entry_writable(FileEntry entry);
+
+uint64_t file_entry_size(FileEntry entry);
+
+#endif
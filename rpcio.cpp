@@ -8,6 +8,7 @@
 #include <err.h>
 #include <fcntl.h>
 #include <netdb.h>
+#include <poll.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -172,6 +173,53 @@ int recv_loop(int connfd, uint8_t *buffer, int64_t num_bytes) {
   return total_bytes;
 }
 
+// Send num_bytes bytes from a buffer to the client, retrying short sends
+int64_t send_loop(int connfd, uint8_t *buffer, int64_t num_bytes, int flags) {
+  int64_t bytes_sent = 0;
+  int64_t total_bytes = 0;
+
+  while (total_bytes < num_bytes) {
+    bytes_sent =
+        send(connfd, buffer + total_bytes, num_bytes - total_bytes, flags);
+
+    if (bytes_sent == -1 && errno == EINTR) {
+      continue;
+    }
+
+    if (bytes_sent <= 0) {
+      return -1;
+    }
+
+    total_bytes += bytes_sent;
+  }
+
+  return total_bytes;
+}
+
+// Look at the next num_bytes bytes from the client without consuming them
+// A peek comes back short when the client stops sending, since the bytes it
+// did send stay queued, so a short peek after the client shut down its side
+// of the connection is returned as is for the caller to treat as closed
+int peek_loop(int connfd, uint8_t *buffer, int64_t num_bytes) {
+  int64_t bytes_received = 0;
+  struct pollfd pfd = {connfd, POLLRDHUP, 0};
+
+  do {
+    bytes_received = recv(connfd, buffer, num_bytes, MSG_PEEK | MSG_WAITALL);
+
+    if (bytes_received < 0) {
+      err(1, "failed listening");
+    }
+
+    if (bytes_received > 0 && bytes_received < num_bytes &&
+        poll(&pfd, 1, 0) > 0 && (pfd.revents & (POLLRDHUP | POLLHUP))) {
+      break;
+    }
+  } while (bytes_received > 0 && bytes_received < num_bytes);
+
+  return bytes_received;
+}
+
 // Get length bytes from the client and place them in a buffer
 // The buffer has the option to be null-terminated
 int64_t recv_string(int connfd, uint8_t *result, uint16_t length, uint8_t nul) {
@@ -208,6 +256,27 @@ int64_t recv_string(int connfd, uint8_t *result, uint16_t length, uint8_t nul) {
   return bytes_received;
 }
 
+// Get length bytes from the client and throw them away
+int64_t recv_discard(int connfd, uint64_t length) {
+  uint8_t buffer[BUFFER_SIZE];
+  int64_t bytes_received = 0;
+  uint64_t bytes_remaining = length;
+
+  while (bytes_remaining > 0) {
+    bytes_received = recv_loop(connfd, buffer,
+                               bytes_remaining > BUFFER_SIZE ? BUFFER_SIZE
+                                                             : bytes_remaining);
+
+    if (bytes_received <= 0) {
+      break;
+    }
+
+    bytes_remaining -= bytes_received;
+  }
+
+  return length - bytes_remaining;
+}
+
 // Set the response header
 void set_header(uint8_t *buffer, uint32_t identifier, uint8_t status) {
   uint32_to_wire(buffer, 0, 3, identifier);
@@ -239,6 +308,12 @@ void set_num_bytes(uint8_t *buffer, uint16_t num) {
   return;
 }
 
+// Set the number of bytes that follow a large transfer response
+void set_transfer_size(uint8_t *buffer, uint64_t num) {
+  uint64_to_wire(buffer, 5, 12, num);
+  return;
+}
+
 // Place a string into a buffer
 void set_string(uint8_t *buffer, uint8_t *string, uint16_t length) {
   string_to_wire(buffer, 0, length - 1, string);
@@ -26,8 +26,14 @@ uint64_t get_offset(uint8_t *buffer);
 
 int recv_loop(int cl, uint8_t *buffer, int64_t num_bytes);
 
+int64_t send_loop(int connfd, uint8_t *buffer, int64_t num_bytes, int flags);
+
+int peek_loop(int connfd, uint8_t *buffer, int64_t num_bytes);
+
 int64_t recv_string(int connfd, uint8_t *result, uint16_t length, uint8_t nul);
 
+int64_t recv_discard(int connfd, uint64_t length);
+
 void set_header(uint8_t *buffer, uint32_t identifier, uint8_t status);
 
 void set_result(uint8_t *buffer, int64_t result);
@@ -38,6 +44,8 @@ void set_var_length(uint8_t *buffer, uint8_t length);
 
 void set_num_bytes(uint8_t *buffer, uint16_t num);
 
+void set_transfer_size(uint8_t *buffer, uint64_t num);
+
 void set_string(uint8_t *buffer, uint8_t *string, uint16_t length);
 
 void data_to_buffer(uint8_t *buffer, uint8_t *data, uint16_t length);
@@ -1,4 +1,7 @@
 #include "rpckeyvaluestore.h"
+#include "rpcmath.h"
+#include "rpcskiplist.h"
+#include "rpctimer.h"
 #include <cctype>
 #include <cerrno>
 #include <cmath>
@@ -8,6 +11,7 @@
 #include <cstring>
 #include <err.h>
 #include <fcntl.h>
+#include <time.h>
 #include <unistd.h>
 
 // Check if a string is a number
@@ -53,6 +57,10 @@ typedef struct LinkedListNodeObj {
   uint8_t name[32];
   int64_t value;
   uint8_t flag;
+  uint64_t version;
+  uint64_t expires;
+  Timer timer;
+  uint8_t referenced;
   struct LinkedListNodeObj *next;
 } LinkedListNodeObj;
 
@@ -66,7 +74,16 @@ typedef struct LinkedListObj {
 typedef struct KeyValueStoreObj {
   uint64_t num_keys;
   uint64_t num_lists;
+  uint64_t version;
   LinkedList *lists;
+  SkipList index;
+  TimerWheel timers;
+  uint64_t max_memory;
+  uint64_t hand;
+  uint64_t num_evictions;
+  uint64_t evicted_bytes;
+  KeyValueObserver observer;
+  void *observer_arg;
 } KeyValueStoreObj;
 
 // Input: key - the name of the variable
@@ -74,10 +91,12 @@ typedef struct KeyValueStoreObj {
 // Input: value - the value of the variable if it holds a number
 // Input: flag - the flag to determine the value type of the node
 //        (1) = variable (0) = number
+// Input: version - the version of the node
 // Output: node - the newly created node
 //
 // Create a new node
-Node create_node(uint8_t *key, uint8_t *name, int64_t value, uint8_t flag) {
+Node create_node(uint8_t *key, uint8_t *name, int64_t value, uint8_t flag,
+                 uint64_t version) {
   Node node = (LinkedListNodeObj *)malloc(sizeof(LinkedListNodeObj));
   if (node != NULL) {
     strncpy((char *)node->key, (char *)key, 31);
@@ -87,6 +106,10 @@ Node create_node(uint8_t *key, uint8_t *name, int64_t value, uint8_t flag) {
       node->value = value;
     }
     node->flag = flag;
+    node->version = version;
+    node->expires = 0;
+    node->timer = NULL;
+    node->referenced = 1;
     node->next = NULL;
   }
   return node;
@@ -123,6 +146,29 @@ Node find_node(LinkedList list, uint8_t *key) {
   return node;
 }
 
+// Input: list - the linked list to search for a node
+// Input: key - the key to search for
+// Output: the node that was found or NULL if it has expired
+//
+// Find the node with a specific key in a linked list unless it has expired
+// An expired node is only removed on the next tick of the timer wheel, so
+// lookups treat it as gone in the meantime
+// The node is marked as referenced for eviction, which readers holding the
+// store together only write when the mark is not set yet
+Node find_live_node(LinkedList list, uint8_t *key) {
+  Node node = find_node(list, key);
+  if (node == NULL) {
+    return NULL;
+  }
+  if (node->expires != 0 && node->expires <= timer_now()) {
+    return NULL;
+  }
+  if (__atomic_load_n(&(node->referenced), __ATOMIC_RELAXED) == 0) {
+    __atomic_store_n(&(node->referenced), 1, __ATOMIC_RELAXED);
+  }
+  return node;
+}
+
 // Input: none
 // Output: the newly created linked list
 //
@@ -163,7 +209,7 @@ uint8_t *linked_list_find_key(LinkedList list, uint8_t *key) {
   if (list == NULL) {
     return NULL;
   }
-  Node node = find_node(list, key);
+  Node node = find_live_node(list, key);
   if (node == NULL) {
     return NULL;
   }
@@ -180,7 +226,7 @@ uint8_t *linked_list_get_item_name(LinkedList list, uint8_t *key) {
   if (list == NULL) {
     return NULL;
   }
-  Node node = find_node(list, key);
+  Node node = find_live_node(list, key);
   if (node == NULL) {
     return NULL;
   }
@@ -200,14 +246,15 @@ int64_t linked_list_get_item_value(LinkedList list, uint8_t *key) {
   if (list == NULL) {
     return ENOENT;
   }
-  Node node = find_node(list, key);
+  Node node = find_live_node(list, key);
   if (node == NULL) {
     return ENOENT;
   }
   if (node->flag == 1) {
     return EFAULT;
   }
-  return node->value;
+  // Counters change values while the store is only held for reading
+  return __atomic_load_n(&(node->value), __ATOMIC_RELAXED);
 }
 
 // Input: list - the linked list to search for a node
@@ -219,7 +266,7 @@ uint8_t linked_list_get_item_flag(LinkedList list, uint8_t *key) {
   if (list == NULL) {
     return ENOENT;
   }
-  Node node = find_node(list, key);
+  Node node = find_live_node(list, key);
   if (node == NULL) {
     return ENOENT;
   }
@@ -229,51 +276,57 @@ uint8_t linked_list_get_item_flag(LinkedList list, uint8_t *key) {
 // Input: list - the linked list to insert a node
 // Input: key - the key to insert
 // Input: name - the variable name to insert
-// Output: none
+// Input: version - the version of the node after the insertion
+// Output: the node that holds the key or NULL
 //
 // Insert a node with a variable name value into a linked list
-void linked_list_insert_item_name(LinkedList list, uint8_t *key,
-                                  uint8_t *name) {
+Node linked_list_insert_item_name(LinkedList list, uint8_t *key, uint8_t *name,
+                                  uint64_t version) {
   Node find = find_node(list, key);
   if (find != NULL) {
     strncpy((char *)find->name, (char *)name, 31);
     find->value = 0;
     find->flag = 1;
-    return;
+    find->version = version;
+    find->referenced = 1;
+    return find;
   }
   Node head_node = list->head;
-  Node node = create_node(key, name, 0, 1);
+  Node node = create_node(key, name, 0, 1, version);
   if (node != NULL) {
     node->next = head_node;
     list->head = node;
     list->num_items++;
   }
-  return;
+  return node;
 }
 
 // Input: list - the linked list to insert a node
 // Input: key - the key to insert
 // Input: value - the numerical value to insert
-// Output: none
+// Input: version - the version of the node after the insertion
+// Output: the node that holds the key or NULL
 //
 // Insert a node with a numerical value into a linked list
-void linked_list_insert_item_value(LinkedList list, uint8_t *key,
-                                   int64_t value) {
+Node linked_list_insert_item_value(LinkedList list, uint8_t *key,
+                                   int64_t value, uint64_t version) {
   Node find = find_node(list, key);
   if (find != NULL) {
     memset(find->name, 0, 32);
     find->value = value;
     find->flag = 0;
-    return;
+    find->version = version;
+    find->referenced = 1;
+    return find;
   }
   Node head_node = list->head;
-  Node node = create_node(key, NULL, value, 0);
+  Node node = create_node(key, NULL, value, 0, version);
   if (node != NULL) {
     node->next = head_node;
     list->head = node;
     list->num_items++;
   }
-  return;
+  return node;
 }
 
 // Input: list - the linked list to delete a node
@@ -285,7 +338,8 @@ uint8_t linked_list_delete_item(LinkedList list, uint8_t *key) {
   if (list == NULL) {
     return ENOENT;
   }
-  if (linked_list_find_key(list, key) == NULL) {
+  // Expired nodes are deleted too
+  if (find_node(list, key) == NULL) {
     return ENOENT;
   }
   Node head_node = list->head;
@@ -330,15 +384,85 @@ void linked_list_delete_all_items(LinkedList list) {
   return;
 }
 
+// Input: kvstore - the key-value store
+// Output: a version greater than any the key-value store has handed out
+//
+// Take the next version of a key-value store
+// Counters take versions while the store is only held for reading
+uint64_t next_version(KeyValueStore kvstore) {
+  return __atomic_add_fetch(&(kvstore->version), 1, __ATOMIC_RELAXED);
+}
+
+// Input: node - a node of the key-value store
+// Input: version - a version taken with next_version()
+// Output: the version of the node afterwards
+//
+// Publish the version of a change that a counter made while the store is
+// only held for reading
+// Two counters can take their versions in one order and store them in the
+// other, so a version only ever replaces a smaller one
+uint64_t node_publish_version(Node node, uint64_t version) {
+  uint64_t current = __atomic_load_n(&(node->version), __ATOMIC_RELAXED);
+  while (current < version &&
+         !__atomic_compare_exchange_n(&(node->version), &current, version, 1,
+                                      __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+  }
+  return current < version ? version : current;
+}
+
+// Input: kvstore - the key-value store
+// Input: node - a node of the key-value store
+// Output: none
+//
+// Make a node live until it is deleted
+void node_clear_expiry(KeyValueStore kvstore, Node node) {
+  if (node == NULL) {
+    return;
+  }
+  if (node->timer != NULL) {
+    timer_wheel_cancel(kvstore->timers, node->timer);
+    node->timer = NULL;
+  }
+  node->expires = 0;
+  return;
+}
+
+// Input: kvstore - the key-value store
+// Input: key - the key that changed
+// Input: version - the new version of the key or (0) if it was deleted
+// Output: none
+//
+// Tell the observer of a key-value store that a key changed
+void key_value_store_notify(KeyValueStore kvstore, uint8_t *key,
+                            uint64_t version) {
+  if (kvstore->observer != NULL) {
+    kvstore->observer(kvstore->observer_arg, key, version);
+  }
+  return;
+}
+
 // Input: size - the size of the hash table in a key-value store
 // Output: the newly created key-value store
 //
 // Create a key-value store
+// Versions start from the time of creation so that a version a client saw
+// before a restart is not handed out again to a different value
 KeyValueStore create_key_value_store(uint64_t size) {
   KeyValueStore kvstore = (KeyValueStoreObj *)malloc(sizeof(KeyValueStoreObj));
+  struct timespec now;
   if (kvstore != NULL) {
+    clock_gettime(CLOCK_REALTIME, &now);
     kvstore->num_keys = 0;
+    kvstore->version = now.tv_sec * 1000000000L + now.tv_nsec;
     kvstore->num_lists = size;
+    kvstore->index = create_skip_list();
+    kvstore->timers = create_timer_wheel(timer_now(), DEFAULT_TIMER_TICK);
+    kvstore->max_memory = 0;
+    kvstore->hand = 0;
+    kvstore->num_evictions = 0;
+    kvstore->evicted_bytes = 0;
+    kvstore->observer = NULL;
+    kvstore->observer_arg = NULL;
     kvstore->lists = (LinkedListObj **)calloc(size, sizeof(LinkedListObj));
     for (uint64_t i = 0; i < kvstore->num_lists; i++) {
       kvstore->lists[i] = create_linked_list();
@@ -360,6 +484,8 @@ uint8_t delete_key_value_store(KeyValueStore *ptr) {
     }
     free(kvstore->lists);
     kvstore->lists = NULL;
+    delete_skip_list(&(kvstore->index));
+    delete_timer_wheel(&(kvstore->timers));
     free(kvstore);
     kvstore = NULL;
     return 0;
@@ -368,6 +494,25 @@ uint8_t delete_key_value_store(KeyValueStore *ptr) {
   }
 }
 
+// Input: kvstore - the key-value store
+// Input: observer - the function to call with every key that changes, or
+// NULL for none
+// Input: arg - the first argument to pass to the observer
+// Output: none
+//
+// Set the observer of a key-value store
+// The observer is called by the thread that changed the key while it still
+// holds the store
+void key_value_store_observe(KeyValueStore kvstore, KeyValueObserver observer,
+                             void *arg) {
+  if (kvstore == NULL) {
+    return;
+  }
+  kvstore->observer_arg = arg;
+  kvstore->observer = observer;
+  return;
+}
+
 // Input: kvstore - the key-value store
 // Output: the number of keys in the key-value store
 //
@@ -453,6 +598,108 @@ uint8_t key_value_store_key_flag_lookup(KeyValueStore kvstore, uint8_t *key) {
   return flag;
 }
 
+// Input: kvstore - the key-value store
+// Input: key - the key to lookup
+// Output: the version of the key or (0) if it does not exist
+//
+// Lookup the version of a specific key in a key-value store
+// Every change to a key gives it a version greater than any it had before.
+// A counter stores its value before its version, so a reader that races one
+// can see the new value with the old version but never the other way around.
+uint64_t key_value_store_key_version(KeyValueStore kvstore, uint8_t *key) {
+  if (kvstore == NULL || key == NULL) {
+    return 0;
+  }
+  uint64_t index = hash(key, key_value_store_num_lists(kvstore));
+  Node node = find_live_node(kvstore->lists[index], key);
+  if (node == NULL) {
+    return 0;
+  }
+  return __atomic_load_n(&(node->version), __ATOMIC_ACQUIRE);
+}
+
+// Input: kvstore - the key-value store
+// Input: key - the variable to resolve
+// Input: recursive - (1) to follow variables that hold other variable names
+// Input: max_iterations - the longest chain of names to follow
+// Input: value - set to the numerical value the variable resolves to
+// Output: (0) if the variable was resolved, ENOENT (2) if a variable in the
+// chain does not exist, EFAULT (14) if the variable holds a name and recursive
+// is (0) or ELOOP (40) if the chain is longer than max_iterations
+//
+// Resolve a variable used as an operand to its numerical value
+// Each variable in the chain is looked up once and its flag and value are read
+// from the same node, so a variable that expires part way through a resolve
+// is reported as missing rather than read as a number it no longer holds
+uint8_t key_value_store_resolve(KeyValueStore kvstore, uint8_t *key,
+                                uint8_t recursive, uint64_t max_iterations,
+                                int64_t *value) {
+  if (kvstore == NULL || key == NULL) {
+    return ENOENT;
+  }
+
+  uint64_t num_lists = key_value_store_num_lists(kvstore);
+
+  // Follow the chain of names until it reaches a number
+  for (uint64_t iterations = 0;; iterations++) {
+    Node node = find_live_node(kvstore->lists[hash(key, num_lists)], key);
+    if (node == NULL) {
+      return ENOENT;
+    }
+
+    if (node->flag == 0) {
+      // Counters change values while the store is only held for reading
+      *value = __atomic_load_n(&(node->value), __ATOMIC_RELAXED);
+      return 0;
+    }
+
+    if (!recursive) {
+      return EFAULT;
+    }
+
+    // The number at the end of the chain counts towards max_iterations
+    if (iterations + 2 >= max_iterations) {
+      return ELOOP;
+    }
+
+    key = node->name;
+  }
+}
+
+// Input: kvstore - the key-value store
+// Input: key - the key to lookup
+// Input: flag - set to (1) if the key holds a name or (0) if it holds a number
+// Input: value - set to the numerical value held by the key
+// Input: name - a buffer of 32 bytes set to the variable name held by the key
+// Input: version - set to the version of the key
+// Output: (0) if the key was read or ENOENT (2) if the key-value store or the
+// key do not exist
+//
+// Read everything a key holds from a single lookup so that the key cannot
+// expire part way through
+// The version is read first so that it is never newer than the value
+uint8_t key_value_store_key_read(KeyValueStore kvstore, uint8_t *key,
+                                 uint8_t *flag, int64_t *value, uint8_t *name,
+                                 uint64_t *version) {
+  if (kvstore == NULL || key == NULL) {
+    return ENOENT;
+  }
+  uint64_t index = hash(key, key_value_store_num_lists(kvstore));
+  Node node = find_live_node(kvstore->lists[index], key);
+  if (node == NULL) {
+    return ENOENT;
+  }
+  *version = __atomic_load_n(&(node->version), __ATOMIC_ACQUIRE);
+  *flag = node->flag;
+  if (node->flag == 1) {
+    memcpy(name, node->name, 32);
+    name[31] = 0;
+  } else {
+    *value = __atomic_load_n(&(node->value), __ATOMIC_RELAXED);
+  }
+  return 0;
+}
+
 // Input: kvstore - the key-value store
 // Input: key - the key to insert
 // Input: name - the variable name to insert
@@ -466,8 +713,16 @@ uint8_t key_value_store_insert_key_name(KeyValueStore kvstore, uint8_t *key,
     return ENOENT;
   }
   int64_t index = hash(key, key_value_store_num_lists(kvstore));
-  linked_list_insert_item_name(kvstore->lists[index], key, name);
-  kvstore->num_keys++;
+  uint64_t version = next_version(kvstore);
+  uint64_t num_items = kvstore->lists[index]->num_items;
+  Node node =
+      linked_list_insert_item_name(kvstore->lists[index], key, name, version);
+  if (node != NULL && kvstore->lists[index]->num_items > num_items) {
+    skip_list_insert(kvstore->index, node->key, node);
+  }
+  kvstore->num_keys += kvstore->lists[index]->num_items - num_items;
+  node_clear_expiry(kvstore, node);
+  key_value_store_notify(kvstore, key, version);
   return 0;
 }
 
@@ -484,8 +739,96 @@ uint8_t key_value_store_insert_key_value(KeyValueStore kvstore, uint8_t *key,
     return ENOENT;
   }
   int64_t index = hash(key, key_value_store_num_lists(kvstore));
-  linked_list_insert_item_value(kvstore->lists[index], key, value);
-  kvstore->num_keys++;
+  uint64_t version = next_version(kvstore);
+  uint64_t num_items = kvstore->lists[index]->num_items;
+  Node node =
+      linked_list_insert_item_value(kvstore->lists[index], key, value, version);
+  if (node != NULL && kvstore->lists[index]->num_items > num_items) {
+    skip_list_insert(kvstore->index, node->key, node);
+  }
+  kvstore->num_keys += kvstore->lists[index]->num_items - num_items;
+  node_clear_expiry(kvstore, node);
+  key_value_store_notify(kvstore, key, version);
+  return 0;
+}
+
+// Input: kvstore - the key-value store
+// Input: key - the variable to add to
+// Input: delta - the amount to add
+// Input: previous - set to the value before the addition
+// Output: (0) if the value was updated, ENOENT (2) if the variable does not
+// exist, EFAULT (14) if it holds a variable name or EOVERFLOW (75) if the sum
+// does not fit, in which case the value is left as it was
+//
+// Atomically add to the numerical value of a variable
+// Only the value of the node changes, so the store only needs to be held for
+// reading
+uint8_t key_value_store_fetch_add(KeyValueStore kvstore, uint8_t *key,
+                                  int64_t delta, int64_t *previous) {
+  if (kvstore == NULL || key == NULL) {
+    return ENOENT;
+  }
+  uint64_t index = hash(key, key_value_store_num_lists(kvstore));
+  Node node = find_live_node(kvstore->lists[index], key);
+  if (node == NULL) {
+    return ENOENT;
+  }
+  if (node->flag == 1) {
+    return EFAULT;
+  }
+
+  int64_t value = __atomic_load_n(&(node->value), __ATOMIC_RELAXED);
+  int64_t sum = 0;
+
+  do {
+    if (checked_add(value, delta, &sum) != 0) {
+      *previous = value;
+      return EOVERFLOW;
+    }
+  } while (!__atomic_compare_exchange_n(&(node->value), &value, sum, 1,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+
+  if (delta != 0) {
+    uint64_t version = node_publish_version(node, next_version(kvstore));
+    key_value_store_notify(kvstore, key, version);
+  }
+  *previous = value;
+  return 0;
+}
+
+// Input: kvstore - the key-value store
+// Input: key - the variable to swap
+// Input: expected - the value the variable must hold
+// Input: desired - the value to replace it with
+// Input: previous - set to the value before the swap, which is expected if
+// and only if the swap happened
+// Output: (0) if the variable was compared, ENOENT (2) if it does not exist or
+// EFAULT (14) if it holds a variable name
+//
+// Atomically replace the numerical value of a variable if it holds a specific
+// value
+uint8_t key_value_store_compare_and_swap(KeyValueStore kvstore, uint8_t *key,
+                                         int64_t expected, int64_t desired,
+                                         int64_t *previous) {
+  if (kvstore == NULL || key == NULL) {
+    return ENOENT;
+  }
+  uint64_t index = hash(key, key_value_store_num_lists(kvstore));
+  Node node = find_live_node(kvstore->lists[index], key);
+  if (node == NULL) {
+    return ENOENT;
+  }
+  if (node->flag == 1) {
+    return EFAULT;
+  }
+
+  *previous = expected;
+  if (__atomic_compare_exchange_n(&(node->value), previous, desired, 0,
+                                  __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) &&
+      desired != expected) {
+    uint64_t version = node_publish_version(node, next_version(kvstore));
+    key_value_store_notify(kvstore, key, version);
+  }
   return 0;
 }
 
@@ -500,13 +843,252 @@ uint8_t key_value_store_delete_key(KeyValueStore kvstore, uint8_t *key) {
     return ENOENT;
   }
   int64_t index = hash(key, key_value_store_num_lists(kvstore));
+  node_clear_expiry(kvstore, find_node(kvstore->lists[index], key));
+  // The index points into the node, so it goes first
+  skip_list_delete(kvstore->index, key);
   uint8_t status = linked_list_delete_item(kvstore->lists[index], key);
   if (status == 0) {
     kvstore->num_keys--;
+    key_value_store_notify(kvstore, key, 0);
   }
   return status;
 }
 
+// Input: kvstore - the key-value store
+// Input: key - the key to expire
+// Input: expires - the time in milliseconds at which the key is deleted, or
+// (0) to keep it until it is deleted
+// Output: (0) if the expiry was set or ENOENT (2) if the key does not exist
+//
+// Set the time at which a key expires
+// Setting a key again makes it live until it is deleted, while counters keep
+// its expiry
+// A key that expired but was not deleted yet can still be given a new expiry,
+// which lets a replayed log settle on the last one
+uint8_t key_value_store_set_expiry(KeyValueStore kvstore, uint8_t *key,
+                                   uint64_t expires) {
+  if (kvstore == NULL || key == NULL) {
+    return ENOENT;
+  }
+  uint64_t index = hash(key, key_value_store_num_lists(kvstore));
+  Node node = find_node(kvstore->lists[index], key);
+  if (node == NULL) {
+    return ENOENT;
+  }
+  node_clear_expiry(kvstore, node);
+  if (expires != 0) {
+    node->expires = expires;
+    node->timer = timer_wheel_add(kvstore->timers, expires, node);
+  }
+  return 0;
+}
+
+typedef struct ExpiryObj {
+  KeyValueStore kvstore;
+  int logfd;
+} ExpiryObj;
+
+// Input: ctx - the key-value store and log file the expiry is for
+// Input: arg - the node whose timer fired
+// Output: none
+//
+// Delete a node whose timer fired and log a tombstone for it
+void expire_node(void *ctx, void *arg) {
+  ExpiryObj *expiry = (ExpiryObj *)ctx;
+  Node node = (Node)arg;
+  uint8_t key[32];
+
+  // The timer was freed when it fired
+  node->timer = NULL;
+  memcpy(key, node->key, 32);
+  key_value_store_delete_key(expiry->kvstore, key);
+  if (expiry->logfd >= 0) {
+    log_delete_key(key, expiry->logfd);
+  }
+  return;
+}
+
+// Input: kvstore - the key-value store
+// Input: now - the current time in milliseconds
+// Input: logfd - the file descriptor of the log file or -1
+// Output: the number of keys that expired
+//
+// Delete the keys whose time has come and log a tombstone for each of them
+// The keys are found by a hierarchical timer wheel, so the cost does not grow
+// with the number of keys that have not expired yet
+uint64_t key_value_store_expire(KeyValueStore kvstore, uint64_t now,
+                                int logfd) {
+  if (kvstore == NULL) {
+    return 0;
+  }
+  ExpiryObj expiry = {kvstore, logfd};
+  return timer_wheel_advance(kvstore->timers, now, expire_node, &expiry);
+}
+
+// Input: kvstore - the key-value store
+// Output: the number of keys that will expire
+//
+// Get the number of keys with an expiry in a key-value store
+uint64_t key_value_store_num_expiring(KeyValueStore kvstore) {
+  if (kvstore == NULL) {
+    return 0;
+  }
+  return timer_wheel_num_timers(kvstore->timers);
+}
+
+// Input: kvstore - the key-value store
+// Output: the time in milliseconds before which no key can expire, or
+// UINT64_MAX if no key has an expiry
+//
+// Get the next time a key of a key-value store may expire
+uint64_t key_value_store_next_expiry(KeyValueStore kvstore) {
+  if (kvstore == NULL) {
+    return UINT64_MAX;
+  }
+  return timer_wheel_next_expiry(kvstore->timers);
+}
+
+// Input: kvstore - the key-value store
+// Input: start - the key to start from, or NULL for the first key
+// Input: after - (1) to start after the key, (0) to start at it
+// Input: visitor - the function to call with each key in order until it
+// returns a value other than (0)
+// Input: arg - the first argument to pass to the visitor
+// Output: the number of keys visited
+//
+// Visit the keys of a key-value store in key order
+// The keys are kept in a skip list next to the hash table, so a scan starts
+// with a logarithmic search and never walks the keys before it. Expired keys
+// are skipped, and a scan does not mark the keys it visits as used for
+// eviction.
+uint64_t key_value_store_scan(KeyValueStore kvstore, uint8_t *start,
+                              uint8_t after, KeyValueVisitor visitor,
+                              void *arg) {
+  if (kvstore == NULL || visitor == NULL) {
+    return 0;
+  }
+
+  uint64_t now = timer_now();
+  uint64_t num_visited = 0;
+  SkipListNode entry = skip_list_seek(kvstore->index, start, after);
+
+  for (; entry != NULL; entry = skip_list_next(entry)) {
+    Node node = (Node)skip_list_node_value(entry);
+    if (node->expires != 0 && node->expires <= now) {
+      continue;
+    }
+    num_visited++;
+    // Counters change values while the store is only held for reading
+    uint64_t version = __atomic_load_n(&(node->version), __ATOMIC_ACQUIRE);
+    int64_t value = __atomic_load_n(&(node->value), __ATOMIC_RELAXED);
+    if (visitor(arg, node->key, node->flag, value, node->name, version) != 0) {
+      break;
+    }
+  }
+  return num_visited;
+}
+
+// Input: kvstore - the key-value store
+// Input: max_memory - the number of bytes the keys may take, or (0) for no
+// limit
+// Output: none
+//
+// Set the memory limit of a key-value store
+// The limit is enforced by key_value_store_evict
+void key_value_store_set_memory_limit(KeyValueStore kvstore,
+                                      uint64_t max_memory) {
+  if (kvstore == NULL) {
+    return;
+  }
+  kvstore->max_memory = max_memory;
+  return;
+}
+
+// Input: kvstore - the key-value store
+// Output: the number of bytes taken by the keys of the key-value store
+//
+// Get the memory used by a key-value store
+uint64_t key_value_store_memory(KeyValueStore kvstore) {
+  if (kvstore == NULL) {
+    return 0;
+  }
+  return kvstore->num_keys * sizeof(LinkedListNodeObj) +
+         skip_list_memory(kvstore->index);
+}
+
+// Input: kvstore - the key-value store
+// Input: logfd - the file descriptor of the log file or -1
+// Output: the number of keys that were evicted
+//
+// Evict keys until the key-value store fits in its memory limit and log a
+// tombstone for each of them
+// Keys are picked with the CLOCK algorithm. A hand sweeps the linked lists,
+// gives a key that was used since the hand last passed it another chance and
+// evicts one that was not, which approximates least recently used order
+// without keeping the keys ordered on every lookup
+uint64_t key_value_store_evict(KeyValueStore kvstore, int logfd) {
+  if (kvstore == NULL || kvstore->max_memory == 0) {
+    return 0;
+  }
+
+  uint64_t num_evicted = 0;
+  uint64_t memory = key_value_store_memory(kvstore);
+  uint8_t key[32];
+
+  // Every key is either evicted or loses its mark on the first pass, so the
+  // second pass over the lists always makes room
+  while (kvstore->num_keys > 0 &&
+         key_value_store_memory(kvstore) > kvstore->max_memory) {
+    Node node = kvstore->lists[kvstore->hand]->head;
+    while (node != NULL &&
+           key_value_store_memory(kvstore) > kvstore->max_memory) {
+      Node next = node->next;
+      if (node->referenced) {
+        node->referenced = 0;
+      } else {
+        memcpy(key, node->key, 32);
+        key_value_store_delete_key(kvstore, key);
+        if (logfd >= 0) {
+          log_delete_key(key, logfd);
+        }
+        num_evicted++;
+      }
+      node = next;
+    }
+    kvstore->hand = (kvstore->hand + 1) % kvstore->num_lists;
+  }
+
+  __atomic_add_fetch(&(kvstore->num_evictions), num_evicted, __ATOMIC_RELAXED);
+  // Count the skip list nodes as well as the linked list nodes, so that the
+  // bytes evicted are measured the same way as the memory of the store
+  __atomic_add_fetch(&(kvstore->evicted_bytes),
+                     memory - key_value_store_memory(kvstore),
+                     __ATOMIC_RELAXED);
+  return num_evicted;
+}
+
+// Input: kvstore - the key-value store
+// Output: the number of keys evicted from the key-value store
+//
+// Get the number of keys evicted to keep a key-value store in its memory limit
+uint64_t key_value_store_num_evictions(KeyValueStore kvstore) {
+  if (kvstore == NULL) {
+    return 0;
+  }
+  return __atomic_load_n(&(kvstore->num_evictions), __ATOMIC_RELAXED);
+}
+
+// Input: kvstore - the key-value store
+// Output: the number of bytes evicted from the key-value store
+//
+// Get the number of bytes freed by evicting keys from a key-value store
+uint64_t key_value_store_evicted_bytes(KeyValueStore kvstore) {
+  if (kvstore == NULL) {
+    return 0;
+  }
+  return __atomic_load_n(&(kvstore->evicted_bytes), __ATOMIC_RELAXED);
+}
+
 // Input: key - the key to insert
 // Input: name - the variable name to insert
 // Input: value - the numerical value to insert
@@ -521,10 +1103,7 @@ uint8_t log_insert_key(uint8_t *key, uint8_t *name, int64_t value, uint8_t flag,
     return ENOENT;
   }
 
-  FILE *fp;
-  fp = fdopen(logfd, "w");
-
-  if (fseek(fp, 0, SEEK_END) == -1) {
+  if (lseek(logfd, 0, SEEK_END) == -1) {
     warn("%s", "log.txt");
     return EINVAL;
   }
@@ -545,6 +1124,114 @@ uint8_t log_insert_key(uint8_t *key, uint8_t *name, int64_t value, uint8_t flag,
   return 0;
 }
 
+// Input: key - the key that was added to
+// Input: delta - the amount that was added
+// Input: logfd - the file descriptor of the log file
+// Output: (0) if the addition was logged successfully, ENOENT (2) if the key
+// is NULL or EINVAL (22) if the log file could not be written
+//
+// Log an addition to a key as key=+delta
+// Additions commute, so counters that log them in a different order than
+// they happened still replay to the right value
+uint8_t log_add_key(uint8_t *key, int64_t delta, int logfd) {
+  if (key == NULL) {
+    return ENOENT;
+  }
+
+  if (lseek(logfd, 0, SEEK_END) == -1) {
+    warn("%s", "log.txt");
+    return EINVAL;
+  }
+
+  if (dprintf(logfd, "%s=+%ld\n", key, delta) == -1) {
+    return EINVAL;
+  }
+
+  return 0;
+}
+
+// Input: key - the key that expires
+// Input: expires - the time in milliseconds at which the key expires
+// Input: logfd - the file descriptor of the log file
+// Output: (0) if the expiry was logged successfully, ENOENT (2) if the key is
+// NULL or EINVAL (22) if the log file could not be written
+//
+// Log the expiry of a key as key=@time, where time (0) means never
+uint8_t log_expire_key(uint8_t *key, uint64_t expires, int logfd) {
+  if (key == NULL) {
+    return ENOENT;
+  }
+
+  if (lseek(logfd, 0, SEEK_END) == -1) {
+    warn("%s", "log.txt");
+    return EINVAL;
+  }
+
+  if (dprintf(logfd, "%s=@%lu\n", key, expires) == -1) {
+    return EINVAL;
+  }
+
+  return 0;
+}
+
+// Input: writes - the writes of the transaction
+// Input: num_writes - the number of writes
+// Input: logfd - the file descriptor of the log file
+// Output: (0) if the transaction was logged successfully, ENOMEM (12) if the
+// record could not be built or EINVAL (22) if the log file could not be
+// written
+//
+// Log the writes of a transaction as one record
+// The record is a *=count line followed by one line for each write, and is
+// written with a single call so that a torn record can only be at the end of
+// the log. A single write is logged as a plain line.
+uint8_t log_transaction(KeyValueWrite writes, uint8_t num_writes, int logfd) {
+  if (writes == NULL || num_writes == 0) {
+    return 0;
+  }
+
+  // A line is at most a key, an equals sign, a number and a newline
+  uint64_t size = 8 + num_writes * 64;
+  char *record = (char *)malloc(size);
+  uint64_t length = 0;
+  int64_t written;
+
+  if (record == NULL) {
+    return ENOMEM;
+  }
+
+  if (num_writes > 1) {
+    length += snprintf(record + length, size - length, "*=%u\n", num_writes);
+  }
+  for (uint8_t i = 0; i < num_writes; i++) {
+    if (writes[i].kind == WRITE_NAME) {
+      length += snprintf(record + length, size - length, "%s=%s\n",
+                         writes[i].key, writes[i].name);
+    } else if (writes[i].kind == WRITE_DELETE) {
+      length += snprintf(record + length, size - length, "%s=~\n",
+                         writes[i].key);
+    } else {
+      length += snprintf(record + length, size - length, "%s=%ld\n",
+                         writes[i].key, writes[i].value);
+    }
+  }
+
+  if (lseek(logfd, 0, SEEK_END) == -1) {
+    warn("%s", "log.txt");
+    free(record);
+    return EINVAL;
+  }
+
+  written = write(logfd, record, length);
+  free(record);
+
+  if (written != (int64_t)length) {
+    return EINVAL;
+  }
+
+  return 0;
+}
+
 // Input: kvstore - the key-value store
 // Input: logfd - the file descriptor of the log file
 // Output: (0) if the key-value store was dumped successfully, ENOENT (2) if
@@ -560,6 +1247,7 @@ uint8_t log_key_value_store(KeyValueStore kvstore, int logfd) {
   FILE *fp;
   LinkedList list;
   Node node;
+  uint64_t now = timer_now();
 
   fp = fdopen(logfd, "w");
 
@@ -571,6 +1259,9 @@ uint8_t log_key_value_store(KeyValueStore kvstore, int logfd) {
   for (uint64_t i = 0; i < key_value_store_num_lists(kvstore); i++) {
     list = kvstore->lists[i];
     for (node = list->head; node != NULL; node = node->next) {
+      if (node->expires != 0 && node->expires <= now) {
+        continue;
+      }
       if (node->flag == 1) {
         if (dprintf(logfd, "%s=%s\n", node->key, node->name) == -1) {
           return EINVAL;
@@ -580,6 +1271,11 @@ uint8_t log_key_value_store(KeyValueStore kvstore, int logfd) {
           return EINVAL;
         }
       }
+      if (node->expires != 0) {
+        if (dprintf(logfd, "%s=@%lu\n", node->key, node->expires) == -1) {
+          return EINVAL;
+        }
+      }
     }
   }
 
@@ -602,6 +1298,7 @@ uint8_t dump_key_value_store(KeyValueStore kvstore, char *filename) {
   FILE *fp;
   LinkedList list;
   Node node;
+  uint64_t now = timer_now();
 
   if ((fd = open(filename, O_WRONLY | O_CREAT,
                  0644)) == -1) { // Open file filename
@@ -614,6 +1311,9 @@ uint8_t dump_key_value_store(KeyValueStore kvstore, char *filename) {
   for (uint64_t i = 0; i < key_value_store_num_lists(kvstore); i++) {
     list = kvstore->lists[i];
     for (node = list->head; node != NULL; node = node->next) {
+      if (node->expires != 0 && node->expires <= now) {
+        continue;
+      }
       if (node->flag == 1) {
         if (dprintf(fd, "%s=%s\n", node->key, node->name) == -1) {
           return EINVAL;
@@ -623,6 +1323,11 @@ uint8_t dump_key_value_store(KeyValueStore kvstore, char *filename) {
           return EINVAL;
         }
       }
+      if (node->expires != 0) {
+        if (dprintf(fd, "%s=@%lu\n", node->key, node->expires) == -1) {
+          return EINVAL;
+        }
+      }
     }
   }
 
@@ -635,44 +1340,80 @@ uint8_t dump_key_value_store(KeyValueStore kvstore, char *filename) {
 }
 
 // Input: kvstore - the key-value store
-// Input: logfd - the file descriptor of the log file
-// Output: (0) if the key-value store was loaded successfully or EINVAL (22) if
-// the log file could not be opened or an invalid variable was encountered
+// Input: key - the key of a log record
+// Input: name - the value of a log record
+// Output: (0) if the record was replayed successfully or EINVAL (22) if it
+// holds an invalid variable
 //
-// Load the key-value store from the log file and return a status code
-uint8_t load_log(KeyValueStore kvstore, int logfd) {
-  if (kvstore == NULL) {
-    return EINVAL;
-  }
-
-  FILE *fp;
-  uint8_t key[32];
-  uint8_t name[32];
+// Replay a single key=value record of the log file
+uint8_t load_record(KeyValueStore kvstore, uint8_t *key, uint8_t *name) {
   int64_t value;
   char *ptr;
 
-  if ((fp = fdopen(logfd, "r")) == NULL) {
+  if (isnumber((char *)key)) {
     return EINVAL;
   }
 
-  while (fscanf(fp, "%[^'=']=%s\n", key, name) != EOF) {
-    if (isnumber((char *)key)) {
-      return EINVAL;
+  for (uint8_t i = 0; key[i] != 0; i++) {
+    // Check if a character is a valid character
+    if (i == 0) {
+      if (isdigit(key[i])) {
+        return EINVAL;
+      }
+      if (!isalpha(key[i])) {
+        return EINVAL;
+      }
+    } else {
+      if (!isdigit(key[i])) {
+        if (!isalpha(key[i])) {
+          if (key[i] != '_') {
+            return EINVAL;
+          }
+        }
+      }
     }
+  }
 
-    for (uint8_t i = 0; key[i] != 0; i++) {
+  if (name[0] == '@' && isnumber((char *)name + 1)) {
+    // A later record may still change the expiry, so a key that expired
+    // while the server was down is only hidden and is deleted by the next
+    // call to key_value_store_expire
+    key_value_store_set_expiry(kvstore, key,
+                               strtoull((char *)name + 1, &ptr, 10));
+  } else if (name[0] == '+' && isnumber((char *)name + 1)) {
+    // Replay an addition with wrapping, the final value fits even if a
+    // partial sum in log order does not
+    // The counter is changed in place, even if it expired, since a counter
+    // keeps its expiry and a later record may still move it
+    value = strtol((char *)name + 1, &ptr, 10);
+    uint64_t index = hash(key, key_value_store_num_lists(kvstore));
+    Node node = find_node(kvstore->lists[index], key);
+    if (node != NULL && node->flag == 0) {
+      node->value = (int64_t)((uint64_t)node->value + (uint64_t)value);
+      node->version = next_version(kvstore);
+      key_value_store_notify(kvstore, key, node->version);
+    } else {
+      key_value_store_insert_key_value(kvstore, key, value);
+    }
+  } else if (isnumber((char *)name)) {
+    value = strtol((char *)name, &ptr, 10);
+    key_value_store_insert_key_value(kvstore, key, value);
+  } else {
+    for (uint8_t i = 0; name[i] != 0; i++) {
       // Check if a character is a valid character
       if (i == 0) {
         if (isdigit(key[i])) {
           return EINVAL;
         }
-        if (!isalpha(key[i])) {
-          return EINVAL;
+        if (!isalpha(name[i])) {
+          if (name[i] != '~') {
+            return EINVAL;
+          }
         }
       } else {
-        if (!isdigit(key[i])) {
-          if (!isalpha(key[i])) {
-            if (key[i] != '_') {
+        if (!isdigit(name[i])) {
+          if (!isalpha(name[i])) {
+            if (name[i] != '_') {
               return EINVAL;
             }
           }
@@ -680,37 +1421,74 @@ uint8_t load_log(KeyValueStore kvstore, int logfd) {
       }
     }
 
-    if (isnumber((char *)name)) {
-      value = strtol((char *)name, &ptr, 10);
-      key_value_store_insert_key_value(kvstore, key, value);
+    if (name[0] == '~') {
+      key_value_store_delete_key(kvstore, key);
     } else {
-      for (uint8_t i = 0; name[i] != 0; i++) {
-        // Check if a character is a valid character
-        if (i == 0) {
-          if (isdigit(key[i])) {
-            return EINVAL;
-          }
-          if (!isalpha(name[i])) {
-            if (name[i] != '~') {
-              return EINVAL;
-            }
-          }
-        } else {
-          if (!isdigit(name[i])) {
-            if (!isalpha(name[i])) {
-              if (name[i] != '_') {
-                return EINVAL;
-              }
-            }
-          }
+      key_value_store_insert_key_name(kvstore, key, name);
+    }
+  }
+
+  return 0;
+}
+
+// Input: kvstore - the key-value store
+// Input: logfd - the file descriptor of the log file
+// Output: (0) if the key-value store was loaded successfully or EINVAL (22) if
+// the log file could not be opened or an invalid variable was encountered
+//
+// Load the key-value store from the log file and return a status code
+// The writes of a transaction are only replayed once the whole record has
+// been read, so a record torn by a crash is dropped
+uint8_t load_log(KeyValueStore kvstore, int logfd) {
+  if (kvstore == NULL) {
+    return EINVAL;
+  }
+
+  FILE *fp;
+  uint8_t key[32];
+  uint8_t name[32];
+  uint8_t status;
+  uint64_t count;
+  uint64_t num_read;
+  char *ptr;
+
+  if ((fp = fdopen(logfd, "r")) == NULL) {
+    return EINVAL;
+  }
+
+  while (fscanf(fp, "%[^'=']=%s\n", key, name) != EOF) {
+    if (strcmp((char *)key, "*") == 0) {
+      count = strtoul((char *)name, &ptr, 10);
+      if (*ptr != 0 || count == 0 || count > UINT8_MAX) {
+        return EINVAL;
+      }
+
+      uint8_t(*records)[2][32] =
+          (uint8_t(*)[2][32])calloc(count, sizeof(*records));
+      if (records == NULL) {
+        return EINVAL;
+      }
+
+      for (num_read = 0; num_read < count; num_read++) {
+        if (fscanf(fp, "%[^'=']=%s\n", records[num_read][0],
+                   records[num_read][1]) != 2) {
+          break;
         }
       }
 
-      if (name[0] == '~') {
-        key_value_store_delete_key(kvstore, key);
-      } else {
-        key_value_store_insert_key_name(kvstore, key, name);
+      status = 0;
+      if (num_read == count) {
+        for (uint64_t i = 0; i < count && status == 0; i++) {
+          status = load_record(kvstore, records[i][0], records[i][1]);
+        }
+      }
+
+      free(records);
+      if (status != 0) {
+        return status;
       }
+    } else if ((status = load_record(kvstore, key, name)) != 0) {
+      return status;
     }
 
     memset(key, 0, 32);
@@ -735,8 +1513,7 @@ uint8_t load_key_value_store(KeyValueStore kvstore, char *filename) {
   FILE *fp;
   uint8_t key[32];
   uint8_t name[32];
-  int64_t value;
-  char *ptr;
+  uint8_t status;
 
   if ((fd = open(filename, O_RDONLY, 0)) == -1) { // Open file filename
     warn("%s", filename);
@@ -748,61 +1525,8 @@ uint8_t load_key_value_store(KeyValueStore kvstore, char *filename) {
   }
 
   while (fscanf(fp, "%[^'=']=%s\n", key, name) != EOF) {
-    if (isnumber((char *)key)) {
-      return EINVAL;
-    }
-
-    for (uint8_t i = 0; key[i] != 0; i++) {
-      // Check if a character is a valid character
-      if (i == 0) {
-        if (isdigit(key[i])) {
-          return EINVAL;
-        }
-        if (!isalpha(key[i])) {
-          return EINVAL;
-        }
-      } else {
-        if (!isdigit(key[i])) {
-          if (!isalpha(key[i])) {
-            if (key[i] != '_') {
-              return EINVAL;
-            }
-          }
-        }
-      }
-    }
-
-    if (isnumber((char *)name)) {
-      value = strtol((char *)name, &ptr, 10);
-      key_value_store_insert_key_value(kvstore, key, value);
-    } else {
-      for (uint8_t i = 0; name[i] != 0; i++) {
-        // Check if a character is a valid character
-        if (i == 0) {
-          if (isdigit(key[i])) {
-            return EINVAL;
-          }
-          if (!isalpha(name[i])) {
-            if (name[i] != '~') {
-              return EINVAL;
-            }
-          }
-        } else {
-          if (!isdigit(name[i])) {
-            if (!isalpha(name[i])) {
-              if (name[i] != '_') {
-                return EINVAL;
-              }
-            }
-          }
-        }
-      }
-
-      if (name[0] == '~') {
-        key_value_store_delete_key(kvstore, key);
-      } else {
-        key_value_store_insert_key_name(kvstore, key, name);
-      }
+    if ((status = load_record(kvstore, key, name)) != 0) {
+      return status;
     }
 
     memset(key, 0, 32);
@@ -829,10 +1553,7 @@ uint8_t log_delete_key(uint8_t *key, int logfd) {
     return ENOENT;
   }
 
-  FILE *fp;
-  fp = fdopen(logfd, "w");
-
-  if (fseek(fp, 0, SEEK_END) == -1) {
+  if (lseek(logfd, 0, SEEK_END) == -1) {
     warn("%s", "log.txt");
     return EINVAL;
   }
@@ -877,14 +1598,17 @@ uint8_t clear_key_value_store(KeyValueStore kvstore) {
     return EINVAL;
   }
 
-  uint8_t *key;
+  uint8_t key[32];
   LinkedList list;
   Node node;
+  Node next;
 
   for (uint64_t i = 0; i < key_value_store_num_lists(kvstore); i++) {
     list = kvstore->lists[i];
-    for (node = list->head; node != NULL; node = node->next) {
-      key = node->key;
+    // The node is freed by the deletion, so keep what is needed from it
+    for (node = list->head; node != NULL; node = next) {
+      next = node->next;
+      memcpy(key, node->key, 32);
       key_value_store_delete_key(kvstore, key);
     }
   }
@@ -3,14 +3,33 @@
 
 #include <cstdint>
 
+#define WRITE_VALUE 0x00
+#define WRITE_NAME 0x09
+#define WRITE_DELETE 0x0F
+
 uint8_t isnumber(char *number);
 
 typedef struct KeyValueStoreObj *KeyValueStore;
 
+typedef struct KeyValueWriteObj {
+  uint8_t *key;
+  uint8_t *name;
+  int64_t value;
+  uint8_t kind;
+} KeyValueWriteObj;
+
+typedef struct KeyValueWriteObj *KeyValueWrite;
+
+typedef void (*KeyValueObserver)(void *arg, uint8_t *key, uint64_t version);
+
+typedef uint8_t (*KeyValueVisitor)(void *arg, uint8_t *key, uint8_t flag, int64_t value, uint8_t *name, uint64_t version);
+
 KeyValueStore create_key_value_store(uint64_t size);
 
 uint8_t delete_key_value_store(KeyValueStore *ptr);
 
+void key_value_store_observe(KeyValueStore kvstore, KeyValueObserver observer, void *arg);
+
 uint64_t key_value_store_num_keys(KeyValueStore kvstore);
 
 uint64_t key_value_store_num_lists(KeyValueStore kvstore);
@@ -23,14 +42,50 @@ int64_t key_value_store_key_value_lookup(KeyValueStore kvstore, uint8_t *key);
 
 uint8_t key_value_store_key_flag_lookup(KeyValueStore kvstore, uint8_t *key);
 
+uint64_t key_value_store_key_version(KeyValueStore kvstore, uint8_t *key);
+
+uint8_t key_value_store_resolve(KeyValueStore kvstore, uint8_t *key, uint8_t recursive, uint64_t max_iterations, int64_t *value);
+
+uint8_t key_value_store_key_read(KeyValueStore kvstore, uint8_t *key, uint8_t *flag, int64_t *value, uint8_t *name, uint64_t *version);
+
 uint8_t key_value_store_insert_key_name(KeyValueStore kvstore, uint8_t *key, uint8_t *name);
 
 uint8_t key_value_store_insert_key_value(KeyValueStore kvstore, uint8_t *key, int64_t value);
 
+uint8_t key_value_store_fetch_add(KeyValueStore kvstore, uint8_t *key, int64_t delta, int64_t *previous);
+
+uint8_t key_value_store_compare_and_swap(KeyValueStore kvstore, uint8_t *key, int64_t expected, int64_t desired, int64_t *previous);
+
 uint8_t key_value_store_delete_key(KeyValueStore kvstore, uint8_t *key);
 
+uint8_t key_value_store_set_expiry(KeyValueStore kvstore, uint8_t *key, uint64_t expires);
+
+uint64_t key_value_store_expire(KeyValueStore kvstore, uint64_t now, int fd);
+
+uint64_t key_value_store_num_expiring(KeyValueStore kvstore);
+
+uint64_t key_value_store_next_expiry(KeyValueStore kvstore);
+
+uint64_t key_value_store_scan(KeyValueStore kvstore, uint8_t *start, uint8_t after, KeyValueVisitor visitor, void *arg);
+
+void key_value_store_set_memory_limit(KeyValueStore kvstore, uint64_t max_memory);
+
+uint64_t key_value_store_memory(KeyValueStore kvstore);
+
+uint64_t key_value_store_evict(KeyValueStore kvstore, int fd);
+
+uint64_t key_value_store_num_evictions(KeyValueStore kvstore);
+
+uint64_t key_value_store_evicted_bytes(KeyValueStore kvstore);
+
 uint8_t log_insert_key(uint8_t *key, uint8_t *name, int64_t value, uint8_t flag, int fd);
 
+uint8_t log_add_key(uint8_t *key, int64_t delta, int fd);
+
+uint8_t log_expire_key(uint8_t *key, uint64_t expires, int fd);
+
+uint8_t log_transaction(KeyValueWrite writes, uint8_t num_writes, int fd);
+
 uint8_t log_key_value_store(KeyValueStore kvstore, int fd);
 
 uint8_t dump_key_value_store(KeyValueStore kvstore, char *filename);
@@ -1,5 +1,6 @@
 #include "rpcconvert.h"
 #include "rpcfile.h"
+#include "rpcfilecache.h"
 #include "rpcio.h"
 #include "rpckeyvaluestore.h"
 #include "rpcmath.h"
@@ -28,7 +29,7 @@
 #define PORT_NUMBER 8912
 #define DIR_NAME "data"
 #define BUFFER_SIZE 4096
-#define OPTIONS "H:N:I:d:"
+#define OPTIONS "H:N:F:I:C:B:R:W:M:Dd:"
 
 int main(int argc, char *argv[]) {
   int64_t option = 0;
@@ -40,14 +41,27 @@ int main(int argc, char *argv[]) {
   char *hostportstr = NULL;
   char *sizestr = NULL;
   char *nthreadsstr = NULL;
+  char *niothreadsstr = NULL;
   char *iterationsstr = NULL;
+  char *cachestr = NULL;
+  char *chunkstr = NULL;
+  char *readaheadstr = NULL;
+  char *windowsstr = NULL;
+  char *memorystr = NULL;
   char *dir_path = strdup(DIR_NAME);
   int dirfd = 0;
   int logfd = 0;
   long num;
   uint64_t size = 32;
   uint8_t nthreads = 4;
+  uint8_t niothreads = 2;
   uint64_t iterations = 50;
+  uint64_t cache_size = 64;
+  uint64_t chunk_size = DEFAULT_CHUNK_SIZE;
+  uint64_t readahead = DEFAULT_READAHEAD;
+  uint64_t windows = DEFAULT_FILE_WINDOWS;
+  uint64_t max_memory = 0;
+  uint8_t direct = 0;
 
   // getopt()
   while ((option = getopt(argc, argv, OPTIONS)) != -1) {
@@ -62,18 +76,56 @@ int main(int argc, char *argv[]) {
       strcpy(nthreadsstr, optarg);
       nthreads = strtol(nthreadsstr, &ptr, 10);
       break;
+    case 'F': // Sets the number of file I/O threads
+      niothreadsstr = (char *)calloc(strlen(optarg) + 1, sizeof(char));
+      strcpy(niothreadsstr, optarg);
+      niothreads = strtol(niothreadsstr, &ptr, 10);
+      break;
     case 'I': // Sets the number of recursive resolution iterations
       iterationsstr = (char *)calloc(strlen(optarg), sizeof(char));
       strcpy(iterationsstr, optarg);
       iterations = strtol(iterationsstr, &ptr, 10);
       break;
+    case 'C': // Sets the number of open file descriptors to cache
+      cachestr = (char *)calloc(strlen(optarg) + 1, sizeof(char));
+      strcpy(cachestr, optarg);
+      cache_size = strtol(cachestr, &ptr, 10);
+      break;
+    case 'B': // Sets the default chunk size for large transfers
+      chunkstr = (char *)calloc(strlen(optarg) + 1, sizeof(char));
+      strcpy(chunkstr, optarg);
+      chunk_size = strtol(chunkstr, &ptr, 10);
+      if (chunk_size < BUFFER_SIZE || chunk_size > MAX_CHUNK_SIZE) {
+        fprintf(stderr, "rpcserver: invalid chunk size\n");
+        exit(EXIT_FAILURE);
+      }
+      break;
+    case 'R': // Sets how far to read ahead of sequential readers (0 disables)
+      readaheadstr = (char *)calloc(strlen(optarg) + 1, sizeof(char));
+      strcpy(readaheadstr, optarg);
+      readahead = strtol(readaheadstr, &ptr, 10);
+      break;
+    case 'W': // Sets the number of file windows to keep mapped (0 disables)
+      windowsstr = (char *)calloc(strlen(optarg) + 1, sizeof(char));
+      strcpy(windowsstr, optarg);
+      windows = strtol(windowsstr, &ptr, 10);
+      break;
+    case 'M': // Sets the memory limit of the key-value store (0 disables)
+      memorystr = (char *)calloc(strlen(optarg) + 1, sizeof(char));
+      strcpy(memorystr, optarg);
+      max_memory = strtoull(memorystr, &ptr, 10);
+      break;
+    case 'D': // Bypasses the page cache for all large transfers
+      direct = 1;
+      break;
     case 'd': // Sets the scratch directory path for the server
       dir_path = (char *)calloc(strlen(optarg), sizeof(char));
       strcpy((char *)dir_path, optarg);
       break;
     default:
       fprintf(stderr, "usage: ./rpcserver [hostname:port] -H size -N nthreads "
-                      "-I iterations -d dir\n");
+                      "-F niothreads -I iterations -C entries -B chunk "
+                      "-R readahead -W windows -M memory -D -d dir\n");
       exit(EXIT_FAILURE);
     }
   }
@@ -87,7 +139,9 @@ int main(int argc, char *argv[]) {
       hostname = strtok(argv[optind], ":");
       if (hostname == NULL) {
         fprintf(stderr, "usage: ./rpcserver [hostname:port] -H size -N "
-                        "nthreads -I iterations -d dir\n");
+                        "nthreads -F niothreads -I iterations -C entries "
+                        "-B chunk -R readahead -W windows -M memory -D "
+                        "-d dir\n");
         exit(EXIT_FAILURE);
       }
 
@@ -111,7 +165,10 @@ int main(int argc, char *argv[]) {
   }
 
   pthread_mutex_t main_mutex; // Main mutex
-  pthread_mutex_t kvs_mutex;  // Key-value store mutex
+  pthread_rwlock_t kvs_lock;  // Key-value store lock
+  pthread_rwlockattr_t kvs_lock_attr;
+  pthread_mutex_t io_mutex;   // File I/O queue mutex
+  pthread_cond_t io_cv = PTHREAD_COND_INITIALIZER; // File I/O queue signal
   sem_t dispatch_lock;        // Dispatch lock semaphore
 
   // Open the directory specified on the command line
@@ -128,10 +185,36 @@ int main(int argc, char *argv[]) {
 
   KeyValueStore kvstore = create_key_value_store(size); // Key-value store
   load_log(kvstore, logfd);     // Load saved variables from the log file
+  // Evict variables past the memory limit, least recently used first
+  key_value_store_set_memory_limit(kvstore, max_memory);
+  key_value_store_evict(kvstore, logfd);
+  // Subscriptions to changes of variables
+  WatchTable watches = create_watch_table(DEFAULT_WATCH_EVENTS);
+  if (watches == NULL) {
+    err(2, "failed to create watch table");
+  }
+  key_value_store_observe(kvstore, watch_table_notify, watches);
   Queue queue = create_queue(); // Thread queue
+  Queue io_queue = create_queue(); // Connections waiting for a file I/O thread
+  Queue ready_queue = create_queue(); // Connections waiting for a worker
+  // Open file cache
+  FileCache fcache = create_file_cache(cache_size, readahead, windows);
+  // Aligned buffers for direct I/O, one for each thread that serves files
+  BufferPool bpool = create_buffer_pool(niothreads > 0 ? niothreads : nthreads,
+                                        DEFAULT_CHUNK_SIZE, DIRECT_ALIGNMENT);
+
+  server_init_dispatch(); // Map each opcode to the function that serves it
+
+  // Counters update the store under the read lock, so let a waiting writer
+  // go first rather than wait for them to stop
+  pthread_rwlockattr_init(&kvs_lock_attr);
+  pthread_rwlockattr_setkind_np(&kvs_lock_attr,
+                                PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+  pthread_rwlock_init(&kvs_lock, &kvs_lock_attr); // Init the k-v store lock
 
   Thread threads[nthreads]; // Thread array
   Thread thread;            // Thread object
+  Thread io_thread;         // File I/O thread object
   pthread_t threadPointer;  // THread pointer
   uint64_t i;
 
@@ -141,18 +224,30 @@ int main(int argc, char *argv[]) {
     threads[i] = (ThreadObj *)malloc(sizeof(ThreadObj));
     thread = threads[i];
     thread->cl = 0;
+    thread->detached = 0;
     thread->id = i;
     thread->iterations = iterations;
+    thread->chunk_size = chunk_size;
+    thread->direct = direct;
     thread->dirfd = &dirfd;
     thread->logfd = &logfd;
     thread->kvstore = kvstore;
+    thread->fcache = fcache;
+    thread->bpool = bpool;
+    thread->pcache = create_program_cache(DEFAULT_PROGRAM_CACHE_SIZE);
+    thread->watches = watches;
     thread->queue = queue;
+    thread->io_queue = io_queue;
+    thread->ready_queue = ready_queue;
+    thread->io_threads = niothreads;
+    thread->threads = threads;
     thread->cv = PTHREAD_COND_INITIALIZER;
+    thread->io_cv = &io_cv;
     thread->main_mutex = &main_mutex;
-    thread->kvs_mutex = &kvs_mutex;
+    thread->kvs_lock = &kvs_lock;
+    thread->io_mutex = &io_mutex;
     thread->dispatch_lock = &dispatch_lock;
     pthread_mutex_init(thread->main_mutex, NULL); // Initialize the main mutex
-    pthread_mutex_init(thread->kvs_mutex, NULL); // Init the k-v store mutex
     
     // Initialize the dispatch lock semaphore
     if (sem_init(thread->dispatch_lock, 0, nthreads)) {
@@ -167,6 +262,37 @@ int main(int argc, char *argv[]) {
     }
   }
 
+  pthread_mutex_init(&io_mutex, NULL); // Initialize the file I/O queue mutex
+
+  // Initialize file I/O threads
+  // They share everything with the worker threads except their own buffer
+  for (i = 0; i < niothreads; i++) {
+    io_thread = (ThreadObj *)malloc(sizeof(ThreadObj));
+    memcpy(io_thread, thread, sizeof(ThreadObj));
+    io_thread->cl = 0;
+    io_thread->id = nthreads + i;
+    io_thread->pcache = create_program_cache(DEFAULT_PROGRAM_CACHE_SIZE);
+    io_thread->cv = PTHREAD_COND_INITIALIZER;
+
+    // Create a new file I/O thread
+    if (pthread_create(&threadPointer, 0, server_io_start, io_thread)) {
+      err(2, "pthread_create");
+    }
+  }
+
+  // Start the thread that pushes change events to watching connections
+  if (pthread_create(&threadPointer, 0, watch_table_start, watches)) {
+    err(2, "pthread_create");
+  }
+
+  // Start the thread that deletes variables once they expire
+  // It shares the k-v store, its lock and the log with the worker threads
+  ThreadObj *expire_thread = (ThreadObj *)malloc(sizeof(ThreadObj));
+  memcpy(expire_thread, thread, sizeof(ThreadObj));
+  if (pthread_create(&threadPointer, 0, server_expire_start, expire_thread)) {
+    err(2, "pthread_create");
+  }
+
   // Set up the socket connection
   if ((sockfd = server_connect(hostname, port)) < 0) {
     err(1, "failed listening");
@@ -174,20 +300,7 @@ int main(int argc, char *argv[]) {
 
   while (true) {
     connfd = accept(sockfd, NULL, NULL); // Accept incoming client connections
-    sem_wait(thread->dispatch_lock); // Make the dispatch lock wait
-    
-    pthread_mutex_lock(thread->main_mutex); // Lock the main mutex
-    // ------------------------------------------------------------------------
-    // Begin critical section
-
-    i = dequeue(thread->queue); // Get first available thread id
-    thread = threads[i]; // Get the ith thread in the thread array
-    thread->cl = connfd; // Assign the connection file descriptor to the thread
-    pthread_cond_signal(&(thread->cv)); // Signal the current thread
-
-    // End critical section
-    // ------------------------------------------------------------------------
-    pthread_mutex_unlock(thread->main_mutex); // Unlock the main mutex
+    server_dispatch(thread, connfd); // Hand it to an idle worker thread
   }
 
   return EXIT_SUCCESS;
@@ -1,6 +1,7 @@
 #ifndef __RPCMATH_H__
 #define __RPCMATH_H__
 
+#include <cerrno>
 #include <cstdint>
 
 int64_t add(int64_t a, int64_t b);
@@ -13,4 +14,43 @@ int64_t divide(int64_t a, int64_t b);
 
 int64_t mod(int64_t a, int64_t b);
 
+// Checked arithmetic
+// Each kernel stores the result through a pointer and returns (0) or the
+// error, so that every int64_t is a valid result. They are defined here so
+// that they inline into their callers.
+
+// Add two numbers, EOVERFLOW (75) if the sum does not fit
+inline uint8_t checked_add(int64_t a, int64_t b, int64_t *result) {
+  return __builtin_add_overflow(a, b, result) ? EOVERFLOW : 0;
+}
+
+// Subtract two numbers, EOVERFLOW (75) if the difference does not fit
+inline uint8_t checked_sub(int64_t a, int64_t b, int64_t *result) {
+  return __builtin_sub_overflow(a, b, result) ? EOVERFLOW : 0;
+}
+
+// Multiply two numbers, EOVERFLOW (75) if the product does not fit
+inline uint8_t checked_mul(int64_t a, int64_t b, int64_t *result) {
+  return __builtin_mul_overflow(a, b, result) ? EOVERFLOW : 0;
+}
+
+// Divide two numbers, EINVAL (22) if b is 0 or EOVERFLOW (75) for
+// INT64_MIN / -1
+inline uint8_t checked_divide(int64_t a, int64_t b, int64_t *result) {
+  uint8_t zero = b == 0;
+  uint8_t overflow = (a == INT64_MIN) & (b == -1);
+  // Divide by 1 instead of trapping, the result is discarded anyway
+  *result = a / ((zero | overflow) ? 1 : b);
+  return zero ? EINVAL : (overflow ? EOVERFLOW : 0);
+}
+
+// Mod two numbers, EINVAL (22) if b is 0
+// Any number mod -1 is 0, even INT64_MIN, but the hardware traps on
+// INT64_MIN % -1 as it does on the division, so mod by 1 instead
+inline uint8_t checked_mod(int64_t a, int64_t b, int64_t *result) {
+  uint8_t zero = b == 0;
+  *result = a % ((zero | (b == -1)) ? 1 : b);
+  return zero ? EINVAL : 0;
+}
+
 #endif
@@ -0,0 +1,115 @@
+#include "rpcmath.h"
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <time.h>
+
+#define NUM_PAIRS (1 << 16)
+#define NUM_ROUNDS 512
+
+typedef int64_t (*Legacy)(int64_t a, int64_t b);
+
+typedef uint8_t (*Checked)(int64_t a, int64_t b, int64_t *result);
+
+// Get the current time in nanoseconds
+uint64_t bench_now() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000000L + now.tv_nsec;
+}
+
+// Time a sentinel kernel the way the server used to call it, including the
+// check that tells a real result of EOVERFLOW apart from an error
+template <Legacy kernel>
+double bench_legacy(int64_t *a, int64_t *b, int64_t *sink) {
+  uint64_t start = bench_now();
+  int64_t total = 0;
+
+  for (uint64_t round = 0; round < NUM_ROUNDS; round++) {
+    for (uint64_t i = 0; i < NUM_PAIRS; i++) {
+      int64_t result = kernel(a[i], b[i]);
+      if (result == EOVERFLOW || result == EINVAL) {
+        total += (b[i] == 0) ? 1 : 2;
+      } else {
+        total += result;
+      }
+    }
+  }
+
+  *sink += total;
+  return (double)(bench_now() - start) / ((double)NUM_ROUNDS * NUM_PAIRS);
+}
+
+// Call a checked kernel out of line, the way the legacy kernels in
+// rpcmath.o are called, so that the two are compared on equal terms
+template <Checked kernel>
+__attribute__((noinline)) uint8_t out_of_line(int64_t a, int64_t b,
+                                              int64_t *result) {
+  return kernel(a, b, result);
+}
+
+// Time a checked kernel
+template <Checked kernel>
+double bench_checked(int64_t *a, int64_t *b, int64_t *sink) {
+  uint64_t start = bench_now();
+  int64_t total = 0;
+
+  for (uint64_t round = 0; round < NUM_ROUNDS; round++) {
+    for (uint64_t i = 0; i < NUM_PAIRS; i++) {
+      int64_t result;
+      uint8_t status = kernel(a[i], b[i], &result);
+      total += (status != 0) ? status : result;
+    }
+  }
+
+  *sink += total;
+  return (double)(bench_now() - start) / ((double)NUM_ROUNDS * NUM_PAIRS);
+}
+
+// Compare the per-operation cost of the sentinel and checked kernels
+int main() {
+  int64_t *a = (int64_t *)malloc(NUM_PAIRS * sizeof(int64_t));
+  int64_t *b = (int64_t *)malloc(NUM_PAIRS * sizeof(int64_t));
+  int64_t sink = 0;
+
+  if (a == NULL || b == NULL) {
+    fprintf(stderr, "rpcmathbench: out of memory\n");
+    return EXIT_FAILURE;
+  }
+
+  // Mostly small operands with some that overflow or divide by zero
+  srand(1);
+  for (uint64_t i = 0; i < NUM_PAIRS; i++) {
+    a[i] = (i % 16 == 0) ? INT64_MAX - rand() % 4 : rand() - RAND_MAX / 2;
+    b[i] = (i % 64 == 1) ? 0 : rand() % 100000 - 50000;
+  }
+
+  // Both kernels are called out of line in the first two columns, the last
+  // one shows the checked kernel inlined into the loop as the server uses it
+  printf("%-8s %12s %12s %12s\n", "op", "legacy ns", "checked ns",
+         "inlined ns");
+  printf("%-8s %12.3f %12.3f %12.3f\n", "add", bench_legacy<add>(a, b, &sink),
+         bench_checked<out_of_line<checked_add>>(a, b, &sink),
+         bench_checked<checked_add>(a, b, &sink));
+  printf("%-8s %12.3f %12.3f %12.3f\n", "sub", bench_legacy<sub>(a, b, &sink),
+         bench_checked<out_of_line<checked_sub>>(a, b, &sink),
+         bench_checked<checked_sub>(a, b, &sink));
+  printf("%-8s %12.3f %12.3f %12.3f\n", "mul", bench_legacy<mul>(a, b, &sink),
+         bench_checked<out_of_line<checked_mul>>(a, b, &sink),
+         bench_checked<checked_mul>(a, b, &sink));
+  printf("%-8s %12.3f %12.3f %12.3f\n", "divide",
+         bench_legacy<divide>(a, b, &sink),
+         bench_checked<out_of_line<checked_divide>>(a, b, &sink),
+         bench_checked<checked_divide>(a, b, &sink));
+  printf("%-8s %12.3f %12.3f %12.3f\n", "mod", bench_legacy<mod>(a, b, &sink),
+         bench_checked<out_of_line<checked_mod>>(a, b, &sink),
+         bench_checked<checked_mod>(a, b, &sink));
+
+  // Keep the results alive so that the loops are not optimised away
+  fprintf(stderr, "checksum %ld\n", (long)sink);
+
+  free(a);
+  free(b);
+  return 0;
+}
@@ -0,0 +1,286 @@
+#include "rpcrangelock.h"
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <pthread.h>
+#include <time.h>
+
+typedef struct RangeObj *Range;
+
+typedef struct RangeObj {
+  uint64_t start;
+  uint64_t end;
+  uint8_t exclusive;
+  struct RangeObj *next;
+} RangeObj;
+
+typedef struct InodeLocksObj *InodeLocks;
+
+typedef struct InodeLocksObj {
+  uint64_t dev;
+  uint64_t ino;
+  uint64_t num_waiters;
+  Range ranges;
+  pthread_cond_t cv;
+  struct InodeLocksObj *next;
+} InodeLocksObj;
+
+typedef struct RangeLocksObj {
+  uint64_t num_lists;
+  InodeLocks *lists;
+  uint64_t num_waits;
+  uint64_t wait_time;
+  pthread_mutex_t mutex;
+} RangeLocksObj;
+
+// Input: locks - the range lock table
+// Input: dev - the device of the file
+// Input: ino - the inode of the file
+// Input: create - (1) if a missing record should be created
+// Output: the lock record for the inode or NULL
+//
+// Find the lock record for a specific inode
+InodeLocks find_inode_locks(RangeLocks locks, uint64_t dev, uint64_t ino,
+                            uint8_t create) {
+  uint64_t index = (ino ^ (dev * 0x9e3779b97f4a7c15L)) % locks->num_lists;
+  InodeLocks record = locks->lists[index];
+  while (record != NULL) {
+    if (record->dev == dev && record->ino == ino) {
+      return record;
+    }
+    record = record->next;
+  }
+  if (create) {
+    record = (InodeLocksObj *)malloc(sizeof(InodeLocksObj));
+    if (record != NULL) {
+      record->dev = dev;
+      record->ino = ino;
+      record->num_waiters = 0;
+      record->ranges = NULL;
+      pthread_cond_init(&(record->cv), NULL);
+      record->next = locks->lists[index];
+      locks->lists[index] = record;
+    }
+  }
+  return record;
+}
+
+// Input: locks - the range lock table
+// Input: record - the lock record to delete
+// Output: none
+//
+// Delete a lock record once nothing holds or waits for one of its ranges
+void delete_inode_locks(RangeLocks locks, InodeLocks record) {
+  if (record->ranges != NULL || record->num_waiters > 0) {
+    return;
+  }
+  uint64_t index =
+      (record->ino ^ (record->dev * 0x9e3779b97f4a7c15L)) % locks->num_lists;
+  InodeLocks *link = &(locks->lists[index]);
+  while (*link != NULL && *link != record) {
+    link = &((*link)->next);
+  }
+  if (*link != NULL) {
+    *link = record->next;
+  }
+  pthread_cond_destroy(&(record->cv));
+  free(record);
+  return;
+}
+
+// Input: record - the lock record of a file
+// Input: start - the first byte of the range
+// Input: end - one past the last byte of the range
+// Input: exclusive - (1) if the range is to be written
+// Output: (1) if a range held by someone else overlaps and either is exclusive
+//
+// Check if a range conflicts with the ranges already held on a file
+uint8_t range_conflict(InodeLocks record, uint64_t start, uint64_t end,
+                       uint8_t exclusive) {
+  for (Range range = record->ranges; range != NULL; range = range->next) {
+    if (range->start < end && start < range->end &&
+        (exclusive || range->exclusive)) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Input: size - the number of lists in the hash table of inodes
+// Output: the newly created range lock table
+//
+// Create a range lock table
+RangeLocks create_range_locks(uint64_t size) {
+  RangeLocks locks = (RangeLocksObj *)malloc(sizeof(RangeLocksObj));
+  if (locks != NULL) {
+    locks->num_lists = size > 0 ? size : 1;
+    locks->lists = (InodeLocks *)calloc(locks->num_lists, sizeof(InodeLocks));
+    locks->num_waits = 0;
+    locks->wait_time = 0;
+    pthread_mutex_init(&(locks->mutex), NULL);
+    if (locks->lists == NULL) {
+      free(locks);
+      return NULL;
+    }
+  }
+  return locks;
+}
+
+// Input: ptr - pointer to a range lock table
+// Output: (0) if the table was deleted successfully, EINVAL (22) if the
+// pointer or contents of the table do not exist
+//
+// Delete a range lock table that has no locks held
+uint8_t delete_range_locks(RangeLocks *ptr) {
+  if (ptr != NULL && *ptr != NULL) {
+    RangeLocks locks = *ptr;
+    pthread_mutex_destroy(&(locks->mutex));
+    free(locks->lists);
+    free(locks);
+    *ptr = NULL;
+    return 0;
+  } else {
+    return EINVAL;
+  }
+}
+
+// Input: locks - the range lock table
+// Input: dev - the device of the file
+// Input: ino - the inode of the file
+// Input: offset - the first byte of the range
+// Input: length - the number of bytes in the range
+// Input: exclusive - (1) to lock the range for writing, (0) for reading
+// Output: (0) if the range was locked or ENOMEM (12) if the lock could not be
+// recorded, in which case nothing is held
+//
+// Lock a byte range of a file, waiting for any overlapping range that
+// conflicts with it. Readers share ranges, writers need them to themselves.
+uint8_t range_lock(RangeLocks locks, uint64_t dev, uint64_t ino,
+                   uint64_t offset, uint64_t length, uint8_t exclusive) {
+  if (locks == NULL || length == 0) {
+    return 0;
+  }
+
+  uint64_t end = offset + length < offset ? UINT64_MAX : offset + length;
+  Range range = (RangeObj *)malloc(sizeof(RangeObj));
+  struct timespec start_time;
+  struct timespec end_time;
+  InodeLocks record;
+
+  if (range == NULL) {
+    return ENOMEM;
+  }
+
+  range->start = offset;
+  range->end = end;
+  range->exclusive = exclusive;
+
+  pthread_mutex_lock(&(locks->mutex)); // Lock the range lock table mutex
+  // --------------------------------------------------------------------------
+  // Begin critical section
+
+  record = find_inode_locks(locks, dev, ino, 1);
+
+  if (record == NULL) {
+    pthread_mutex_unlock(&(locks->mutex));
+    free(range);
+    return ENOMEM;
+  }
+
+  if (range_conflict(record, offset, end, exclusive)) {
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
+    record->num_waiters++;
+    do {
+      pthread_cond_wait(&(record->cv), &(locks->mutex));
+    } while (range_conflict(record, offset, end, exclusive));
+    record->num_waiters--;
+    clock_gettime(CLOCK_MONOTONIC, &end_time);
+    locks->num_waits++;
+    locks->wait_time += (end_time.tv_sec - start_time.tv_sec) * 1000000000L +
+                        (end_time.tv_nsec - start_time.tv_nsec);
+  }
+
+  range->next = record->ranges;
+  record->ranges = range;
+
+  // End critical section
+  // --------------------------------------------------------------------------
+  pthread_mutex_unlock(&(locks->mutex)); // Unlock the range lock table mutex
+  return 0;
+}
+
+// Input: locks - the range lock table
+// Input: dev - the device of the file
+// Input: ino - the inode of the file
+// Input: offset - the first byte of the range
+// Input: length - the number of bytes in the range
+// Input: exclusive - the mode the range was locked with
+// Output: none
+//
+// Unlock a byte range that was locked with range_lock()
+void range_unlock(RangeLocks locks, uint64_t dev, uint64_t ino,
+                  uint64_t offset, uint64_t length, uint8_t exclusive) {
+  if (locks == NULL || length == 0) {
+    return;
+  }
+
+  uint64_t end = offset + length < offset ? UINT64_MAX : offset + length;
+  Range range = NULL;
+  InodeLocks record;
+
+  pthread_mutex_lock(&(locks->mutex)); // Lock the range lock table mutex
+  // --------------------------------------------------------------------------
+  // Begin critical section
+
+  if ((record = find_inode_locks(locks, dev, ino, 0)) != NULL) {
+    Range *link = &(record->ranges);
+    while (*link != NULL) {
+      if ((*link)->start == offset && (*link)->end == end &&
+          (*link)->exclusive == exclusive) {
+        range = *link;
+        *link = range->next;
+        break;
+      }
+      link = &((*link)->next);
+    }
+    if (record->num_waiters > 0) {
+      pthread_cond_broadcast(&(record->cv));
+    }
+    delete_inode_locks(locks, record);
+  }
+
+  // End critical section
+  // --------------------------------------------------------------------------
+  pthread_mutex_unlock(&(locks->mutex)); // Unlock the range lock table mutex
+
+  free(range);
+  return;
+}
+
+// Input: locks - the range lock table
+// Output: the number of times a lock had to wait for a conflicting range
+//
+// Get the number of range lock waits
+uint64_t range_locks_num_waits(RangeLocks locks) {
+  if (locks == NULL) {
+    return 0;
+  }
+  pthread_mutex_lock(&(locks->mutex));
+  uint64_t num_waits = locks->num_waits;
+  pthread_mutex_unlock(&(locks->mutex));
+  return num_waits;
+}
+
+// Input: locks - the range lock table
+// Output: the total time spent waiting for conflicting ranges in nanoseconds
+//
+// Get the total range lock wait time
+uint64_t range_locks_wait_time(RangeLocks locks) {
+  if (locks == NULL) {
+    return 0;
+  }
+  pthread_mutex_lock(&(locks->mutex));
+  uint64_t wait_time = locks->wait_time;
+  pthread_mutex_unlock(&(locks->mutex));
+  return wait_time;
+}
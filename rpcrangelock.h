@@ -0,0 +1,20 @@
+#ifndef __RPCRANGELOCK_H__
+#define __RPCRANGELOCK_H__
+
+#include <cstdint>
+
+typedef struct RangeLocksObj *RangeLocks;
+
+RangeLocks create_range_locks(uint64_t size);
+
+uint8_t delete_range_locks(RangeLocks *ptr);
+
+uint8_t range_lock(RangeLocks locks, uint64_t dev, uint64_t ino, uint64_t offset, uint64_t length, uint8_t exclusive);
+
+void range_unlock(RangeLocks locks, uint64_t dev, uint64_t ino, uint64_t offset, uint64_t length, uint8_t exclusive);
+
+uint64_t range_locks_num_waits(RangeLocks locks);
+
+uint64_t range_locks_wait_time(RangeLocks locks);
+
+#endif
@@ -1,10 +1,14 @@
 #include "rpcserver.h"
 #include "rpcconvert.h"
+#include "rpcexpr.h"
 #include "rpcfile.h"
 #include "rpcio.h"
 #include "rpckeyvaluestore.h"
 #include "rpcmath.h"
 #include "rpcqueue.h"
+#include "rpcrangelock.h"
+#include "rpctimer.h"
+#include "rpcvector.h"
 #include <arpa/inet.h>
 #include <cctype>
 #include <cerrno>
@@ -14,6 +18,7 @@
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <endian.h>
 #include <err.h>
 #include <fcntl.h>
 #include <netdb.h>
@@ -64,1051 +69,1661 @@ int server_connect(char *hostname, uint16_t port) {
   return sock;
 }
 
-// Process an RPC request
-int server_run(int connfd, Thread thread) {
-  uint16_t buff_size = 0;
-  int64_t bytes_read = 0;
-  int64_t bytes_received = 0;
-  int64_t bytes_remaining;
-  int64_t bytes_written = 0;
-  uint8_t *data = NULL;
-  uint64_t file_size = 0;
-  uint8_t *filename = NULL;
-  uint16_t filename_length = 0;
-  uint8_t flag = 0;
-  uint16_t function = 0;
-  uint32_t identifier = 0;
-  uint64_t iterations = 0;
-  uint32_t magic_number = 0;
+// Get the chunk size to use for a large transfer
+// A chunk size of 0 selects the server default
+uint64_t transfer_chunk_size(Thread thread, uint32_t chunk) {
+  if (chunk == 0) {
+    return thread->chunk_size;
+  }
+
+  if (chunk < BUFFER_SIZE) {
+    return BUFFER_SIZE;
+  }
+
+  if (chunk > MAX_CHUNK_SIZE) {
+    return MAX_CHUNK_SIZE;
+  }
+
+  return chunk;
+}
+
+// Get the current value of a server statistic
+uint8_t server_statistic(Thread thread, uint16_t stat, uint64_t *value) {
+  switch (stat) {
+  case STAT_FILE_LOCK_WAITS:
+    *value = range_locks_num_waits(file_cache_range_locks(thread->fcache));
+    break;
+  case STAT_FILE_LOCK_WAIT_TIME:
+    *value = range_locks_wait_time(file_cache_range_locks(thread->fcache));
+    break;
+  case STAT_FILE_CACHE_ENTRIES:
+    *value = file_cache_num_entries(thread->fcache);
+    break;
+  case STAT_FILE_WINDOWS:
+    *value = file_cache_num_windows(thread->fcache);
+    break;
+  case STAT_WATCH_SUBSCRIBERS:
+    *value = watch_table_num_subscribers(thread->watches);
+    break;
+  case STAT_WATCH_OVERFLOWS:
+    *value = watch_table_num_overflows(thread->watches);
+    break;
+  case STAT_EXPIRING_KEYS:
+    *value = key_value_store_num_expiring(thread->kvstore);
+    break;
+  case STAT_MEMORY:
+    *value = key_value_store_memory(thread->kvstore);
+    break;
+  case STAT_EVICTIONS:
+    *value = key_value_store_num_evictions(thread->kvstore);
+    break;
+  case STAT_EVICTED_BYTES:
+    *value = key_value_store_evicted_bytes(thread->kvstore);
+    break;
+  default:
+    return EINVAL;
+  }
+
+  return 0;
+}
+
+// The operands of a 0x01XX request and the state of its evaluation
+typedef struct OperandsObj {
+  uint8_t var;
+  uint8_t a_exists;
+  uint8_t b_exists;
+  uint8_t result_exists;
+  uint8_t recursive;
+  uint8_t versioned;
+  uint8_t expiring;
+  uint8_t *var_a;
+  uint8_t *var_b;
+  uint8_t *var_result;
+  int64_t val_a;
+  int64_t val_b;
+  int64_t result;
+  uint64_t version_a;
+  uint64_t version_b;
+  uint64_t version_result;
+  uint64_t ttl;
+  int64_t status;
+} OperandsObj;
+
+typedef struct OperandsObj *Operands;
+
+// Operand kinds of an arithmetic request, the high nibble of its opcode
+#define KIND_A_VARIABLE 0x01
+#define KIND_B_VARIABLE 0x02
+#define KIND_RESULT_VARIABLE 0x04
+#define KIND_RECURSIVE 0x08
+#define KIND_VARIABLES 0x07
+#define NUM_KINDS 16
+
+// 0x05XX requests are 0x01XX requests whose responses carry versions
+#define VERSIONED_GROUP 0x05
+// 0x06XX and 0x07XX requests are 0x01XX and 0x05XX requests that store a
+// variable and end with the number of milliseconds it lives for
+#define EXPIRING_GROUP 0x06
+#define VERSIONED_EXPIRING_GROUP 0x07
+
+// A Scan request lists the variables that start with a prefix instead of
+// those in a range
+#define SCAN_PREFIX 0x01
+// The largest entry of a scan response is 73 bytes: the length and at most 31
+// bytes of a variable name, its version, its flag and the length and at most
+// 31 bytes of the variable name it holds, which is longer than a value
+// After the 7 byte header of id, status, count and flag a page of 4096 bytes
+// holds (4096 - 7) / 73 = 56 entries
+#define SCAN_ENTRY_SIZE ((1 + 31) + 8 + 1 + (1 + 31))
+#define SCAN_MAX_KEYS ((BUFFER_SIZE - 7) / SCAN_ENTRY_SIZE)
+
+// Handlers indexed by the high and low byte of an opcode
+static Handler dispatch_table[DISPATCH_GROUPS][256];
+
+// Receive a variable name and check that it is a valid identifier
+// A name that is too long or empty is left unread and set to NULL
+uint8_t server_recv_name(int connfd, uint8_t **ptr, uint8_t result) {
+  uint8_t length = recv_uint8(connfd);
+  uint8_t status = 0;
   uint8_t *name = NULL;
-  uint64_t offset = 0;
-  uint16_t opcode = 0;
-  uint8_t recursive = 0;
-  int64_t result = 0;
-  int64_t status = 0;
-  uint8_t *temp = NULL;
-  int64_t val_a = 0;
-  int64_t val_b = 0;
-  uint8_t *var_a = NULL;
-  uint8_t *var_b = NULL;
-  uint8_t *var_result = 0;
-  uint8_t var_a_length = 0;
-  uint8_t var_b_length = 0;
-  uint8_t var_result_length = 0;
-
-  opcode = wire_to_uint16(thread->buffer, 0, 1);
-  identifier = wire_to_uint32(thread->buffer, 2, 5);
 
-  uint8_t var = opcode & 0xFF;
-  uint8_t a_exists = 0;
-  uint8_t b_exists = 0;
-  uint8_t result_exists = 0;
-
-  if (opcode & (1 << 8) && !(opcode & (1 << 9))) { // If opcode is 0x1XX
-    function = opcode &= ~(0xF << 4);
-
-    // If variable a needs to be received or a variable needs to be deleted
-    if ((var & (1 << 3)) || (var & (1 << 4)) || (var == 0xF)) {
-      a_exists = 1;
-      var_a_length = recv_uint8(connfd);
-
-      if (var_a_length >= 1 && var_a_length <= 31) {
-        var_a = (uint8_t *)calloc(var_a_length + 1, sizeof(uint8_t));
-        bytes_received = recv_string(connfd, var_a, var_a_length, 1);
-
-        for (uint8_t i = 0; var_a[i] != 0; i++) {
-          // Check if a character is a valid character
-          if (i == 0) {
-            if (isdigit(var_a[i])) {
-              status = EINVAL;
-            }
-            if (!isalpha(var_a[i])) {
-              status = EINVAL;
-            }
-          } else {
-            if (!isdigit(var_a[i])) {
-              if (!isalpha(var_a[i])) {
-                if (var_a[i] != '_') {
-                  status = EINVAL;
-                }
-              }
-            }
+  if (length >= 1 && length <= 31) {
+    name = (uint8_t *)calloc(length + 1, sizeof(uint8_t));
+    recv_string(connfd, name, length, 1);
+
+    if (result && isnumber((char *)name)) {
+      status = EINVAL;
+    } else {
+      for (uint8_t i = 0; name[i] != 0; i++) {
+        // Check if a character is a valid character
+        if (i == 0) {
+          if (!isalpha(name[i])) {
+            status = EINVAL;
           }
+        } else if (!isalnum(name[i]) && name[i] != '_') {
+          status = EINVAL;
         }
       }
+    }
+  }
+
+  *ptr = name;
+  return status;
+}
+
+// Decode the operands of a 0x01XX request
+// The low byte of the opcode says which operands are variables
+void server_decode_operands(int connfd, uint16_t opcode, Operands ops) {
+  uint8_t var = opcode & 0xFF;
+
+  memset(ops, 0, sizeof(OperandsObj));
+  ops->var = var;
+  ops->versioned = (opcode >> 8) == VERSIONED_GROUP ||
+                   (opcode >> 8) == VERSIONED_EXPIRING_GROUP;
+  ops->expiring = (opcode >> 8) == EXPIRING_GROUP ||
+                  (opcode >> 8) == VERSIONED_EXPIRING_GROUP;
+
+  // If variable a needs to be received or a variable needs to be deleted
+  if ((var & (1 << 3)) || (var & (1 << 4)) || (var == 0xF)) {
+    ops->a_exists = 1;
+    ops->status |= server_recv_name(connfd, &(ops->var_a), 0);
+  } else {
+    ops->val_a = recv_uint64(connfd);
+  }
+
+  // If variable b needs to be received
+  if ((var & (1 << 5)) || (var == 0x9)) {
+    ops->b_exists = 1;
+    ops->status |= server_recv_name(connfd, &(ops->var_b), 0);
+  } else if (var != 0x8 && var != 0xF) {
+    ops->val_b = recv_uint64(connfd);
+  }
+
+  // If the result needs to be stored as a variable
+  if (var & (1 << 6)) {
+    ops->result_exists = 1;
+    ops->status |= server_recv_name(connfd, &(ops->var_result), 1);
+  }
+
+  ops->recursive = (var & (1 << 7)) ? 1 : 0;
+
+  if (ops->expiring) {
+    ops->ttl = recv_uint64(connfd);
+  }
+}
+
+// Free the variable names of a decoded request
+void server_free_operands(Operands ops) {
+  free(ops->var_a);
+  free(ops->var_b);
+  free(ops->var_result);
+  ops->var_a = NULL;
+  ops->var_b = NULL;
+  ops->var_result = NULL;
+}
+
+// Arithmetic operations
+struct AddOp {
+  static uint8_t apply(int64_t a, int64_t b, int64_t *result) {
+    return checked_add(a, b, result);
+  }
+};
+
+struct SubOp {
+  static uint8_t apply(int64_t a, int64_t b, int64_t *result) {
+    return checked_sub(a, b, result);
+  }
+};
+
+struct MulOp {
+  static uint8_t apply(int64_t a, int64_t b, int64_t *result) {
+    return checked_mul(a, b, result);
+  }
+};
+
+struct DivOp {
+  static uint8_t apply(int64_t a, int64_t b, int64_t *result) {
+    return checked_divide(a, b, result);
+  }
+};
+
+struct ModOp {
+  static uint8_t apply(int64_t a, int64_t b, int64_t *result) {
+    return checked_mod(a, b, result);
+  }
+};
+
+// Decode the operands of an arithmetic request of a specific kind
+// Literal operands are read straight into their values
+template <uint8_t Kind> void server_decode_arithmetic(int connfd, Operands ops) {
+  ops->status = 0;
+  ops->var_a = NULL;
+  ops->var_b = NULL;
+  ops->var_result = NULL;
+  ops->version_a = 0;
+  ops->version_b = 0;
+  ops->version_result = 0;
+
+  if (Kind & KIND_A_VARIABLE) {
+    ops->status |= server_recv_name(connfd, &(ops->var_a), 0);
+  } else {
+    ops->val_a = recv_uint64(connfd);
+  }
+
+  if (Kind & KIND_B_VARIABLE) {
+    ops->status |= server_recv_name(connfd, &(ops->var_b), 0);
+  } else {
+    ops->val_b = recv_uint64(connfd);
+  }
+
+  if (Kind & KIND_RESULT_VARIABLE) {
+    ops->status |= server_recv_name(connfd, &(ops->var_result), 1);
+  }
+
+  if ((Kind & KIND_RESULT_VARIABLE) && ops->expiring) {
+    ops->ttl = recv_uint64(connfd);
+  }
+}
+
+// Make a variable expire after a number of milliseconds and log its expiry
+// A ttl of (0) makes it live until it is deleted
+// Must be called with the k-v store locked for writing
+uint8_t server_expire_variable(Thread thread, uint8_t *key, uint64_t ttl) {
+  uint64_t expires = ttl > 0 ? timer_now() + ttl : 0;
+  uint8_t status = key_value_store_set_expiry(thread->kvstore, key, expires);
+  if (status == 0) {
+    status = log_expire_key(key, expires, *(thread->logfd));
+  }
+  return status;
+}
+
+// Evaluate an arithmetic request, resolving and storing variables as needed
+template <class Op, uint8_t Kind>
+void server_execute_arithmetic(Thread thread, Operands ops) {
+  if (ops->status != 0) {
+    return;
+  }
+
+  // Literal operands never touch the key-value store
+  if (!(Kind & KIND_VARIABLES)) {
+    ops->status = Op::apply(ops->val_a, ops->val_b, &(ops->result));
+    return;
+  }
+
+  // Only storing the result changes the store
+  if (Kind & KIND_RESULT_VARIABLE) {
+    pthread_rwlock_wrlock(thread->kvs_lock); // Lock the k-v store for writing
+  } else {
+    pthread_rwlock_rdlock(thread->kvs_lock); // Lock the k-v store for reading
+  }
+  // --------------------------------------------------------------------------
+  // Begin critical section
+
+  // Versions are read before values so that they are never newer
+  if ((Kind & KIND_A_VARIABLE) && ops->versioned) {
+    ops->version_a = key_value_store_key_version(thread->kvstore, ops->var_a);
+  }
+
+  if ((Kind & KIND_B_VARIABLE) && ops->versioned) {
+    ops->version_b = key_value_store_key_version(thread->kvstore, ops->var_b);
+  }
+
+  if (Kind & KIND_A_VARIABLE) {
+    ops->status = key_value_store_resolve(
+        thread->kvstore, ops->var_a, (Kind & KIND_RECURSIVE) ? 1 : 0,
+        thread->iterations, &(ops->val_a));
+  }
+
+  if ((Kind & KIND_B_VARIABLE) && ops->status == 0) {
+    ops->status = key_value_store_resolve(
+        thread->kvstore, ops->var_b, (Kind & KIND_RECURSIVE) ? 1 : 0,
+        thread->iterations, &(ops->val_b));
+  }
+
+  if (ops->status == 0) {
+    ops->status = Op::apply(ops->val_a, ops->val_b, &(ops->result));
+  }
+
+  if ((Kind & KIND_RESULT_VARIABLE) && ops->status == 0) {
+    key_value_store_insert_key_value(thread->kvstore, ops->var_result,
+                                     ops->result);
+    log_insert_key(ops->var_result, NULL, ops->result, 0, *(thread->logfd));
+    if (ops->ttl > 0) {
+      server_expire_variable(thread, ops->var_result, ops->ttl);
+    }
+    ops->result =
+        key_value_store_key_value_lookup(thread->kvstore, ops->var_result);
+    ops->version_result =
+        key_value_store_key_version(thread->kvstore, ops->var_result);
+    key_value_store_evict(thread->kvstore, *(thread->logfd));
+  }
+
+  // End critical section
+  // --------------------------------------------------------------------------
+  pthread_rwlock_unlock(thread->kvs_lock); // Unlock the k-v store
+}
+
+// Send the response to an arithmetic request
+// A versioned response follows the result with the versions of the two
+// operands and the result, which are (0) for those that are not variables
+void server_encode_result(int connfd, Thread thread, uint32_t identifier,
+                          Operands ops) {
+  set_header(thread->buffer, identifier, ops->status);
+
+  if (ops->status == 0 && ops->versioned) {
+    set_result(thread->buffer, ops->result);
+    uint64_to_wire(thread->buffer, 13, 20, ops->version_a);
+    uint64_to_wire(thread->buffer, 21, 28, ops->version_b);
+    uint64_to_wire(thread->buffer, 29, 36, ops->version_result);
+    send(connfd, thread->buffer, 37, 0);
+  } else if (ops->status == 0) {
+    set_result(thread->buffer, ops->result);
+    send(connfd, thread->buffer, 13, 0);
+  } else {
+    send(connfd, thread->buffer, 5, 0);
+  }
+}
+
+// Add, subtract, multiply, divide or mod two operands of a specific kind
+// Each combination of operation and kind is compiled separately, so the
+// checks on the kind fold away
+template <class Op, uint8_t Kind>
+void server_arithmetic(int connfd, Thread thread, uint16_t opcode,
+                       uint32_t identifier) {
+  OperandsObj ops;
+  ops.versioned = (opcode >> 8) == VERSIONED_GROUP ||
+                  (opcode >> 8) == VERSIONED_EXPIRING_GROUP;
+  ops.expiring = (opcode >> 8) == EXPIRING_GROUP ||
+                 (opcode >> 8) == VERSIONED_EXPIRING_GROUP;
+  ops.ttl = 0;
+  server_decode_arithmetic<Kind>(connfd, &ops);
+  server_execute_arithmetic<Op, Kind>(thread, &ops);
+  server_encode_result(connfd, thread, identifier, &ops);
+  if (Kind & KIND_VARIABLES) {
+    server_free_operands(&ops);
+  }
+}
+
+// The handlers of one operation for every kind of operand
+typedef struct ArithmeticRow {
+  Handler handlers[NUM_KINDS];
+} ArithmeticRow;
+
+template <uint8_t... Kinds> struct KindList {};
+
+// Build the list of kinds 0, 1, ..., N - 1
+template <uint8_t N, uint8_t... Kinds>
+struct MakeKinds : MakeKinds<N - 1, N - 1, Kinds...> {};
+
+template <uint8_t... Kinds> struct MakeKinds<0, Kinds...> {
+  typedef KindList<Kinds...> type;
+};
+
+// Instantiate the handler of an operation for every kind at compile time
+template <class Op, uint8_t... Kinds>
+constexpr ArithmeticRow arithmetic_row(KindList<Kinds...>) {
+  return ArithmeticRow{{server_arithmetic<Op, Kinds>...}};
+}
+
+static constexpr ArithmeticRow arithmetic_table[] = {
+    arithmetic_row<AddOp>(MakeKinds<NUM_KINDS>::type()),
+    arithmetic_row<SubOp>(MakeKinds<NUM_KINDS>::type()),
+    arithmetic_row<MulOp>(MakeKinds<NUM_KINDS>::type()),
+    arithmetic_row<DivOp>(MakeKinds<NUM_KINDS>::type()),
+    arithmetic_row<ModOp>(MakeKinds<NUM_KINDS>::type()),
+};
+
+// Get the name stored in a variable
+// A versioned response follows the name with the version of the variable
+void server_get_variable(int connfd, Thread thread, uint16_t opcode,
+                         uint32_t identifier) {
+  OperandsObj ops;
+  uint8_t name[32] = {0};
+  uint8_t flag = 0;
+  int64_t value = 0;
+
+  server_decode_operands(connfd, opcode, &ops);
+
+  if (ops.status == 0 && ops.a_exists) {
+    pthread_rwlock_rdlock(thread->kvs_lock); // Lock the k-v store for reading
+    // ------------------------------------------------------------------------
+    // Begin critical section
+
+    // Read the name and version from one lookup so that a variable expiring
+    // in between is reported as missing instead of sent without a name
+    ops.status = key_value_store_key_read(thread->kvstore, ops.var_a, &flag,
+                                          &value, name, &(ops.version_a));
+    if (ops.status == 0 && flag == 0) {
+      ops.status = EFAULT;
+    }
+
+    // End critical section
+    // ------------------------------------------------------------------------
+    pthread_rwlock_unlock(thread->kvs_lock); // Unlock the k-v store
+  }
+
+  memset(thread->buffer, 0, BUFFER_SIZE);
+  set_header(thread->buffer, identifier, ops.status);
+
+  if (ops.status == 0) {
+    uint8_t length = strlen((char *)name);
+    set_var_length(thread->buffer, length);
+    if (length > 0) {
+      set_string(thread->buffer + 6, name, length);
+    }
+    if (ops.versioned) {
+      uint64_to_wire(thread->buffer, 6 + length, 13 + length, ops.version_a);
+      send(connfd, thread->buffer, 14 + length, 0);
     } else {
-      val_a = recv_uint64(connfd);
+      send(connfd, thread->buffer, 6 + length, 0);
     }
+  } else {
+    send(connfd, thread->buffer, 5, 0);
+  }
 
-    // If variable b needs to be received
-    if ((var & (1 << 5)) || (var == 0x9)) {
-      b_exists = 1;
-      var_b_length = recv_uint8(connfd);
-
-      if (var_b_length >= 1 && var_b_length <= 31) {
-        var_b = (uint8_t *)calloc(var_b_length + 1, sizeof(uint8_t));
-        bytes_received = recv_string(connfd, var_b, var_b_length, 1);
-
-        for (uint8_t i = 0; var_b[i] != 0; i++) {
-          // Check if a character is a valid character
-          if (i == 0) {
-            if (isdigit(var_b[i])) {
-              status = EINVAL;
-            }
-            if (!isalpha(var_b[i])) {
-              status = EINVAL;
-            }
-          } else {
-            if (!isdigit(var_b[i])) {
-              if (!isalpha(var_b[i])) {
-                if (var_b[i] != '_') {
-                  status = EINVAL;
-                }
-              }
-            }
-          }
-        }
-      }
-    } else if (var != 0x8 && var != 0xF) {
-      val_b = recv_uint64(connfd);
+  server_free_operands(&ops);
+}
+
+// Store a variable name in a variable
+// A versioned response carries the new version of the variable
+void server_set_variable(int connfd, Thread thread, uint16_t opcode,
+                         uint32_t identifier) {
+  OperandsObj ops;
+  server_decode_operands(connfd, opcode, &ops);
+
+  if (ops.status == 0 && ops.a_exists && ops.b_exists) {
+    pthread_rwlock_wrlock(thread->kvs_lock); // Lock the k-v store for writing
+    // ------------------------------------------------------------------------
+    // Begin critical section
+
+    ops.status =
+        key_value_store_insert_key_name(thread->kvstore, ops.var_a, ops.var_b);
+    log_insert_key(ops.var_a, ops.var_b, 0, 1, *(thread->logfd));
+    if (ops.status == 0 && ops.ttl > 0) {
+      server_expire_variable(thread, ops.var_a, ops.ttl);
     }
+    ops.version_a = key_value_store_key_version(thread->kvstore, ops.var_a);
+    key_value_store_evict(thread->kvstore, *(thread->logfd));
 
-    // If the result needs to be stored as a variable
-    if ((var & (1 << 6))) {
-      result_exists = 1;
-      var_result_length = recv_uint8(connfd);
+    // End critical section
+    // ------------------------------------------------------------------------
+    pthread_rwlock_unlock(thread->kvs_lock); // Unlock the k-v store
+  }
 
-      if (var_result_length >= 1 && var_result_length <= 31) {
-        var_result = (uint8_t *)calloc(var_result_length + 1, sizeof(uint8_t));
-        bytes_received = recv_string(connfd, var_result, var_result_length, 1);
-        if (isnumber((char *)var_result)) {
-          status = EINVAL;
-        } else {
-          for (uint8_t i = 0; var_result[i] != 0; i++) {
-            // Check if a character is a valid character
-            if (i == 0) {
-              if (isdigit(var_result[i])) {
-                status = EINVAL;
-              }
-              if (!isalpha(var_result[i])) {
-                status = EINVAL;
-              }
-            } else {
-              if (!isdigit(var_result[i])) {
-                if (!isalpha(var_result[i])) {
-                  if (var_result[i] != '_') {
-                    status = EINVAL;
-                  }
-                }
-              }
-            }
-          }
-        }
-      }
+  memset(thread->buffer, 0, BUFFER_SIZE);
+  set_header(thread->buffer, identifier, ops.status);
+  if (ops.status == 0 && ops.versioned) {
+    uint64_to_wire(thread->buffer, 5, 12, ops.version_a);
+    send(connfd, thread->buffer, 13, 0);
+  } else {
+    send(connfd, thread->buffer, 5, 0);
+  }
+  server_free_operands(&ops);
+}
+
+// Delete a variable
+void server_delete_variable(int connfd, Thread thread, uint16_t opcode,
+                            uint32_t identifier) {
+  OperandsObj ops;
+  server_decode_operands(connfd, opcode, &ops);
+
+  if (ops.status == 0 && ops.a_exists) {
+    pthread_rwlock_wrlock(thread->kvs_lock); // Lock the k-v store for writing
+    // ------------------------------------------------------------------------
+    // Begin critical section
+
+    ops.status = key_value_store_key_check(thread->kvstore, ops.var_a);
+
+    if (ops.status == 0) {
+      ops.status = key_value_store_delete_key(thread->kvstore, ops.var_a);
     }
-    if ((var & (1 << 7))) {
-      recursive = 1;
+
+    if (ops.status == 0) {
+      ops.status = log_delete_key(ops.var_a, *(thread->logfd));
+    }
+
+    // End critical section
+    // ------------------------------------------------------------------------
+    pthread_rwlock_unlock(thread->kvs_lock); // Unlock the k-v store
+  }
+
+  memset(thread->buffer, 0, BUFFER_SIZE);
+  set_header(thread->buffer, identifier, ops.status);
+  send(connfd, thread->buffer, 5, 0);
+  server_free_operands(&ops);
+}
+
+// Receive a file name
+uint8_t *server_recv_filename(int connfd) {
+  uint16_t filename_length = recv_uint16(connfd);
+  uint8_t *filename = (uint8_t *)calloc(filename_length + 1, sizeof(uint8_t));
+  recv_string(connfd, filename, filename_length, 1);
+  return filename;
+}
+
+// Read a small part of a file
+void server_read(int connfd, Thread thread, uint16_t /*opcode*/,
+                 uint32_t identifier) {
+  uint8_t *filename = server_recv_filename(connfd);
+  uint64_t offset = recv_uint64(connfd);
+  uint16_t buff_size = recv_uint16(connfd);
+  int64_t file_size = filesize(thread->fcache, (char *)filename);
+  int64_t bytes_read = 0;
+  int64_t status = 0;
+
+  if (buff_size <= file_size) {
+    memset(thread->buffer, 0, BUFFER_SIZE);
+    set_header(thread->buffer, identifier, 0);
+    set_num_bytes(thread->buffer, buff_size);
+
+    // Send the header followed by the file data in a single pass
+    bytes_read = send_file(thread->fcache, (char *)filename, connfd, offset,
+                           buff_size, buff_size, thread->buffer, 7, NULL);
+
+    if (bytes_read < 0) {
+      status = -bytes_read;
     }
   } else {
-    function = opcode;
+    status = EINVAL;
   }
 
-  if (function == 0x0101) { /* Add */
-    if (status == 0) {
-      if (a_exists || b_exists || result_exists) {
-        pthread_mutex_lock(thread->kvs_mutex); // Lock the k-v store mutex
-        // --------------------------------------------------------------------
-        // Begin critical section
-
-        if (a_exists) {
-          status = key_value_store_key_check(thread->kvstore, var_a);
-          if (status == 0) {
-            flag = key_value_store_key_flag_lookup(thread->kvstore, var_a);
-            if (flag == 0) {
-              val_a = key_value_store_key_value_lookup(thread->kvstore, var_a);
-            } else if (flag == 1) {
-              if (recursive) {
-                iterations = 0;
-                temp = var_a;
-                do {
-                  var_a = temp;
-                  temp = key_value_store_key_name_lookup(thread->kvstore, temp);
-                  iterations++;
-                } while (temp != NULL && iterations < thread->iterations);
-                if (iterations < thread->iterations) {
-                  if (temp == NULL) {
-                    val_a = key_value_store_key_value_lookup(thread->kvstore,
-                                                             var_a);
-                    if (val_a == ENOENT) {
-                      status =
-                          key_value_store_key_check(thread->kvstore, var_a);
-                    }
-                  }
-                } else {
-                  status = ELOOP;
-                }
-              } else {
-                status = EFAULT;
-              }
-            }
-          }
-        }
+  if (status != 0) {
+    memset(thread->buffer, 0, BUFFER_SIZE);
+    set_header(thread->buffer, identifier, status);
+    send(connfd, thread->buffer, 5, 0);
+  }
 
-        if (b_exists && status == 0) {
-          status = key_value_store_key_check(thread->kvstore, var_b);
-          if (status == 0) {
-            flag = key_value_store_key_flag_lookup(thread->kvstore, var_b);
-            if (flag == 0) {
-              val_b = key_value_store_key_value_lookup(thread->kvstore, var_b);
-            } else if (flag == 1) {
-              if (recursive) {
-                iterations = 0;
-                temp = var_b;
-                do {
-                  var_b = temp;
-                  temp = key_value_store_key_name_lookup(thread->kvstore, temp);
-                  iterations++;
-                } while (temp != NULL && iterations < thread->iterations);
-                if (iterations < thread->iterations) {
-                  if (temp == NULL) {
-                    val_b = key_value_store_key_value_lookup(thread->kvstore,
-                                                             var_b);
-                    if (val_b == ENOENT) {
-                      status =
-                          key_value_store_key_check(thread->kvstore, var_b);
-                    }
-                  }
-                } else {
-                  status = ELOOP;
-                }
-              } else {
-                status = EFAULT;
-              }
-            }
-          }
-        }
+  free(filename);
+}
 
-        result = add(val_a, val_b);
+// Write a small part of a file
+void server_write(int connfd, Thread thread, uint16_t /*opcode*/,
+                  uint32_t identifier) {
+  uint8_t *filename = server_recv_filename(connfd);
+  uint64_t offset = recv_uint64(connfd);
+  uint16_t buff_size = recv_uint16(connfd);
+  int64_t status = 0;
 
-        if (result == EOVERFLOW && (val_a + val_b) != EOVERFLOW &&
-            status == 0) {
-          status = EOVERFLOW;
-        }
+  // Move the data from the socket into the file without staging it here
+  int64_t bytes_written = recv_file(thread->fcache, (char *)filename, connfd,
+                                    offset, buff_size, buff_size, NULL);
 
-        if (result_exists && status == 0) {
-          key_value_store_insert_key_value(thread->kvstore, var_result, result);
-          log_insert_key(var_result, NULL, result, 0, *(thread->logfd));
-          result =
-              key_value_store_key_value_lookup(thread->kvstore, var_result);
-        }
+  if (bytes_written < 0) {
+    status = -bytes_written;
+  }
 
-        // End critical section
-        // --------------------------------------------------------------------
-        pthread_mutex_unlock(thread->kvs_mutex); // Unlock the k-v store mutex
-      } else {
-        result = add(val_a, val_b);
+  memset(thread->buffer, 0, BUFFER_SIZE);
+  set_header(thread->buffer, identifier, status);
+  send(connfd, thread->buffer, 5, 0);
+  free(filename);
+}
 
-        if (result == EOVERFLOW && (val_a + val_b) != EOVERFLOW) {
-          status = EOVERFLOW;
-        }
-      }
+// Read a large part of a file
+void server_read_large(int connfd, Thread thread, uint16_t /*opcode*/,
+                       uint32_t identifier) {
+  uint8_t *filename = server_recv_filename(connfd);
+  uint64_t offset = recv_uint64(connfd);
+  uint64_t count = recv_uint64(connfd);
+  uint64_t chunk = transfer_chunk_size(thread, recv_uint32(connfd));
+  uint8_t flags = recv_uint8(connfd);
+  int64_t result = filesize(thread->fcache, (char *)filename);
+  int64_t bytes_read = 0;
+  uint32_t checksum = 0;
+  int64_t status = 0;
+
+  if (result < 0) {
+    status = -result;
+  } else if ((flags & ~TRANSFER_FLAGS) != 0 || offset > (uint64_t)result) {
+    status = EINVAL;
+  } else {
+    // Never promise more bytes than the file holds
+    if (count > (uint64_t)result - offset) {
+      count = (uint64_t)result - offset;
+    }
+
+    memset(thread->buffer, 0, BUFFER_SIZE);
+    set_header(thread->buffer, identifier, 0);
+    set_transfer_size(thread->buffer, count);
+
+    if (flags & TRANSFER_COMPRESS) {
+      bytes_read = send_file_compressed(
+          thread->fcache, (char *)filename, connfd, offset, count,
+          thread->buffer, 13, (flags & TRANSFER_CHECKSUM) ? &checksum : NULL);
+    } else if ((flags & TRANSFER_DIRECT) || thread->direct) {
+      bytes_read = send_file_direct(
+          thread->fcache, thread->bpool, (char *)filename, connfd, offset,
+          count, chunk, thread->buffer, 13,
+          (flags & TRANSFER_CHECKSUM) ? &checksum : NULL);
+    } else {
+      bytes_read = send_file(thread->fcache, (char *)filename, connfd, offset,
+                             count, chunk, thread->buffer, 13,
+                             (flags & TRANSFER_CHECKSUM) ? &checksum : NULL);
     }
 
+    if (bytes_read < 0) {
+      status = -bytes_read;
+    } else if ((uint64_t)bytes_read < count) {
+      // The file shrank while it was being sent and the client is still
+      // waiting for the rest, so the stream cannot be resynchronised
+      shutdown(connfd, SHUT_RDWR);
+    } else if (flags & TRANSFER_CHECKSUM) {
+      // The CRC32C of the data follows it
+      uint32_to_wire(thread->buffer, 0, 3, checksum);
+      send(connfd, thread->buffer, 4, 0);
+    }
+  }
+
+  if (status != 0) {
+    memset(thread->buffer, 0, BUFFER_SIZE);
     set_header(thread->buffer, identifier, status);
+    send(connfd, thread->buffer, 5, 0);
+  }
 
-    if (status == 0) {
-      set_result(thread->buffer, result);
-      send(connfd, thread->buffer, 13, 0);
+  free(filename);
+}
+
+// Write a large part of a file
+void server_write_large(int connfd, Thread thread, uint16_t /*opcode*/,
+                        uint32_t identifier) {
+  uint8_t *filename = server_recv_filename(connfd);
+  uint64_t offset = recv_uint64(connfd);
+  uint64_t count = recv_uint64(connfd);
+  uint64_t chunk = transfer_chunk_size(thread, recv_uint32(connfd));
+  uint8_t flags = recv_uint8(connfd);
+  int64_t bytes_written = 0;
+  uint32_t checksum = 0;
+  int64_t status = 0;
+
+  if ((flags & ~TRANSFER_FLAGS) != 0 && (flags & TRANSFER_COMPRESS)) {
+    status = EPROTO; // The frames cannot be trusted to be skipped
+  } else if ((flags & ~TRANSFER_FLAGS) != 0) {
+    status = EINVAL;
+    recv_discard(connfd, count);
+  } else {
+    if (flags & TRANSFER_COMPRESS) {
+      bytes_written = recv_file_compressed(
+          thread->fcache, (char *)filename, connfd, offset, count,
+          (flags & TRANSFER_CHECKSUM) ? &checksum : NULL);
+    } else if ((flags & TRANSFER_DIRECT) || thread->direct) {
+      bytes_written = recv_file_direct(
+          thread->fcache, thread->bpool, (char *)filename, connfd, offset,
+          count, chunk, (flags & TRANSFER_CHECKSUM) ? &checksum : NULL);
     } else {
-      send(connfd, thread->buffer, 5, 0);
+      bytes_written =
+          recv_file(thread->fcache, (char *)filename, connfd, offset, count,
+                    chunk, (flags & TRANSFER_CHECKSUM) ? &checksum : NULL);
     }
-  } else if (function == 0x0102) { /* Substract */
+
+    if (bytes_written < 0) {
+      status = -bytes_written;
+    }
+  }
+
+  memset(thread->buffer, 0, BUFFER_SIZE);
+  set_header(thread->buffer, identifier, status);
+
+  if (status == 0 && (flags & TRANSFER_CHECKSUM)) {
+    // Echo the CRC32C of the data as received so the client can check it
+    set_transfer_size(thread->buffer, bytes_written);
+    uint32_to_wire(thread->buffer, 13, 16, checksum);
+    send(connfd, thread->buffer, 17, 0);
+  } else if (status == 0) {
+    set_transfer_size(thread->buffer, bytes_written);
+    send(connfd, thread->buffer, 13, 0);
+  } else {
+    send(connfd, thread->buffer, 5, 0);
+  }
+
+  // The rest of a malformed compressed payload cannot be found
+  if (status == EPROTO) {
+    shutdown(connfd, SHUT_RDWR);
+  }
+
+  free(filename);
+}
+
+// Copy part of one file into another
+void server_copy(int connfd, Thread thread, uint16_t /*opcode*/,
+                 uint32_t identifier) {
+  uint8_t *filename = server_recv_filename(connfd);
+  uint8_t *destination = server_recv_filename(connfd);
+  uint64_t offset = recv_uint64(connfd);
+  uint64_t destination_offset = recv_uint64(connfd);
+  uint64_t count = recv_uint64(connfd);
+  int64_t result =
+      copy_file(thread->fcache, (char *)filename, (char *)destination, offset,
+                destination_offset, count, thread->chunk_size);
+  memset(thread->buffer, 0, BUFFER_SIZE);
+
+  if (result < 0) {
+    set_header(thread->buffer, identifier, -result);
+    send(connfd, thread->buffer, 5, 0);
+  } else {
+    set_header(thread->buffer, identifier, 0);
+    set_transfer_size(thread->buffer, result);
+    send(connfd, thread->buffer, 13, 0);
+  }
+
+  free(filename);
+  free(destination);
+}
+
+// Create a file
+void server_create(int connfd, Thread thread, uint16_t /*opcode*/,
+                   uint32_t identifier) {
+  uint8_t *filename = server_recv_filename(connfd);
+  uint8_t status = create((char *)filename);
+  memset(thread->buffer, 0, BUFFER_SIZE);
+  set_header(thread->buffer, identifier, status);
+  send(connfd, thread->buffer, 5, 0);
+  free(filename);
+}
+
+// Create a file with its space allocated up front
+void server_create_preallocated(int connfd, Thread thread, uint16_t /*opcode*/,
+                                uint32_t identifier) {
+  uint8_t *filename = server_recv_filename(connfd);
+  uint64_t count = recv_uint64(connfd);
+  uint8_t flags = recv_uint8(connfd);
+  uint8_t status = create_preallocated((char *)filename, count, flags);
+  memset(thread->buffer, 0, BUFFER_SIZE);
+  set_header(thread->buffer, identifier, status);
+  send(connfd, thread->buffer, 5, 0);
+  free(filename);
+}
+
+// Get the size of a file
+void server_file_size(int connfd, Thread thread, uint16_t /*opcode*/,
+                      uint32_t identifier) {
+  uint8_t *filename = server_recv_filename(connfd);
+  int64_t result = filesize(thread->fcache, (char *)filename);
+  uint64_t file_size = 0;
+  int64_t status = 0;
+
+  if (result < 0) {
+    status = -result;
+  } else {
+    file_size = result;
+  }
+
+  memset(thread->buffer, 0, BUFFER_SIZE);
+  set_header(thread->buffer, identifier, status);
+
+  if (status == 0) {
+    set_file_size(thread->buffer, file_size);
+  }
+
+  send(connfd, thread->buffer, 13, 0);
+  free(filename);
+}
+
+// Dump the key-value store to a file
+void server_dump(int connfd, Thread thread, uint16_t /*opcode*/,
+                 uint32_t identifier) {
+  uint8_t *filename = server_recv_filename(connfd);
+  uint8_t status = 0;
+
+  pthread_rwlock_wrlock(thread->kvs_lock); // Lock the k-v store for writing
+  // --------------------------------------------------------------------------
+  // Begin critical section
+
+  status = dump_key_value_store(thread->kvstore, (char *)filename);
+
+  // End critical section
+  // --------------------------------------------------------------------------
+  pthread_rwlock_unlock(thread->kvs_lock); // Unlock the k-v store
+
+  memset(thread->buffer, 0, BUFFER_SIZE);
+  set_header(thread->buffer, identifier, status);
+  send(connfd, thread->buffer, 5, 0);
+  free(filename);
+}
+
+// Load the key-value store from a file
+void server_load(int connfd, Thread thread, uint16_t /*opcode*/,
+                 uint32_t identifier) {
+  uint8_t *filename = server_recv_filename(connfd);
+  uint8_t status = 0;
+
+  pthread_rwlock_wrlock(thread->kvs_lock); // Lock the k-v store for writing
+  // --------------------------------------------------------------------------
+  // Begin critical section
+
+  status = load_key_value_store(thread->kvstore, (char *)filename);
+  if (status == 0) {
+    status = log_key_value_store(thread->kvstore, *(thread->logfd));
+    key_value_store_evict(thread->kvstore, *(thread->logfd));
+  }
+
+  // End critical section
+  // --------------------------------------------------------------------------
+  pthread_rwlock_unlock(thread->kvs_lock); // Unlock the k-v store
+
+  memset(thread->buffer, 0, BUFFER_SIZE);
+  set_header(thread->buffer, identifier, status);
+  send(connfd, thread->buffer, 5, 0);
+  free(filename);
+}
+
+// Clear the key-value store
+void server_clear(int connfd, Thread thread, uint16_t /*opcode*/,
+                  uint32_t identifier) {
+  uint32_t magic_number = recv_uint32(connfd);
+  uint8_t status = 0;
+
+  if (magic_number == 0x0badbad0) {
+    pthread_rwlock_wrlock(thread->kvs_lock); // Lock the k-v store for writing
+    // ------------------------------------------------------------------------
+    // Begin critical section
+
+    status = clear_key_value_store(thread->kvstore);
     if (status == 0) {
-      if (a_exists || b_exists || result_exists) {
-        pthread_mutex_lock(thread->kvs_mutex); // Lock the k-v store mutex
-        // --------------------------------------------------------------------
-        // Begin critical section
-
-        if (a_exists) {
-          status = key_value_store_key_check(thread->kvstore, var_a);
-          if (status == 0) {
-            flag = key_value_store_key_flag_lookup(thread->kvstore, var_a);
-            if (flag == 0) {
-              val_a = key_value_store_key_value_lookup(thread->kvstore, var_a);
-            } else if (flag == 1) {
-              if (recursive) {
-                iterations = 0;
-                temp = var_a;
-                do {
-                  var_a = temp;
-                  temp = key_value_store_key_name_lookup(thread->kvstore, temp);
-                  iterations++;
-                } while (temp != NULL && iterations < thread->iterations);
-                if (iterations < thread->iterations) {
-                  if (temp == NULL) {
-                    val_a = key_value_store_key_value_lookup(thread->kvstore,
-                                                             var_a);
-                    if (val_a == ENOENT) {
-                      status =
-                          key_value_store_key_check(thread->kvstore, var_a);
-                    }
-                  }
-                } else {
-                  status = ELOOP;
-                }
-              } else {
-                status = EFAULT;
-              }
-            }
-          }
-        }
+      status = clear_log(*(thread->dirfd), thread->logfd);
+    }
 
-        if (b_exists && status == 0) {
-          status = key_value_store_key_check(thread->kvstore, var_b);
-          if (status == 0) {
-            flag = key_value_store_key_flag_lookup(thread->kvstore, var_b);
-            if (flag == 0) {
-              val_b = key_value_store_key_value_lookup(thread->kvstore, var_b);
-            } else if (flag == 1) {
-              if (recursive) {
-                iterations = 0;
-                temp = var_b;
-                do {
-                  var_b = temp;
-                  temp = key_value_store_key_name_lookup(thread->kvstore, temp);
-                  iterations++;
-                } while (temp != NULL && iterations < thread->iterations);
-                if (iterations < thread->iterations) {
-                  if (temp == NULL) {
-                    val_b = key_value_store_key_value_lookup(thread->kvstore,
-                                                             var_b);
-                    if (val_b == ENOENT) {
-                      status =
-                          key_value_store_key_check(thread->kvstore, var_b);
-                    }
-                  }
-                } else {
-                  status = ELOOP;
-                }
-              } else {
-                status = EFAULT;
-              }
-            }
-          }
-        }
+    // End critical section
+    // ------------------------------------------------------------------------
+    pthread_rwlock_unlock(thread->kvs_lock); // Unlock the k-v store
+  } else {
+    status = EINVAL;
+  }
 
-        result = sub(val_a, val_b);
+  memset(thread->buffer, 0, BUFFER_SIZE);
+  set_header(thread->buffer, identifier, status);
+  send(connfd, thread->buffer, 5, 0);
+}
 
-        if (result == EOVERFLOW && (val_a - val_b) != EOVERFLOW &&
-            status == 0) {
-          status = EOVERFLOW;
-        }
+// Get a server statistic
+void server_statistics(int connfd, Thread thread, uint16_t /*opcode*/,
+                       uint32_t identifier) {
+  uint64_t value = 0;
+  uint8_t status = server_statistic(thread, recv_uint16(connfd), &value);
 
-        if (result_exists && status == 0) {
-          key_value_store_insert_key_value(thread->kvstore, var_result, result);
-          log_insert_key(var_result, NULL, result, 0, *(thread->logfd));
-          result =
-              key_value_store_key_value_lookup(thread->kvstore, var_result);
-        }
+  memset(thread->buffer, 0, BUFFER_SIZE);
+  set_header(thread->buffer, identifier, status);
 
-        // End critical section
-        // --------------------------------------------------------------------
-        pthread_mutex_unlock(thread->kvs_mutex); // Unlock the k-v store mutex
-      } else {
-        result = sub(val_a, val_b);
+  if (status == 0) {
+    set_file_size(thread->buffer, value);
+    send(connfd, thread->buffer, 13, 0);
+  } else {
+    send(connfd, thread->buffer, 5, 0);
+  }
+}
 
-        if (result == EOVERFLOW && (val_a - val_b) != EOVERFLOW) {
-          status = EOVERFLOW;
-        }
-      }
+// Apply an arithmetic operation to every lane of two arrays of numbers
+// The response carries the number of lanes, their results and then a status
+// byte for each lane
+void server_vector_arithmetic(int connfd, Thread thread, uint16_t /*opcode*/,
+                              uint32_t identifier) {
+  uint8_t operation = recv_uint8(connfd);
+  uint8_t flags = recv_uint8(connfd);
+  uint64_t length = recv_uint32(connfd);
+  uint8_t scalar = flags & VECTOR_SCALAR;
+  uint64_t b_length = scalar ? 1 : length;
+  uint8_t status = 0;
+  int64_t *a = NULL;
+
+  if ((flags & ~VECTOR_FLAGS) != 0 || length > MAX_VECTOR_LENGTH ||
+      operation < VECTOR_ADD || operation > VECTOR_MOD) {
+    status = EINVAL;
+  } else {
+    // The operands, the results and the status of each lane in one block
+    a = (int64_t *)malloc((length + b_length + length) * sizeof(int64_t) +
+                          length);
+    if (a == NULL) {
+      status = ENOMEM;
     }
+  }
 
+  if (status != 0) {
+    recv_discard(connfd, (length + b_length) * sizeof(int64_t));
+    memset(thread->buffer, 0, BUFFER_SIZE);
     set_header(thread->buffer, identifier, status);
+    send(connfd, thread->buffer, 5, 0);
+    return;
+  }
+
+  int64_t *b = a + length;
+  int64_t *result = b + b_length;
+  uint8_t *lanes = (uint8_t *)(result + length);
+
+  if (length + b_length > 0) {
+    recv_loop(connfd, (uint8_t *)a, (length + b_length) * sizeof(int64_t));
+  }
+
+  for (uint64_t i = 0; i < length + b_length; i++) {
+    a[i] = be64toh(a[i]);
+  }
+
+  vector_arithmetic(operation, a, b, scalar, length, result, lanes);
+
+  for (uint64_t i = 0; i < length; i++) {
+    result[i] = htobe64(result[i]);
+  }
+
+  memset(thread->buffer, 0, BUFFER_SIZE);
+  set_header(thread->buffer, identifier, 0);
+  uint32_to_wire(thread->buffer, 5, 8, length);
+  send_loop(connfd, thread->buffer, 9, length > 0 ? MSG_MORE : 0);
+  send_loop(connfd, (uint8_t *)result, length * sizeof(int64_t) + length, 0);
+
+  free(a);
+}
+
+// Evaluate an expression over variables and literals
+// The expression is compiled once and kept in the thread's program cache.
+// Its variables are resolved and its result stored under one lock, and only
+// the result is logged.
+void server_evaluate(int connfd, Thread thread, uint16_t /*opcode*/,
+                     uint32_t identifier) {
+  uint8_t flags = recv_uint8(connfd);
+  uint8_t *var_result = NULL;
+  int64_t values[MAX_PROGRAM_VARIABLES];
+  Program program = NULL;
+  int64_t result = 0;
+  uint8_t status = 0;
+
+  if (flags & EXPRESSION_RESULT) {
+    status = server_recv_name(connfd, &var_result, 1);
+  }
+
+  uint16_t length = recv_uint16(connfd);
 
+  if ((flags & ~EXPRESSION_FLAGS) != 0 || length == 0 ||
+      length > MAX_EXPRESSION_SIZE) {
+    status = EINVAL;
+    recv_discard(connfd, length);
+  } else {
+    recv_loop(connfd, thread->buffer, length);
     if (status == 0) {
-      set_result(thread->buffer, result);
-      send(connfd, thread->buffer, 13, 0);
+      status =
+          program_cache_lookup(thread->pcache, thread->buffer, length, &program);
+    }
+  }
+
+  if (status == 0 && program_num_variables(program) == 0 &&
+      var_result == NULL) {
+    status = program_run(program, NULL, &result);
+  } else if (status == 0) {
+    // Only storing the result changes the store
+    if (var_result != NULL) {
+      pthread_rwlock_wrlock(thread->kvs_lock); // Lock the k-v store for writing
     } else {
-      send(connfd, thread->buffer, 5, 0);
+      pthread_rwlock_rdlock(thread->kvs_lock); // Lock the k-v store for reading
     }
-  } else if (function == 0x0103) { /* Multiply */
+    // ------------------------------------------------------------------------
+    // Begin critical section
+
+    for (uint16_t i = 0; i < program_num_variables(program) && status == 0;
+         i++) {
+      status = key_value_store_resolve(
+          thread->kvstore, program_variable(program, i),
+          (flags & EXPRESSION_RECURSIVE) ? 1 : 0, thread->iterations,
+          &(values[i]));
+    }
+
     if (status == 0) {
-      if (a_exists || b_exists || result_exists) {
-        pthread_mutex_lock(thread->kvs_mutex); // Lock the k-v store mutex
-        // --------------------------------------------------------------------
-        // Begin critical section
-
-        if (a_exists) {
-          status = key_value_store_key_check(thread->kvstore, var_a);
-          if (status == 0) {
-            flag = key_value_store_key_flag_lookup(thread->kvstore, var_a);
-            if (flag == 0) {
-              val_a = key_value_store_key_value_lookup(thread->kvstore, var_a);
-            } else if (flag == 1) {
-              if (recursive) {
-                iterations = 0;
-                temp = var_a;
-                do {
-                  var_a = temp;
-                  temp = key_value_store_key_name_lookup(thread->kvstore, temp);
-                  iterations++;
-                } while (temp != NULL && iterations < thread->iterations);
-                if (iterations < thread->iterations) {
-                  if (temp == NULL) {
-                    val_a = key_value_store_key_value_lookup(thread->kvstore,
-                                                             var_a);
-                    if (val_a == ENOENT) {
-                      status =
-                          key_value_store_key_check(thread->kvstore, var_a);
-                    }
-                  }
-                } else {
-                  status = ELOOP;
-                }
-              } else {
-                status = EFAULT;
-              }
-            }
-          }
-        }
+      status = program_run(program, values, &result);
+    }
 
-        if (b_exists && status == 0) {
-          status = key_value_store_key_check(thread->kvstore, var_b);
-          if (status == 0) {
-            flag = key_value_store_key_flag_lookup(thread->kvstore, var_b);
-            if (flag == 0) {
-              val_b = key_value_store_key_value_lookup(thread->kvstore, var_b);
-            } else if (flag == 1) {
-              if (recursive) {
-                iterations = 0;
-                temp = var_b;
-                do {
-                  var_b = temp;
-                  temp = key_value_store_key_name_lookup(thread->kvstore, temp);
-                  iterations++;
-                } while (temp != NULL && iterations < thread->iterations);
-                if (iterations < thread->iterations) {
-                  if (temp == NULL) {
-                    val_b = key_value_store_key_value_lookup(thread->kvstore,
-                                                             var_b);
-                    if (val_b == ENOENT) {
-                      status =
-                          key_value_store_key_check(thread->kvstore, var_b);
-                    }
-                  }
-                } else {
-                  status = ELOOP;
-                }
-              } else {
-                status = EFAULT;
-              }
-            }
-          }
-        }
+    if (var_result != NULL && status == 0) {
+      key_value_store_insert_key_value(thread->kvstore, var_result, result);
+      log_insert_key(var_result, NULL, result, 0, *(thread->logfd));
+      result = key_value_store_key_value_lookup(thread->kvstore, var_result);
+      key_value_store_evict(thread->kvstore, *(thread->logfd));
+    }
+
+    // End critical section
+    // ------------------------------------------------------------------------
+    pthread_rwlock_unlock(thread->kvs_lock); // Unlock the k-v store
+  }
 
-        result = mul(val_a, val_b);
+  memset(thread->buffer, 0, BUFFER_SIZE);
+  set_header(thread->buffer, identifier, status);
 
-        if (result == EOVERFLOW && (val_a * val_b) != EOVERFLOW &&
-            status == 0) {
-          status = EOVERFLOW;
-        }
+  if (status == 0) {
+    set_result(thread->buffer, result);
+    send(connfd, thread->buffer, 13, 0);
+  } else {
+    send(connfd, thread->buffer, 5, 0);
+  }
+
+  free(var_result);
+}
+
+// Add to a counter and return its new value (0x0411) or its old value
+// (0x0412)
+// The addition is a single atomic operation on the value, so counters only
+// hold the store for reading and do not serialize one another
+void server_fetch_add(int connfd, Thread thread, uint16_t opcode,
+                      uint32_t identifier) {
+  uint8_t *key = NULL;
+  uint8_t status = server_recv_name(connfd, &key, 0);
+  int64_t delta = recv_uint64(connfd);
+  int64_t previous = 0;
+
+  if (status == 0) {
+    pthread_rwlock_rdlock(thread->kvs_lock); // Lock the k-v store for reading
+    // ------------------------------------------------------------------------
+    // Begin critical section
+
+    status = key_value_store_fetch_add(thread->kvstore, key, delta, &previous);
+    if (status == 0 && delta != 0) {
+      status = log_add_key(key, delta, *(thread->logfd));
+    }
+
+    // End critical section
+    // ------------------------------------------------------------------------
+    pthread_rwlock_unlock(thread->kvs_lock); // Unlock the k-v store
+  }
+
+  memset(thread->buffer, 0, BUFFER_SIZE);
+  set_header(thread->buffer, identifier, status);
+
+  if (status == 0) {
+    set_result(thread->buffer, opcode == 0x0411 ? previous + delta : previous);
+    send(connfd, thread->buffer, 13, 0);
+  } else {
+    send(connfd, thread->buffer, 5, 0);
+  }
+
+  free(key);
+}
 
-        if (result_exists && status == 0) {
-          key_value_store_insert_key_value(thread->kvstore, var_result, result);
-          log_insert_key(var_result, NULL, result, 0, *(thread->logfd));
-          result =
-              key_value_store_key_value_lookup(thread->kvstore, var_result);
-        }
+// Replace the value of a variable if it holds an expected value
+// The response carries the value before the swap, which equals the expected
+// value if and only if the swap happened
+void server_compare_and_swap(int connfd, Thread thread, uint16_t /*opcode*/,
+                             uint32_t identifier) {
+  uint8_t *key = NULL;
+  uint8_t status = server_recv_name(connfd, &key, 0);
+  int64_t expected = recv_uint64(connfd);
+  int64_t desired = recv_uint64(connfd);
+  int64_t previous = 0;
+
+  if (status == 0) {
+    pthread_rwlock_rdlock(thread->kvs_lock); // Lock the k-v store for reading
+    // ------------------------------------------------------------------------
+    // Begin critical section
 
-        // End critical section
-        // --------------------------------------------------------------------
-        pthread_mutex_unlock(thread->kvs_mutex); // Unlock the k-v store mutex
-      } else {
-        result = mul(val_a, val_b);
+    status = key_value_store_compare_and_swap(thread->kvstore, key, expected,
+                                              desired, &previous);
 
-        if (result == EOVERFLOW && (val_a * val_b) != EOVERFLOW) {
-          status = EOVERFLOW;
-        }
-      }
+    // A swap is logged as the difference it made so that it commutes with
+    // the additions of other counters
+    if (status == 0 && previous == expected && desired != expected) {
+      status = log_add_key(
+          key, (int64_t)((uint64_t)desired - (uint64_t)expected),
+          *(thread->logfd));
     }
 
-    set_header(thread->buffer, identifier, status);
+    // End critical section
+    // ------------------------------------------------------------------------
+    pthread_rwlock_unlock(thread->kvs_lock); // Unlock the k-v store
+  }
 
-    if (status == 0) {
-      set_result(thread->buffer, result);
-      send(connfd, thread->buffer, 13, 0);
-    } else {
-      send(connfd, thread->buffer, 5, 0);
-    }
-  } else if (function == 0x0104) { /* Divide */
-    if (status == 0) {
-      if (a_exists || b_exists || result_exists) {
-        pthread_mutex_lock(thread->kvs_mutex); // Lock the k-v store mutex
-        // --------------------------------------------------------------------
-        // Begin critical section
-
-        if (a_exists) {
-          status = key_value_store_key_check(thread->kvstore, var_a);
-          if (status == 0) {
-            flag = key_value_store_key_flag_lookup(thread->kvstore, var_a);
-            if (flag == 0) {
-              val_a = key_value_store_key_value_lookup(thread->kvstore, var_a);
-            } else if (flag == 1) {
-              if (recursive) {
-                iterations = 0;
-                temp = var_a;
-                do {
-                  var_a = temp;
-                  temp = key_value_store_key_name_lookup(thread->kvstore, temp);
-                  iterations++;
-                } while (temp != NULL && iterations < thread->iterations);
-                if (iterations < thread->iterations) {
-                  if (temp == NULL) {
-                    val_a = key_value_store_key_value_lookup(thread->kvstore,
-                                                             var_a);
-                    if (val_a == ENOENT) {
-                      status =
-                          key_value_store_key_check(thread->kvstore, var_a);
-                    }
-                  }
-                } else {
-                  status = ELOOP;
-                }
-              } else {
-                status = EFAULT;
-              }
-            }
-          }
-        }
+  memset(thread->buffer, 0, BUFFER_SIZE);
+  set_header(thread->buffer, identifier, status);
 
-        if (b_exists && status == 0) {
-          status = key_value_store_key_check(thread->kvstore, var_b);
-          if (status == 0) {
-            flag = key_value_store_key_flag_lookup(thread->kvstore, var_b);
-            if (flag == 0) {
-              val_b = key_value_store_key_value_lookup(thread->kvstore, var_b);
-            } else if (flag == 1) {
-              if (recursive) {
-                iterations = 0;
-                temp = var_b;
-                do {
-                  var_b = temp;
-                  temp = key_value_store_key_name_lookup(thread->kvstore, temp);
-                  iterations++;
-                } while (temp != NULL && iterations < thread->iterations);
-                if (iterations < thread->iterations) {
-                  if (temp == NULL) {
-                    val_b = key_value_store_key_value_lookup(thread->kvstore,
-                                                             var_b);
-                    if (val_b == ENOENT) {
-                      status =
-                          key_value_store_key_check(thread->kvstore, var_b);
-                    }
-                  }
-                } else {
-                  status = ELOOP;
-                }
-              } else {
-                status = EFAULT;
-              }
-            }
-          }
-        }
+  if (status == 0) {
+    set_result(thread->buffer, previous);
+    send(connfd, thread->buffer, 13, 0);
+  } else {
+    send(connfd, thread->buffer, 5, 0);
+  }
 
-        result = divide(val_a, val_b);
+  free(key);
+}
 
-        if (result == EINVAL && val_b == 0 && status == 0) {
-          status = EINVAL;
-        } else if (result == EOVERFLOW && val_b != 0 &&
-                   (val_a / val_b) != EOVERFLOW) {
-          status = EOVERFLOW;
-        }
+// Get the value of a variable along with its version (0x0421), or only if it
+// changed since a version the client has (0x0422)
+// The response carries the version, the flag of the variable and then either
+// its numerical value or its variable name. An unchanged variable only gets
+// its version back.
+void server_get_versioned(int connfd, Thread thread, uint16_t opcode,
+                          uint32_t identifier) {
+  uint8_t *key = NULL;
+  uint8_t status = server_recv_name(connfd, &key, 0);
+  uint64_t since = opcode == 0x0422 ? recv_uint64(connfd) : 0;
+  uint8_t name[32] = {0};
+  uint64_t version = 0;
+  int64_t value = 0;
+  uint8_t flag = 0;
 
-        if (result_exists && status == 0) {
-          key_value_store_insert_key_value(thread->kvstore, var_result, result);
-          log_insert_key(var_result, NULL, result, 0, *(thread->logfd));
-          result =
-              key_value_store_key_value_lookup(thread->kvstore, var_result);
-        }
+  if (status == 0 && key == NULL) {
+    status = EINVAL;
+  }
 
-        // End critical section
-        // --------------------------------------------------------------------
-        pthread_mutex_unlock(thread->kvs_mutex); // Unlock the k-v store mutex
-      } else {
-        result = divide(val_a, val_b);
+  if (status == 0) {
+    pthread_rwlock_rdlock(thread->kvs_lock); // Lock the k-v store for reading
+    // ------------------------------------------------------------------------
+    // Begin critical section
 
-        if (result == EINVAL && val_b == 0) {
-          status = EINVAL;
-        } else if (result == EOVERFLOW && val_b != 0 &&
-                   (val_a / val_b) != EOVERFLOW) {
-          status = EOVERFLOW;
-        }
-      }
-    }
+    // A key that expires between reading its version and its value would be
+    // sent with a flag and value it never held, so read both at once
+    status = key_value_store_key_read(thread->kvstore, key, &flag, &value, name,
+                                      &version);
 
-    set_header(thread->buffer, identifier, status);
+    // End critical section
+    // ------------------------------------------------------------------------
+    pthread_rwlock_unlock(thread->kvs_lock); // Unlock the k-v store
+  }
 
-    if (status == 0) {
-      set_result(thread->buffer, result);
-      send(connfd, thread->buffer, 13, 0);
+  memset(thread->buffer, 0, BUFFER_SIZE);
+  set_header(thread->buffer, identifier, status);
+
+  if (status == 0 && version == since) {
+    uint64_to_wire(thread->buffer, 5, 12, version);
+    send(connfd, thread->buffer, 13, 0);
+  } else if (status == 0) {
+    uint64_to_wire(thread->buffer, 5, 12, version);
+    uint8_to_wire(thread->buffer, 13, flag);
+    if (flag == 1) {
+      uint8_t length = strlen((char *)name);
+      uint8_to_wire(thread->buffer, 14, length);
+      set_string(thread->buffer + 15, name, length);
+      send(connfd, thread->buffer, 15 + length, 0);
     } else {
-      send(connfd, thread->buffer, 5, 0);
+      uint64_to_wire(thread->buffer, 14, 21, value);
+      send(connfd, thread->buffer, 22, 0);
     }
-  } else if (function == 0x0105) { /* Modulo */
-    if (status == 0) {
-      if (a_exists || b_exists || result_exists) {
-        pthread_mutex_lock(thread->kvs_mutex); // Lock the k-v store mutex
-        // --------------------------------------------------------------------
-        // Begin critical section
-
-        if (a_exists) {
-          status = key_value_store_key_check(thread->kvstore, var_a);
-          if (status == 0) {
-            flag = key_value_store_key_flag_lookup(thread->kvstore, var_a);
-            if (flag == 0) {
-              val_a = key_value_store_key_value_lookup(thread->kvstore, var_a);
-            } else if (flag == 1) {
-              if (recursive) {
-                iterations = 0;
-                temp = var_a;
-                do {
-                  var_a = temp;
-                  temp = key_value_store_key_name_lookup(thread->kvstore, temp);
-                  iterations++;
-                } while (temp != NULL && iterations < thread->iterations);
-                if (iterations < thread->iterations) {
-                  if (temp == NULL) {
-                    val_a = key_value_store_key_value_lookup(thread->kvstore,
-                                                             var_a);
-                    if (val_a == ENOENT) {
-                      status =
-                          key_value_store_key_check(thread->kvstore, var_a);
-                    }
-                  }
-                } else {
-                  status = ELOOP;
-                }
-              } else {
-                status = EFAULT;
-              }
-            }
-          }
-        }
-
-        if (b_exists && status == 0) {
-          status = key_value_store_key_check(thread->kvstore, var_b);
-          if (status == 0) {
-            flag = key_value_store_key_flag_lookup(thread->kvstore, var_b);
-            if (flag == 0) {
-              val_b = key_value_store_key_value_lookup(thread->kvstore, var_b);
-            } else if (flag == 1) {
-              if (recursive) {
-                iterations = 0;
-                temp = var_b;
-                do {
-                  var_b = temp;
-                  temp = key_value_store_key_name_lookup(thread->kvstore, temp);
-                  iterations++;
-                } while (temp != NULL && iterations < thread->iterations);
-                if (iterations < thread->iterations) {
-                  if (temp == NULL) {
-                    val_b = key_value_store_key_value_lookup(thread->kvstore,
-                                                             var_b);
-                    if (val_b == ENOENT) {
-                      status =
-                          key_value_store_key_check(thread->kvstore, var_b);
-                    }
-                  }
-                } else {
-                  status = ELOOP;
-                }
-              } else {
-                status = EFAULT;
-              }
-            }
-          }
-        }
+  } else {
+    send(connfd, thread->buffer, 5, 0);
+  }
 
-        result = mod(val_a, val_b);
+  free(key);
+}
 
-        if (result == EINVAL && val_b == 0 && status == 0) {
-          status = EINVAL;
-        } else if (result == EOVERFLOW && val_b != 0 &&
-                   (val_a % val_b) != EOVERFLOW) {
-          status = EOVERFLOW;
-        }
+// Receive the kind of a write to a variable whose name was already received,
+// followed by a value for WRITE_VALUE or a variable name for WRITE_NAME
+uint8_t server_recv_write(int connfd, KeyValueWrite write) {
+  uint8_t status = 0;
+
+  write->kind = recv_uint8(connfd);
+  if (write->kind == WRITE_VALUE) {
+    write->value = recv_uint64(connfd);
+  } else if (write->kind == WRITE_NAME) {
+    status |= server_recv_name(connfd, &(write->name), 0);
+    if (write->name == NULL) {
+      status = EINVAL;
+    }
+  } else if (write->kind != WRITE_DELETE) {
+    status = EINVAL;
+  }
 
-        if (result_exists && status == 0) {
-          key_value_store_insert_key_value(thread->kvstore, var_result, result);
-          log_insert_key(var_result, NULL, result, 0, *(thread->logfd));
-          result =
-              key_value_store_key_value_lookup(thread->kvstore, var_result);
-        }
+  if (write->key == NULL) {
+    status = EINVAL;
+  }
+  return status;
+}
 
-        // End critical section
-        // --------------------------------------------------------------------
-        pthread_mutex_unlock(thread->kvs_mutex); // Unlock the k-v store mutex
-      } else {
-        result = mod(val_a, val_b);
+// Apply a write to the key-value store and return the new version of its
+// variable
+uint64_t server_apply_write(Thread thread, KeyValueWrite write) {
+  if (write->kind == WRITE_VALUE) {
+    key_value_store_insert_key_value(thread->kvstore, write->key,
+                                     write->value);
+  } else if (write->kind == WRITE_NAME) {
+    key_value_store_insert_key_name(thread->kvstore, write->key, write->name);
+  } else {
+    key_value_store_delete_key(thread->kvstore, write->key);
+  }
+  return key_value_store_key_version(thread->kvstore, write->key);
+}
 
-        if (result == EINVAL && val_b == 0) {
-          status = EINVAL;
-        } else if (result == EOVERFLOW && val_b != 0 &&
-                   (val_a % val_b) != EOVERFLOW) {
-          status = EOVERFLOW;
-        }
-      }
+// Apply the writes of a transaction if the variables it read are unchanged
+// The read set holds the versions the client saw, where (0) means that the
+// variable must not exist. The versions are checked and the writes applied
+// and logged as one record under a single lock, so no reader sees part of a
+// transaction. A transaction that lost a race is aborted with EAGAIN for the
+// client to retry, nothing is held between requests. The response carries
+// the new version of each write.
+void server_transaction(int connfd, Thread thread, uint16_t /*opcode*/,
+                        uint32_t identifier) {
+  uint8_t *reads[UINT8_MAX] = {NULL};
+  uint64_t versions[UINT8_MAX];
+  KeyValueWriteObj writes[UINT8_MAX];
+  uint8_t num_reads = recv_uint8(connfd);
+  uint8_t num_writes = 0;
+  uint8_t status = 0;
+
+  for (uint8_t i = 0; i < num_reads; i++) {
+    status |= server_recv_name(connfd, &(reads[i]), 0);
+    if (reads[i] == NULL) {
+      status = EINVAL;
     }
+    versions[i] = recv_uint64(connfd);
+  }
 
-    set_header(thread->buffer, identifier, status);
+  memset(writes, 0, sizeof(writes));
+  num_writes = recv_uint8(connfd);
+
+  for (uint8_t i = 0; i < num_writes; i++) {
+    status |= server_recv_name(connfd, &(writes[i].key), 1);
+    status |= server_recv_write(connfd, &(writes[i]));
+    if (status != 0 && writes[i].kind != WRITE_VALUE &&
+        writes[i].kind != WRITE_NAME && writes[i].kind != WRITE_DELETE) {
+      // The rest of the request cannot be parsed
+      num_writes = i + 1;
+      break;
+    }
+  }
 
-    if (status == 0) {
-      set_result(thread->buffer, result);
-      send(connfd, thread->buffer, 13, 0);
+  if (status == 0) {
+    // A transaction without writes only validates its reads
+    if (num_writes > 0) {
+      pthread_rwlock_wrlock(thread->kvs_lock); // Lock the k-v store for writing
     } else {
-      send(connfd, thread->buffer, 5, 0);
+      pthread_rwlock_rdlock(thread->kvs_lock); // Lock the k-v store for reading
     }
-  } else if (function == 0x0108) { /* Get variable */
-    if (status == 0) {
-      if (a_exists) {
-        pthread_mutex_lock(thread->kvs_mutex); // Lock the k-v store mutex
-        // --------------------------------------------------------------------
-        // Begin critical section
-
-        if (a_exists) {
-          status = key_value_store_key_check(thread->kvstore, var_a);
-          if (status == 0) {
-            flag = key_value_store_key_flag_lookup(thread->kvstore, var_a);
-            if (flag == 1) {
-              name = key_value_store_key_name_lookup(thread->kvstore, var_a);
-            } else if (flag == 0) {
-              status = EFAULT;
-            }
-          }
-        }
+    // ------------------------------------------------------------------------
+    // Begin critical section
 
-        // End critical section
-        // --------------------------------------------------------------------
-        pthread_mutex_unlock(thread->kvs_mutex); // Unlock the k-v store mutex
+    for (uint8_t i = 0; i < num_reads && status == 0; i++) {
+      if (key_value_store_key_version(thread->kvstore, reads[i]) !=
+          versions[i]) {
+        status = EAGAIN;
       }
     }
 
-    memset(thread->buffer, 0, BUFFER_SIZE);
-    set_header(thread->buffer, identifier, status);
-
-    if (status == 0) {
-      set_var_length(thread->buffer, strlen((char *)name));
-      send(connfd, thread->buffer, 6, 0);
-      memset(thread->buffer, 0, BUFFER_SIZE);
-      set_string(thread->buffer, name, strlen((char *)name));
-      send(connfd, thread->buffer, strlen((char *)name), 0);
-    } else {
-      send(connfd, thread->buffer, 5, 0);
-    }
-  } else if (function == 0x0109) { /* Set variable */
-    if (status == 0) {
-      if (a_exists || b_exists) {
-        pthread_mutex_lock(thread->kvs_mutex); // Lock the k-v store mutex
-        // --------------------------------------------------------------------
-        // Begin critical section
-
-        if (a_exists && b_exists) {
-          status =
-              key_value_store_insert_key_name(thread->kvstore, var_a, var_b);
-          log_insert_key(var_a, var_b, 0, 1, *(thread->logfd));
-        }
-
-        // End critical section
-        // --------------------------------------------------------------------
-        pthread_mutex_unlock(thread->kvs_mutex); // Unlock the k-v store mutex
-      }
+    for (uint8_t i = 0; i < num_writes && status == 0; i++) {
+      versions[i] = server_apply_write(thread, &(writes[i]));
     }
 
-    memset(thread->buffer, 0, BUFFER_SIZE);
-    set_header(thread->buffer, identifier, status);
-    send(connfd, thread->buffer, 5, 0);
-  } else if (function == 0x010f) { /* Delete */
+    // Evicted variables are logged after the transaction so that replaying
+    // the log does not bring them back
     if (status == 0) {
-      if (a_exists) {
-        pthread_mutex_lock(thread->kvs_mutex); // Lock the k-v store mutex
-        // --------------------------------------------------------------------
-        // Begin critical section
-
-        status = key_value_store_key_check(thread->kvstore, var_a);
+      status = log_transaction(writes, num_writes, *(thread->logfd));
+      key_value_store_evict(thread->kvstore, *(thread->logfd));
+    }
 
-        if (status == 0) {
-          status = key_value_store_delete_key(thread->kvstore, var_a);
-        }
+    // End critical section
+    // ------------------------------------------------------------------------
+    pthread_rwlock_unlock(thread->kvs_lock); // Unlock the k-v store
+  }
 
-        if (status == 0) {
-          status = log_delete_key(var_a, *(thread->logfd));
-        }
+  memset(thread->buffer, 0, BUFFER_SIZE);
+  set_header(thread->buffer, identifier, status);
 
-        // End critical section
-        // --------------------------------------------------------------------
-        pthread_mutex_unlock(thread->kvs_mutex); // Unlock the k-v store mutex
-      }
+  if (status == 0) {
+    uint8_to_wire(thread->buffer, 5, num_writes);
+    for (uint8_t i = 0; i < num_writes; i++) {
+      uint64_to_wire(thread->buffer, 6 + i * 8, 13 + i * 8, versions[i]);
     }
-
-    memset(thread->buffer, 0, BUFFER_SIZE);
-    set_header(thread->buffer, identifier, status);
+    send(connfd, thread->buffer, 6 + num_writes * 8, 0);
+  } else {
     send(connfd, thread->buffer, 5, 0);
-  } else if (function == 0x0201) { /* Read */
-    filename_length = recv_uint16(connfd);
-    filename = (uint8_t *)calloc(filename_length + 1, sizeof(uint8_t));
-    bytes_received = recv_string(connfd, filename, filename_length, 1);
-    offset = recv_uint64(connfd);
-    buff_size = recv_uint16(connfd);
-    file_size = filesize((char *)filename);
-    bytes_read = 0;
-    bytes_remaining = buff_size;
-
-    if (buff_size <= file_size) {
-      status = 0;
-      uint8_t count = 1;
-
-      if (buff_size > BUFFER_SIZE) {
-        data = (uint8_t *)calloc(BUFFER_SIZE, sizeof(uint8_t));
-
-        do {
-          memset(data, 0, BUFFER_SIZE);
-
-          if (bytes_remaining > BUFFER_SIZE) {
-            bytes_read = read((char *)filename, offset, BUFFER_SIZE, data);
-
-            if (bytes_read > 0) {
-              bytes_remaining -= BUFFER_SIZE;
-              offset += BUFFER_SIZE;
-            }
-          } else {
-            bytes_read = read((char *)filename, offset, bytes_remaining, data);
-            bytes_remaining = 0;
-          }
-
-          if (bytes_read < 0) {
-            status = -bytes_read;
-          }
-
-          memset(thread->buffer, 0, BUFFER_SIZE);
-
-          if (count == 1) {
-            set_header(thread->buffer, identifier, status);
-
-            if (status == 0) {
-              set_num_bytes(thread->buffer, buff_size);
-              send(connfd, thread->buffer, 7, 0);
-              memset(thread->buffer, 0, BUFFER_SIZE);
-              set_string(thread->buffer, data, bytes_read);
-              send(connfd, thread->buffer, bytes_read, 0);
-            } else {
-              send(connfd, thread->buffer, 5, 0);
-              bytes_remaining = 0;
-            }
-          } else {
-            set_string(thread->buffer, data, bytes_read);
-            send(connfd, thread->buffer, bytes_read, 0);
-          }
+  }
 
-          count++;
-        } while (bytes_remaining > 0 && bytes_received != 0);
-      } else {
-        data = (uint8_t *)calloc(buff_size, sizeof(uint8_t));
-        memset(data, 0, buff_size);
-        bytes_read = read((char *)filename, offset, buff_size, data);
+  for (uint8_t i = 0; i < num_reads; i++) {
+    free(reads[i]);
+  }
+  for (uint8_t i = 0; i < num_writes; i++) {
+    free(writes[i].key);
+    free(writes[i].name);
+  }
+}
 
-        if (bytes_read < 0) {
-          status = -bytes_read;
-        }
+// Write a variable only if it still has a version the client has
+// Version (0) means that the variable must not exist. The write is that of a
+// transaction and the response carries the new version of the variable, or
+// EAGAIN if the variable changed.
+void server_set_if_version(int connfd, Thread thread, uint16_t /*opcode*/,
+                           uint32_t identifier) {
+  KeyValueWriteObj write;
+  uint64_t version = 0;
+  uint8_t status = 0;
 
-        memset(thread->buffer, 0, BUFFER_SIZE);
+  memset(&write, 0, sizeof(write));
+  status |= server_recv_name(connfd, &(write.key), 1);
+  version = recv_uint64(connfd);
 
-        if (count == 1) {
-          set_header(thread->buffer, identifier, status);
+  status |= server_recv_write(connfd, &write);
 
-          if (status == 0) {
-            set_num_bytes(thread->buffer, buff_size);
-            send(connfd, thread->buffer, 7, 0);
-            memset(thread->buffer, 0, BUFFER_SIZE);
-            set_string(thread->buffer, data, bytes_read);
-            send(connfd, thread->buffer, bytes_read, 0);
-          } else {
-            send(connfd, thread->buffer, 5, 0);
-            bytes_remaining = 0;
-          }
-        } else {
-          set_string(thread->buffer, data, bytes_read);
-          send(connfd, thread->buffer, bytes_read, 0);
-        }
+  if (status == 0) {
+    pthread_rwlock_wrlock(thread->kvs_lock); // Lock the k-v store for writing
+    // ------------------------------------------------------------------------
+    // Begin critical section
 
-        count++;
-      }
+    if (key_value_store_key_version(thread->kvstore, write.key) != version) {
+      status = EAGAIN;
     } else {
-      status = EINVAL;
-      memset(thread->buffer, 0, BUFFER_SIZE);
-      set_header(thread->buffer, identifier, status);
-      send(connfd, thread->buffer, 5, 0);
+      version = server_apply_write(thread, &write);
+      status = log_transaction(&write, 1, *(thread->logfd));
+      key_value_store_evict(thread->kvstore, *(thread->logfd));
     }
 
-    free(filename);
-    filename = NULL;
-  } else if (function == 0x0202) { /* Write */
-    filename_length = recv_uint16(connfd);
-    filename = (uint8_t *)calloc(filename_length + 1, sizeof(uint8_t));
-    bytes_received = recv_string(connfd, filename, filename_length, 1);
-    offset = recv_uint64(connfd);
-    buff_size = recv_uint16(connfd);
-    bytes_written = 0;
-    bytes_remaining = buff_size;
-
-    if (buff_size > BUFFER_SIZE) {
-      data = (uint8_t *)calloc(BUFFER_SIZE, sizeof(uint8_t));
-
-      do {
-        memset(data, 0, BUFFER_SIZE);
-
-        if (bytes_remaining > BUFFER_SIZE) {
-          bytes_received = recv_string(connfd, data, BUFFER_SIZE, 0);
-          bytes_written = write((char *)filename, offset, BUFFER_SIZE, data);
-
-          if (bytes_written > 0) {
-            bytes_remaining -= BUFFER_SIZE;
-            offset += BUFFER_SIZE;
-          }
-        } else {
-          bytes_received = recv_string(connfd, data, bytes_remaining, 1);
-          bytes_written =
-              write((char *)filename, offset, bytes_remaining, data);
-          bytes_remaining = 0;
-        }
+    // End critical section
+    // ------------------------------------------------------------------------
+    pthread_rwlock_unlock(thread->kvs_lock); // Unlock the k-v store
+  }
 
-        if (bytes_written < 0) {
-          status = -bytes_written;
-        }
-      } while (bytes_remaining > 0 && bytes_received != 0 && status == 0);
+  memset(thread->buffer, 0, BUFFER_SIZE);
+  set_header(thread->buffer, identifier, status);
 
-      if (data != NULL) {
-        free(data);
-      }
-    } else {
-      data = (uint8_t *)calloc(buff_size, sizeof(uint8_t));
-      memset(data, 0, buff_size);
-      bytes_received = recv_string(connfd, data, buff_size, 1);
-      bytes_written = write((char *)filename, offset, buff_size, data);
+  if (status == 0) {
+    uint64_to_wire(thread->buffer, 5, 12, version);
+    send(connfd, thread->buffer, 13, 0);
+  } else {
+    send(connfd, thread->buffer, 5, 0);
+  }
 
-      if (bytes_written < 0) {
-        status = -bytes_written;
-      }
+  free(write.key);
+  free(write.name);
+}
 
-      if (data != NULL) {
-        free(data);
+// Subscribe the connection to changes of variables
+// On success the connection is handed to the watch thread, which replies and
+// then pushes an event each time a watched variable changes. The connection
+// serves no other requests after that.
+void server_watch(int connfd, Thread thread, uint16_t /*opcode*/,
+                  uint32_t identifier) {
+  uint8_t *keys[UINT8_MAX] = {NULL};
+  uint8_t flags[UINT8_MAX];
+  uint8_t num_keys = recv_uint8(connfd);
+  uint8_t status = num_keys > 0 ? 0 : EINVAL;
+
+  for (uint8_t i = 0; i < num_keys; i++) {
+    flags[i] = recv_uint8(connfd);
+    if (!(flags[i] & WATCH_ALL)) {
+      status |= server_recv_name(connfd, &(keys[i]), 0);
+      if (keys[i] == NULL) {
+        status = EINVAL;
       }
     }
+  }
 
+  if (status == 0) {
+    status = watch_table_subscribe(thread->watches, connfd, identifier, keys,
+                                   flags, num_keys);
+  }
+
+  if (status == 0) {
+    thread->detached = 1;
+  } else {
     memset(thread->buffer, 0, BUFFER_SIZE);
     set_header(thread->buffer, identifier, status);
     send(connfd, thread->buffer, 5, 0);
-    free(filename);
-    filename = NULL;
-  } else if (function == 0x0210) { /* Create */
-    filename_length = recv_uint16(connfd);
-    filename = (uint8_t *)calloc(filename_length + 1, sizeof(uint8_t));
-    recv_string(connfd, filename, filename_length, 1);
-    status = create((char *)filename);
-    memset(thread->buffer, 0, BUFFER_SIZE);
-    set_header(thread->buffer, identifier, status);
-    send(connfd, thread->buffer, 5, 0);
-
-    free(filename);
-    filename = NULL;
-  } else if (function == 0x0220) { /* File size */
-    filename_length = recv_uint16(connfd);
-    filename = (uint8_t *)calloc(filename_length + 1, sizeof(uint8_t));
-    recv_string(connfd, filename, filename_length, 1);
-    result = filesize((char *)filename);
+  }
 
-    if (result < 0) {
-      status = -result;
-    } else {
-      file_size = result;
-    }
+  for (uint8_t i = 0; i < num_keys; i++) {
+    free(keys[i]);
+  }
+}
 
-    memset(thread->buffer, 0, BUFFER_SIZE);
-    set_header(thread->buffer, identifier, status);
+// Set or clear the number of milliseconds a variable lives for
+void server_expire(int connfd, Thread thread, uint16_t /*opcode*/,
+                   uint32_t identifier) {
+  uint8_t *key = NULL;
+  uint8_t status = server_recv_name(connfd, &key, 0);
+  uint64_t ttl = recv_uint64(connfd);
 
-    if (status == 0) {
-      set_file_size(thread->buffer, file_size);
-    }
+  if (status == 0 && key == NULL) {
+    status = EINVAL;
+  }
 
-    send(connfd, thread->buffer, 13, 0);
-    free(filename);
-    filename = NULL;
-  } else if (function == 0x0301) { /* Dump key-value store */
-    filename_length = recv_uint16(connfd);
-    filename = (uint8_t *)calloc(filename_length + 1, sizeof(uint8_t));
-    recv_string(connfd, filename, filename_length, 1);
-
-    pthread_mutex_lock(thread->kvs_mutex); // Lock the key-value store mutex
+  if (status == 0) {
+    pthread_rwlock_wrlock(thread->kvs_lock); // Lock the k-v store for writing
     // ------------------------------------------------------------------------
     // Begin critical section
 
-    status = dump_key_value_store(thread->kvstore, (char *)filename);
+    status = key_value_store_key_check(thread->kvstore, key);
+    if (status == 0) {
+      status = server_expire_variable(thread, key, ttl);
+    }
 
     // End critical section
     // ------------------------------------------------------------------------
-    pthread_mutex_unlock(thread->kvs_mutex); // Unlock the k-v store mutex
-    
-    memset(thread->buffer, 0, BUFFER_SIZE);
-    set_header(thread->buffer, identifier, status);
-    send(connfd, thread->buffer, 5, 0);
-  } else if (function == 0x0302) { /* Load key-value store */
-    filename_length = recv_uint16(connfd);
-    filename = (uint8_t *)calloc(filename_length + 1, sizeof(uint8_t));
-    recv_string(connfd, filename, filename_length, 1);
+    pthread_rwlock_unlock(thread->kvs_lock); // Unlock the k-v store
+  }
+
+  memset(thread->buffer, 0, BUFFER_SIZE);
+  set_header(thread->buffer, identifier, status);
+  send(connfd, thread->buffer, 5, 0);
+
+  free(key);
+}
+
+typedef struct ScanObj {
+  uint8_t *buffer;
+  uint64_t length;
+  uint8_t *prefix;
+  uint8_t *end;
+  uint8_t limit;
+  uint8_t count;
+  uint8_t more;
+} ScanObj;
+
+// Add a variable to a scan response
+// Stops at the end of the prefix or range, or once the page is full, in which
+// case the response says that more variables follow
+uint8_t server_scan_variable(void *arg, uint8_t *key, uint8_t flag,
+                             int64_t value, uint8_t *name, uint64_t version) {
+  ScanObj *scan = (ScanObj *)arg;
+
+  if (scan->prefix != NULL &&
+      strncmp((char *)key, (char *)scan->prefix,
+              strlen((char *)scan->prefix)) != 0) {
+    return 1;
+  }
+  if (scan->end != NULL && strcmp((char *)key, (char *)scan->end) >= 0) {
+    return 1;
+  }
+  if (scan->count == scan->limit) {
+    scan->more = 1;
+    return 1;
+  }
+
+  uint8_t length = strlen((char *)key);
+  uint8_to_wire(scan->buffer, scan->length, length);
+  set_string(scan->buffer + scan->length + 1, key, length);
+  scan->length += 1 + length;
+  uint64_to_wire(scan->buffer, scan->length, scan->length + 7, version);
+  uint8_to_wire(scan->buffer, scan->length + 8, flag);
+  scan->length += 9;
+  if (flag == 1) {
+    length = strlen((char *)name);
+    uint8_to_wire(scan->buffer, scan->length, length);
+    set_string(scan->buffer + scan->length + 1, name, length);
+    scan->length += 1 + length;
+  } else {
+    uint64_to_wire(scan->buffer, scan->length, scan->length + 7, value);
+    scan->length += 8;
+  }
+  scan->count++;
+  return 0;
+}
 
-    pthread_mutex_lock(thread->kvs_mutex); // Lock the key-value store mutex
+// List variables in name order, a page at a time
+// A page holds the k-v store for reading only while it is filled, and the
+// client continues with the last name it got as the cursor, so a long scan
+// never holds off writers. Each page sees the store as it is when it is read.
+void server_scan(int connfd, Thread thread, uint16_t /*opcode*/,
+                 uint32_t identifier) {
+  uint8_t flags = recv_uint8(connfd);
+  uint8_t *start = NULL;
+  uint8_t *end = NULL;
+  uint8_t *cursor = NULL;
+  uint8_t status = server_recv_name(connfd, &start, 0);
+  if (!(flags & SCAN_PREFIX)) {
+    status |= server_recv_name(connfd, &end, 0);
+  }
+  status |= server_recv_name(connfd, &cursor, 0);
+  uint8_t limit = recv_uint8(connfd);
+
+  if ((flags & ~SCAN_PREFIX) != 0 || limit == 0) {
+    status = EINVAL;
+  }
+
+  memset(thread->buffer, 0, BUFFER_SIZE);
+  ScanObj scan = {thread->buffer,
+                  7,
+                  (flags & SCAN_PREFIX) ? start : NULL,
+                  end,
+                  (uint8_t)(limit < SCAN_MAX_KEYS ? limit : SCAN_MAX_KEYS),
+                  0,
+                  0};
+
+  if (status == 0) {
+    // Continue after the cursor unless the range starts past it
+    uint8_t *from = start;
+    uint8_t after = 0;
+    if (cursor != NULL &&
+        (start == NULL || strcmp((char *)cursor, (char *)start) >= 0)) {
+      from = cursor;
+      after = 1;
+    }
+
+    pthread_rwlock_rdlock(thread->kvs_lock); // Lock the k-v store for reading
     // ------------------------------------------------------------------------
     // Begin critical section
 
-    status = load_key_value_store(thread->kvstore, (char *)filename);
-    if (status == 0) {
-      status = log_key_value_store(thread->kvstore, *(thread->logfd));
-    }
+    key_value_store_scan(thread->kvstore, from, after, server_scan_variable,
+                         &scan);
 
     // End critical section
     // ------------------------------------------------------------------------
-    pthread_mutex_unlock(thread->kvs_mutex); // Unlock the k-v store mutex
+    pthread_rwlock_unlock(thread->kvs_lock); // Unlock the k-v store
+  }
 
-    memset(thread->buffer, 0, BUFFER_SIZE);
-    set_header(thread->buffer, identifier, status);
+  set_header(thread->buffer, identifier, status);
+  if (status == 0) {
+    uint8_to_wire(thread->buffer, 5, scan.count);
+    uint8_to_wire(thread->buffer, 6, scan.more);
+    send(connfd, thread->buffer, scan.length, 0);
+  } else {
     send(connfd, thread->buffer, 5, 0);
-  } else if (function == 0x0310) { /* Clear key-value store */
-    magic_number = recv_uint32(connfd);
-
-    if (magic_number == 0x0badbad0) {
-      pthread_mutex_lock(thread->kvs_mutex); // Lock the key-value store mutex
-      // ----------------------------------------------------------------------
-      // Begin critical section
+  }
 
-      status = clear_key_value_store(thread->kvstore);
-      if (status == 0) {
-        status = clear_log(*(thread->dirfd), thread->logfd);
-      }
+  free(start);
+  free(end);
+  free(cursor);
+}
 
-      // End critical section
-      // ----------------------------------------------------------------------
-      pthread_mutex_unlock(thread->kvs_mutex); // Unlock the k-v store mutex
-    } else {
-      status = EINVAL;
+// Fill in the dispatch table
+// The low nibble of a 0x01XX opcode is the function and the high nibble is
+// the kind of its operands, and 0x05XX to 0x07XX opcodes share the same
+// handlers
+void server_init_dispatch() {
+  memset(dispatch_table, 0, sizeof(dispatch_table));
+
+  for (uint16_t low = 0; low < 256; low++) {
+    uint8_t function = low & 0x0F;
+    Handler handler = NULL;
+    if (function >= 0x01 && function <= 0x05) {
+      handler = arithmetic_table[function - 1].handlers[low >> 4];
+    } else if (function == 0x08) {
+      handler = server_get_variable;
+    } else if (function == 0x09) {
+      handler = server_set_variable;
+    } else if (function == 0x0F) {
+      handler = server_delete_variable;
     }
+    dispatch_table[0x01][low] = handler;
+    dispatch_table[VERSIONED_GROUP][low] = handler;
+
+    // Only requests that store a variable can give it an expiry
+    if ((function >= 0x01 && function <= 0x05 &&
+         ((low >> 4) & KIND_RESULT_VARIABLE)) ||
+        function == 0x09) {
+      dispatch_table[EXPIRING_GROUP][low] = handler;
+      dispatch_table[VERSIONED_EXPIRING_GROUP][low] = handler;
+    }
+  }
 
-    memset(thread->buffer, 0, BUFFER_SIZE);
-    set_header(thread->buffer, identifier, status);
-    send(connfd, thread->buffer, 5, 0);
+  dispatch_table[0x02][0x01] = server_read;
+  dispatch_table[0x02][0x02] = server_write;
+  dispatch_table[0x02][0x03] = server_read_large;
+  dispatch_table[0x02][0x04] = server_write_large;
+  dispatch_table[0x02][0x05] = server_copy;
+  dispatch_table[0x02][0x10] = server_create;
+  dispatch_table[0x02][0x11] = server_create_preallocated;
+  dispatch_table[0x02][0x20] = server_file_size;
+  dispatch_table[0x03][0x01] = server_dump;
+  dispatch_table[0x03][0x02] = server_load;
+  dispatch_table[0x03][0x10] = server_clear;
+  dispatch_table[0x03][0x20] = server_statistics;
+  dispatch_table[0x04][0x01] = server_vector_arithmetic;
+  dispatch_table[0x04][0x10] = server_evaluate;
+  dispatch_table[0x04][0x11] = server_fetch_add;
+  dispatch_table[0x04][0x12] = server_fetch_add;
+  dispatch_table[0x04][0x13] = server_compare_and_swap;
+  dispatch_table[0x04][0x20] = server_transaction;
+  dispatch_table[0x04][0x21] = server_get_versioned;
+  dispatch_table[0x04][0x22] = server_get_versioned;
+  dispatch_table[0x04][0x23] = server_set_if_version;
+  dispatch_table[0x04][0x30] = server_watch;
+  dispatch_table[0x04][0x40] = server_expire;
+  dispatch_table[0x04][0x50] = server_scan;
+}
+
+// Process an RPC request
+// Requests without a handler get no response
+int server_run(int connfd, Thread thread) {
+  uint16_t opcode = wire_to_uint16(thread->buffer, 0, 1);
+  uint32_t identifier = wire_to_uint32(thread->buffer, 2, 5);
+  uint8_t group = opcode >> 8;
+
+  if (group < DISPATCH_GROUPS && dispatch_table[group][opcode & 0xFF]) {
+    dispatch_table[group][opcode & 0xFF](connfd, thread, opcode, identifier);
   }
 
   return connfd;
 }
 
+// Check if the request header in a buffer is for a file operation
+uint8_t server_is_file_request(uint8_t *buffer) {
+  return (wire_to_uint16(buffer, 0, 1) & 0xFF00) == 0x0200;
+}
+
+// Hand a connection to the first idle worker thread
+void server_dispatch(Thread thread, int connfd) {
+  sem_wait(thread->dispatch_lock); // Make the dispatch lock wait
+
+  pthread_mutex_lock(thread->main_mutex); // Lock the main mutex
+  // --------------------------------------------------------------------------
+  // Begin critical section
+
+  uint64_t i = dequeue(thread->queue); // Get first available thread id
+  Thread worker = thread->threads[i];  // Get the ith thread in the thread array
+  worker->cl = connfd; // Assign the connection file descriptor to the thread
+  pthread_cond_signal(&(worker->cv)); // Signal the worker thread
+
+  // End critical section
+  // --------------------------------------------------------------------------
+  pthread_mutex_unlock(thread->main_mutex); // Unlock the main mutex
+}
+
+// Hand a connection to the file I/O threads
+void server_post_io(Thread thread, int connfd) {
+  pthread_mutex_lock(thread->io_mutex); // Lock the file I/O queue mutex
+  enqueue(thread->io_queue, connfd);
+  pthread_cond_signal(thread->io_cv); // Signal a file I/O thread
+  pthread_mutex_unlock(thread->io_mutex); // Unlock the file I/O queue mutex
+}
+
+// Give a connection back to the worker threads without waiting for one
+// File I/O threads must not block on busy workers, so a connection that finds
+// none idle waits in the ready queue for the next worker to finish
+void server_return_io(Thread thread, int connfd) {
+  pthread_mutex_lock(thread->main_mutex); // Lock the main mutex
+  // --------------------------------------------------------------------------
+  // Begin critical section
+
+  if (sem_trywait(thread->dispatch_lock) == 0) {
+    uint64_t i = dequeue(thread->queue); // Get first available thread id
+    Thread worker = thread->threads[i];
+    worker->cl = connfd;
+    pthread_cond_signal(&(worker->cv)); // Signal the worker thread
+  } else {
+    enqueue(thread->ready_queue, connfd);
+  }
+
+  // End critical section
+  // --------------------------------------------------------------------------
+  pthread_mutex_unlock(thread->main_mutex); // Unlock the main mutex
+}
+
 // Thread loop
 void *server_start(void *arg) {
   Thread thread = (Thread)arg;
@@ -1128,31 +1743,122 @@ void *server_start(void *arg) {
     pthread_mutex_unlock(thread->main_mutex); // Unlock the main mutex
 
     memset(thread->buffer, 0, BUFFER_SIZE); // Clear the buffer
-    
-    // Get 6 bytes from the client
-    ssize_t bytes_read = recv_loop(thread->cl, thread->buffer, 6);
+
+    // Look at the next 6 bytes from the client
+    ssize_t bytes_read = peek_loop(thread->cl, thread->buffer, 6);
+    thread->detached = 0;
 
     // Continute to process requests while they exist
     while (bytes_read == 6) {
+      // Let the file I/O threads wait on the disk so that this thread can
+      // serve other connections in the meantime
+      if (thread->io_threads > 0 && server_is_file_request(thread->buffer)) {
+        server_post_io(thread, thread->cl);
+        break;
+      }
+
+      recv_loop(thread->cl, thread->buffer, 6); // Get 6 bytes from the client
       server_run(thread->cl, thread); // Process the incoming request
+
+      // Stop serving a connection that was handed to another thread
+      if (thread->detached) {
+        break;
+      }
+
       memset(thread->buffer, 0, BUFFER_SIZE); // Clear the buffer
-      // Get 6 bytes from the client
-      bytes_read = recv_loop(thread->cl, thread->buffer, 6);
+      bytes_read = peek_loop(thread->cl, thread->buffer, 6);
     }
 
-    thread->cl = 0; // Set the thread status to not waiting
-
     pthread_mutex_lock(thread->main_mutex); // Lock the main mutex
     // ------------------------------------------------------------------------
     // Begin critical section
 
-    enqueue(thread->queue, thread->id); // Enqueue the current thread id
+    // Serve a connection handed back by the file I/O threads before going
+    // idle. Otherwise the dispatch lock is signalled under the main mutex, so
+    // a file I/O thread that finds no idle worker knows the connection it
+    // queues will be seen.
+    if (!queue_is_empty(thread->ready_queue)) {
+      thread->cl = dequeue(thread->ready_queue);
+    } else {
+      thread->cl = 0; // Set the thread status to not waiting
+      enqueue(thread->queue, thread->id); // Enqueue the current thread id
+      sem_post(thread->dispatch_lock);    // Signal the dispatch lock
+    }
 
     // End critical section
     // ------------------------------------------------------------------------
     pthread_mutex_unlock(thread->main_mutex); // Unlock the main mutex
+  }
+
+  return 0;
+}
+
+// File I/O thread loop
+void *server_io_start(void *arg) {
+  Thread thread = (Thread)arg;
+  int connfd;
+
+  while (true) {
+    pthread_mutex_lock(thread->io_mutex); // Lock the file I/O queue mutex
+    // ------------------------------------------------------------------------
+    // Begin critical section
+
+    // Keep a thread waiting while there are no file requests
+    while (queue_is_empty(thread->io_queue)) {
+      pthread_cond_wait(thread->io_cv, thread->io_mutex);
+    }
+
+    connfd = dequeue(thread->io_queue); // Get the next waiting connection
+
+    // End critical section
+    // ------------------------------------------------------------------------
+    pthread_mutex_unlock(thread->io_mutex); // Unlock the file I/O queue mutex
+
+    // Serve the one file request whose header the worker already saw and
+    // give the connection back, so that an idle client never holds a file
+    // I/O thread
+    memset(thread->buffer, 0, BUFFER_SIZE); // Clear the buffer
+    recv_loop(connfd, thread->buffer, 6); // Get 6 bytes from the client
+    server_run(connfd, thread); // Process the incoming request
+    server_return_io(thread, connfd);
+  }
+
+  return 0;
+}
+
+// Expiry thread loop
+// Deletes the variables that expired once every tick of the timer wheel, and
+// only takes the k-v store lock for writing when a timer of the wheel is due,
+// so that ticks with nothing to do do not stall readers
+void *server_expire_start(void *arg) {
+  Thread thread = (Thread)arg;
+  struct timespec tick = {0, DEFAULT_TIMER_TICK * 1000000L};
+  uint64_t next = 0;
+
+  while (true) {
+    nanosleep(&tick, NULL);
+
+    if (key_value_store_num_expiring(thread->kvstore) == 0) {
+      continue;
+    }
+
+    pthread_rwlock_rdlock(thread->kvs_lock); // Lock the k-v store for reading
+    next = key_value_store_next_expiry(thread->kvstore);
+    pthread_rwlock_unlock(thread->kvs_lock); // Unlock the k-v store
 
-    sem_post(thread->dispatch_lock); // Signal the dispatch lock
+    if (next > timer_now()) {
+      continue;
+    }
+
+    pthread_rwlock_wrlock(thread->kvs_lock); // Lock the k-v store for writing
+    // ------------------------------------------------------------------------
+    // Begin critical section
+
+    key_value_store_expire(thread->kvstore, timer_now(), *(thread->logfd));
+
+    // End critical section
+    // ------------------------------------------------------------------------
+    pthread_rwlock_unlock(thread->kvs_lock); // Unlock the k-v store
   }
 
   return 0;
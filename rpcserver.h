@@ -1,35 +1,85 @@
 #ifndef __RPCSERVER_H__
 #define __RPCSERVER_H__
 
+#include "rpcbufferpool.h"
+#include "rpcexpr.h"
+#include "rpcfilecache.h"
 #include "rpckeyvaluestore.h"
 #include "rpcqueue.h"
+#include "rpcwatch.h"
 #include <cstdint>
 #include <pthread.h>
 #include <semaphore.h>
 
 #define BUFFER_SIZE 4096
 
+#define STAT_FILE_LOCK_WAITS 0x0001
+#define STAT_FILE_LOCK_WAIT_TIME 0x0002
+#define STAT_FILE_CACHE_ENTRIES 0x0003
+#define STAT_FILE_WINDOWS 0x0004
+#define STAT_WATCH_SUBSCRIBERS 0x0005
+#define STAT_WATCH_OVERFLOWS 0x0006
+#define STAT_EXPIRING_KEYS 0x0007
+#define STAT_MEMORY 0x0008
+#define STAT_EVICTIONS 0x0009
+#define STAT_EVICTED_BYTES 0x000A
+
+#define DISPATCH_GROUPS 8
+
 typedef struct ThreadObj {
   uint8_t buffer[BUFFER_SIZE];
   int cl;
+  uint8_t detached;
   uint64_t id;
   uint64_t iterations;
+  uint64_t chunk_size;
+  uint8_t direct;
   int *dirfd;
   int *logfd;
   KeyValueStore kvstore;
+  FileCache fcache;
+  BufferPool bpool;
+  ProgramCache pcache;
+  WatchTable watches;
   Queue queue;
+  Queue io_queue;
+  Queue ready_queue;
+  uint8_t io_threads;
+  struct ThreadObj **threads;
   pthread_cond_t cv;
+  pthread_cond_t *io_cv;
   pthread_mutex_t *main_mutex;
-  pthread_mutex_t *kvs_mutex;
+  pthread_rwlock_t *kvs_lock;
+  pthread_mutex_t *io_mutex;
   sem_t *dispatch_lock;
 } ThreadObj;
 
 typedef struct ThreadObj *Thread;
 
+typedef void (*Handler)(int connfd, Thread thread, uint16_t opcode, uint32_t identifier);
+
 int server_connect(char *hostname, uint16_t port);
 
+uint64_t transfer_chunk_size(Thread thread, uint32_t chunk);
+
+uint8_t server_statistic(Thread thread, uint16_t stat, uint64_t *value);
+
+void server_init_dispatch();
+
 int server_run(int connfd, Thread thread);
 
+uint8_t server_is_file_request(uint8_t *buffer);
+
+void server_dispatch(Thread thread, int connfd);
+
+void server_post_io(Thread thread, int connfd);
+
+void server_return_io(Thread thread, int connfd);
+
 void * server_start(void *arg);
 
+void * server_io_start(void *arg);
+
+void * server_expire_start(void *arg);
+
 #endif
\ No newline at end of file
@@ -0,0 +1,292 @@
+#include "rpcskiplist.h"
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+// A node reaches each next level with a chance of 1/4, so 16 levels keep
+// searches logarithmic up to 4^16 keys with 1.33 links per node on average
+#define SKIP_LIST_LEVELS 16
+
+typedef struct SkipListNodeObj {
+  uint8_t *key;
+  void *value;
+  uint8_t height;
+  struct SkipListNodeObj *next[1];
+} SkipListNodeObj;
+
+typedef struct SkipListObj {
+  SkipListNode head;
+  uint8_t height;
+  uint64_t num_items;
+  uint64_t memory;
+  uint64_t seed;
+} SkipListObj;
+
+// Input: height - the number of levels the node is linked on
+// Output: the size of a node in bytes
+//
+// Get the size of a node with a specific height
+uint64_t skip_list_node_size(uint8_t height) {
+  return sizeof(SkipListNodeObj) + (height - 1) * sizeof(SkipListNode);
+}
+
+// Input: key - the key of the node
+// Input: value - the value of the node
+// Input: height - the number of levels the node is linked on
+// Output: the newly created node or NULL
+//
+// Create a skip list node
+SkipListNode create_skip_list_node(uint8_t *key, void *value, uint8_t height) {
+  SkipListNode node =
+      (SkipListNodeObj *)calloc(1, skip_list_node_size(height));
+  if (node != NULL) {
+    node->key = key;
+    node->value = value;
+    node->height = height;
+  }
+  return node;
+}
+
+// Input: list - the skip list
+// Output: the height of a new node
+//
+// Pick the height of a new node
+// Each pair of bits of a xorshift draw decides one more level
+uint8_t skip_list_random_height(SkipList list) {
+  uint64_t x = list->seed;
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  list->seed = x;
+
+  uint8_t height = 1;
+  while (height < SKIP_LIST_LEVELS && (x & 3) == 0) {
+    height++;
+    x >>= 2;
+  }
+  return height;
+}
+
+// Input: list - the skip list
+// Input: key - the key to search for
+// Input: update - set to the last node before the key on each level, or NULL
+// Output: the first node whose key is not less than the key or NULL
+//
+// Find where a key is or would be in a skip list
+SkipListNode skip_list_find(SkipList list, uint8_t *key, SkipListNode *update) {
+  SkipListNode node = list->head;
+  for (int8_t level = list->height - 1; level >= 0; level--) {
+    while (node->next[level] != NULL &&
+           strcmp((char *)node->next[level]->key, (char *)key) < 0) {
+      node = node->next[level];
+    }
+    if (update != NULL) {
+      update[level] = node;
+    }
+  }
+  return node->next[0];
+}
+
+// Input: none
+// Output: the newly created skip list
+//
+// Create a skip list
+SkipList create_skip_list() {
+  SkipList list = (SkipListObj *)malloc(sizeof(SkipListObj));
+  if (list != NULL) {
+    list->head = create_skip_list_node(NULL, NULL, SKIP_LIST_LEVELS);
+    if (list->head == NULL) {
+      free(list);
+      return NULL;
+    }
+    list->height = 1;
+    list->num_items = 0;
+    list->memory = 0;
+    list->seed = 0x9E3779B97F4A7C15UL;
+  }
+  return list;
+}
+
+// Input: ptr - pointer to a skip list
+// Output: (0) if the skip list was deleted successfully, EINVAL (22) if the
+// pointer or contents of the skip list do not exist
+//
+// Delete a skip list
+// The keys and values belong to the caller and are not freed
+uint8_t delete_skip_list(SkipList *ptr) {
+  if (ptr != NULL && *ptr != NULL) {
+    SkipList list = *ptr;
+    skip_list_clear(list);
+    free(list->head);
+    free(list);
+    *ptr = NULL;
+    return 0;
+  } else {
+    return EINVAL;
+  }
+}
+
+// Input: list - the skip list
+// Input: key - the key to insert, which must stay valid until it is deleted
+// Input: value - the value to map the key to
+// Output: (0) if the key was inserted, EINVAL (22) if the list or key are
+// NULL or ENOMEM (12) if a node could not be allocated
+//
+// Insert a key into a skip list or replace the value it maps to
+uint8_t skip_list_insert(SkipList list, uint8_t *key, void *value) {
+  if (list == NULL || key == NULL) {
+    return EINVAL;
+  }
+
+  SkipListNode update[SKIP_LIST_LEVELS];
+  SkipListNode node = skip_list_find(list, key, update);
+  if (node != NULL && strcmp((char *)node->key, (char *)key) == 0) {
+    node->key = key;
+    node->value = value;
+    return 0;
+  }
+
+  uint8_t height = skip_list_random_height(list);
+  node = create_skip_list_node(key, value, height);
+  if (node == NULL) {
+    return ENOMEM;
+  }
+  for (uint8_t level = list->height; level < height; level++) {
+    update[level] = list->head;
+  }
+  for (uint8_t level = 0; level < height; level++) {
+    node->next[level] = update[level]->next[level];
+    update[level]->next[level] = node;
+  }
+  if (height > list->height) {
+    list->height = height;
+  }
+  list->num_items++;
+  list->memory += skip_list_node_size(height);
+  return 0;
+}
+
+// Input: list - the skip list
+// Input: key - the key to delete
+// Output: (0) if the key was deleted or ENOENT (2) if it is not in the list
+//
+// Delete a key from a skip list
+uint8_t skip_list_delete(SkipList list, uint8_t *key) {
+  if (list == NULL || key == NULL) {
+    return ENOENT;
+  }
+
+  SkipListNode update[SKIP_LIST_LEVELS];
+  SkipListNode node = skip_list_find(list, key, update);
+  if (node == NULL || strcmp((char *)node->key, (char *)key) != 0) {
+    return ENOENT;
+  }
+
+  for (uint8_t level = 0; level < node->height; level++) {
+    update[level]->next[level] = node->next[level];
+  }
+  while (list->height > 1 && list->head->next[list->height - 1] == NULL) {
+    list->height--;
+  }
+  list->num_items--;
+  list->memory -= skip_list_node_size(node->height);
+  free(node);
+  return 0;
+}
+
+// Input: list - the skip list
+// Output: none
+//
+// Delete every key from a skip list
+void skip_list_clear(SkipList list) {
+  if (list == NULL) {
+    return;
+  }
+  SkipListNode node = list->head->next[0];
+  while (node != NULL) {
+    SkipListNode next = node->next[0];
+    free(node);
+    node = next;
+  }
+  memset(list->head->next, 0, SKIP_LIST_LEVELS * sizeof(SkipListNode));
+  list->height = 1;
+  list->num_items = 0;
+  list->memory = 0;
+  return;
+}
+
+// Input: list - the skip list
+// Input: key - the key to start from, or NULL for the first key
+// Input: after - (1) to start after the key, (0) to start at it
+// Output: the first node at or after the key or NULL
+//
+// Find the node a scan in key order starts from
+SkipListNode skip_list_seek(SkipList list, uint8_t *key, uint8_t after) {
+  if (list == NULL) {
+    return NULL;
+  }
+  if (key == NULL) {
+    return list->head->next[0];
+  }
+  SkipListNode node = skip_list_find(list, key, NULL);
+  if (after && node != NULL && strcmp((char *)node->key, (char *)key) == 0) {
+    node = node->next[0];
+  }
+  return node;
+}
+
+// Input: node - a node of a skip list
+// Output: the node with the next key or NULL
+//
+// Get the node that follows a node in key order
+SkipListNode skip_list_next(SkipListNode node) {
+  if (node == NULL) {
+    return NULL;
+  }
+  return node->next[0];
+}
+
+// Input: node - a node of a skip list
+// Output: the key of the node
+//
+// Get the key of a skip list node
+uint8_t *skip_list_node_key(SkipListNode node) {
+  if (node == NULL) {
+    return NULL;
+  }
+  return node->key;
+}
+
+// Input: node - a node of a skip list
+// Output: the value of the node
+//
+// Get the value of a skip list node
+void *skip_list_node_value(SkipListNode node) {
+  if (node == NULL) {
+    return NULL;
+  }
+  return node->value;
+}
+
+// Input: list - the skip list
+// Output: the number of keys in the skip list
+//
+// Get the number of keys of a skip list
+uint64_t skip_list_num_items(SkipList list) {
+  if (list == NULL) {
+    return 0;
+  }
+  return list->num_items;
+}
+
+// Input: list - the skip list
+// Output: the number of bytes taken by the nodes of the skip list
+//
+// Get the memory used by the keys of a skip list
+uint64_t skip_list_memory(SkipList list) {
+  if (list == NULL) {
+    return 0;
+  }
+  return list->memory;
+}
@@ -0,0 +1,32 @@
+#ifndef __RPCSKIPLIST_H__
+#define __RPCSKIPLIST_H__
+
+#include <cstdint>
+
+typedef struct SkipListObj *SkipList;
+
+typedef struct SkipListNodeObj *SkipListNode;
+
+SkipList create_skip_list();
+
+uint8_t delete_skip_list(SkipList *ptr);
+
+uint8_t skip_list_insert(SkipList list, uint8_t *key, void *value);
+
+uint8_t skip_list_delete(SkipList list, uint8_t *key);
+
+void skip_list_clear(SkipList list);
+
+SkipListNode skip_list_seek(SkipList list, uint8_t *key, uint8_t after);
+
+SkipListNode skip_list_next(SkipListNode node);
+
+uint8_t *skip_list_node_key(SkipListNode node);
+
+void *skip_list_node_value(SkipListNode node);
+
+uint64_t skip_list_num_items(SkipList list);
+
+uint64_t skip_list_memory(SkipList list);
+
+#endif
@@ -0,0 +1,288 @@
+#include "rpctimer.h"
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <time.h>
+
+// Each level of the wheel has 64 slots and each slot of a level spans all 64
+// slots of the level below it, so four levels cover 64^4 ticks
+#define WHEEL_BITS 6
+#define WHEEL_SIZE (1 << WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SIZE - 1)
+#define WHEEL_LEVELS 4
+#define WHEEL_SPAN (1L << (WHEEL_BITS * WHEEL_LEVELS))
+
+typedef struct TimerObj {
+  uint64_t expires;
+  uint64_t tick;
+  void *arg;
+  struct TimerObj *next;
+  struct TimerObj **pprev;
+} TimerObj;
+
+typedef struct TimerWheelObj {
+  uint64_t tick;
+  uint64_t current;
+  uint64_t num_timers;
+  Timer slots[WHEEL_LEVELS][WHEEL_SIZE];
+} TimerWheelObj;
+
+// Input: none
+// Output: the wall clock time in milliseconds
+//
+// Get the current time of the timer wheel
+// The coarse clock is read without a system call, which makes it cheap enough
+// to check on every lookup
+uint64_t timer_now() {
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME_COARSE, &now);
+  return now.tv_sec * 1000L + now.tv_nsec / 1000000L;
+}
+
+// Input: head - the list to link into
+// Input: timer - the timer to link
+// Output: none
+//
+// Link a timer at the head of a list
+void timer_link(Timer *head, Timer timer) {
+  timer->next = *head;
+  if (*head != NULL) {
+    (*head)->pprev = &(timer->next);
+  }
+  timer->pprev = head;
+  *head = timer;
+  return;
+}
+
+// Input: timer - the timer to unlink
+// Output: none
+//
+// Unlink a timer from whatever list it is on
+void timer_unlink(Timer timer) {
+  *(timer->pprev) = timer->next;
+  if (timer->next != NULL) {
+    timer->next->pprev = timer->pprev;
+  }
+  timer->next = NULL;
+  timer->pprev = NULL;
+  return;
+}
+
+// Input: wheel - the timer wheel
+// Input: timer - the timer to place
+// Input: earliest - the first tick whose slot has not been fired yet
+// Output: none
+//
+// Place a timer in the slot of the lowest level that reaches its tick
+// A timer further away than the whole wheel waits in the last level and is
+// placed again each time that slot comes around
+void timer_place(TimerWheel wheel, Timer timer, uint64_t earliest) {
+  uint64_t tick = timer->tick;
+  uint8_t level = 0;
+
+  if (tick < earliest) {
+    tick = earliest;
+  } else if (tick - wheel->current >= WHEEL_SPAN) {
+    tick = wheel->current + WHEEL_SPAN - 1;
+  }
+
+  while (level < WHEEL_LEVELS - 1 &&
+         tick - wheel->current >= (1UL << (WHEEL_BITS * (level + 1)))) {
+    level++;
+  }
+
+  timer_link(
+      &(wheel->slots[level][(tick >> (WHEEL_BITS * level)) & WHEEL_MASK]),
+      timer);
+  return;
+}
+
+// Input: now - the current time in milliseconds
+// Input: tick - the number of milliseconds in a tick
+// Output: the newly created timer wheel
+//
+// Create a timer wheel
+TimerWheel create_timer_wheel(uint64_t now, uint64_t tick) {
+  TimerWheel wheel = (TimerWheelObj *)calloc(1, sizeof(TimerWheelObj));
+  if (wheel != NULL) {
+    wheel->tick = tick > 0 ? tick : 1;
+    wheel->current = now / wheel->tick;
+    wheel->num_timers = 0;
+  }
+  return wheel;
+}
+
+// Input: ptr - pointer to a timer wheel
+// Output: (0) if the wheel was deleted successfully, EINVAL (22) if the
+// pointer or contents of the wheel do not exist
+//
+// Delete a timer wheel and the timers that have not fired
+uint8_t delete_timer_wheel(TimerWheel *ptr) {
+  if (ptr != NULL && *ptr != NULL) {
+    TimerWheel wheel = *ptr;
+    for (uint8_t level = 0; level < WHEEL_LEVELS; level++) {
+      for (uint16_t slot = 0; slot < WHEEL_SIZE; slot++) {
+        while (wheel->slots[level][slot] != NULL) {
+          Timer timer = wheel->slots[level][slot];
+          timer_unlink(timer);
+          free(timer);
+        }
+      }
+    }
+    free(wheel);
+    *ptr = NULL;
+    return 0;
+  } else {
+    return EINVAL;
+  }
+}
+
+// Input: wheel - the timer wheel
+// Input: expires - the time in milliseconds to fire the timer at
+// Input: arg - the argument to pass to the callback when the timer fires
+// Output: the newly created timer or NULL
+//
+// Add a timer to a timer wheel in constant time
+Timer timer_wheel_add(TimerWheel wheel, uint64_t expires, void *arg) {
+  if (wheel == NULL) {
+    return NULL;
+  }
+  Timer timer = (TimerObj *)malloc(sizeof(TimerObj));
+  if (timer != NULL) {
+    timer->expires = expires;
+    // Round up so that a timer never fires before it expires
+    timer->tick = (expires + wheel->tick - 1) / wheel->tick;
+    timer->arg = arg;
+    // An empty wheel is not advanced while idle, so catch it up first or the
+    // timer would be placed by the distance from a stale tick
+    uint64_t now = timer_now() / wheel->tick;
+    if (wheel->num_timers == 0 && wheel->current < now) {
+      wheel->current = now;
+    }
+    timer_place(wheel, timer, wheel->current + 1);
+    __atomic_add_fetch(&(wheel->num_timers), 1, __ATOMIC_RELAXED);
+  }
+  return timer;
+}
+
+// Input: wheel - the timer wheel
+// Input: timer - a timer of the wheel that has not fired
+// Output: none
+//
+// Cancel a timer in constant time
+void timer_wheel_cancel(TimerWheel wheel, Timer timer) {
+  if (wheel == NULL || timer == NULL) {
+    return;
+  }
+  timer_unlink(timer);
+  __atomic_sub_fetch(&(wheel->num_timers), 1, __ATOMIC_RELAXED);
+  free(timer);
+  return;
+}
+
+// Input: wheel - the timer wheel
+// Input: now - the current time in milliseconds
+// Input: callback - the function to call for each timer that fires
+// Input: ctx - the first argument to pass to the callback
+// Output: the number of timers that fired
+//
+// Advance a timer wheel to the current time and fire the timers that expired
+// Each tick moves the timers of a higher level slot down once every 64 ticks
+// of the level below it, so every timer is moved at most once per level
+uint64_t timer_wheel_advance(TimerWheel wheel, uint64_t now,
+                             TimerCallback callback, void *ctx) {
+  if (wheel == NULL) {
+    return 0;
+  }
+
+  uint64_t target = now / wheel->tick;
+  uint64_t num_fired = 0;
+  Timer pending;
+  Timer timer;
+
+  // An empty wheel has nothing to cascade or fire on the way
+  if (wheel->num_timers == 0 && wheel->current < target) {
+    wheel->current = target;
+  }
+
+  while (wheel->current < target) {
+    wheel->current++;
+
+    // Cascade the slots of the higher levels that have come around
+    for (uint8_t level = 1; level < WHEEL_LEVELS; level++) {
+      if ((wheel->current & ((1UL << (WHEEL_BITS * level)) - 1)) != 0) {
+        break;
+      }
+      Timer *slot = &(wheel->slots[level][(wheel->current >>
+                                           (WHEEL_BITS * level)) &
+                                          WHEEL_MASK]);
+      pending = NULL;
+      while ((timer = *slot) != NULL) {
+        timer_unlink(timer);
+        timer_link(&pending, timer);
+      }
+      while ((timer = pending) != NULL) {
+        timer_unlink(timer);
+        timer_place(wheel, timer, wheel->current);
+      }
+    }
+
+    // Fire the timers of the current tick
+    // They are moved to a list of their own first so that the callback can
+    // cancel or add timers
+    Timer *slot = &(wheel->slots[0][wheel->current & WHEEL_MASK]);
+    pending = NULL;
+    while ((timer = *slot) != NULL) {
+      timer_unlink(timer);
+      timer_link(&pending, timer);
+    }
+    while ((timer = pending) != NULL) {
+      timer_unlink(timer);
+      if (timer->tick > wheel->current) {
+        timer_place(wheel, timer, wheel->current + 1);
+        continue;
+      }
+      __atomic_sub_fetch(&(wheel->num_timers), 1, __ATOMIC_RELAXED);
+      void *arg = timer->arg;
+      free(timer);
+      num_fired++;
+      callback(ctx, arg);
+    }
+  }
+
+  return num_fired;
+}
+
+// Input: wheel - the timer wheel
+// Output: the number of timers that have not fired
+//
+// Get the number of timers of a timer wheel
+uint64_t timer_wheel_num_timers(TimerWheel wheel) {
+  if (wheel == NULL) {
+    return 0;
+  }
+  return __atomic_load_n(&(wheel->num_timers), __ATOMIC_RELAXED);
+}
+
+// Input: wheel - the timer wheel
+// Output: the time in milliseconds before which advancing the wheel has
+// nothing to do, or UINT64_MAX if the wheel has no timers
+//
+// Get the next time a timer of a timer wheel may fire
+// Only the 64 slots of the lowest level are looked at. Timers further away
+// are moved down when the next slot of the level above comes around, so that
+// tick is returned for them.
+uint64_t timer_wheel_next_expiry(TimerWheel wheel) {
+  if (wheel == NULL || wheel->num_timers == 0) {
+    return UINT64_MAX;
+  }
+
+  for (uint64_t tick = wheel->current + 1; tick <= wheel->current + WHEEL_SIZE;
+       tick++) {
+    if (wheel->slots[0][tick & WHEEL_MASK] != NULL) {
+      return tick * wheel->tick;
+    }
+  }
+
+  return (((wheel->current >> WHEEL_BITS) + 1) << WHEEL_BITS) * wheel->tick;
+}
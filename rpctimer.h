@@ -0,0 +1,31 @@
+#ifndef __RPCTIMER_H__
+#define __RPCTIMER_H__
+
+#include <cstdint>
+
+// Milliseconds in a tick of the timer wheel
+#define DEFAULT_TIMER_TICK 10
+
+typedef struct TimerWheelObj *TimerWheel;
+
+typedef struct TimerObj *Timer;
+
+typedef void (*TimerCallback)(void *ctx, void *arg);
+
+uint64_t timer_now();
+
+TimerWheel create_timer_wheel(uint64_t now, uint64_t tick);
+
+uint8_t delete_timer_wheel(TimerWheel *ptr);
+
+Timer timer_wheel_add(TimerWheel wheel, uint64_t expires, void *arg);
+
+void timer_wheel_cancel(TimerWheel wheel, Timer timer);
+
+uint64_t timer_wheel_advance(TimerWheel wheel, uint64_t now, TimerCallback callback, void *ctx);
+
+uint64_t timer_wheel_num_timers(TimerWheel wheel);
+
+uint64_t timer_wheel_next_expiry(TimerWheel wheel);
+
+#endif
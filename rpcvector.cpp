@@ -0,0 +1,248 @@
+#include "rpcvector.h"
+#include "rpcmath.h"
+#include <cerrno>
+#include <cstdint>
+#include <pthread.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+typedef void (*VectorFunction)(const int64_t *, const int64_t *, uint8_t,
+                               uint64_t, int64_t *, uint8_t *);
+
+static VectorFunction vector_add_function = NULL;
+static VectorFunction vector_sub_function = NULL;
+static pthread_once_t vector_once = PTHREAD_ONCE_INIT;
+
+// Input: a - the first operands
+// Input: b - the second operands, or a single operand if scalar is (1)
+// Input: scalar - (1) if b holds one value for every lane
+// Input: length - the number of lanes
+// Input: result - set to the result of each lane, (0) where it failed
+// Input: status - set to (0) or the error of each lane
+// Output: none
+//
+// Apply a checked arithmetic kernel to each lane in turn
+template <uint8_t (*kernel)(int64_t, int64_t, int64_t *)>
+void vector_scalar(const int64_t *a, const int64_t *b, uint8_t scalar,
+                   uint64_t length, int64_t *result, uint8_t *status) {
+  for (uint64_t i = 0; i < length; i++) {
+    int64_t value;
+    status[i] = kernel(a[i], b[scalar ? 0 : i], &value);
+    result[i] = status[i] == 0 ? value : 0;
+  }
+  return;
+}
+
+#if defined(__x86_64__)
+// Input: a - the first operands
+// Input: b - the second operands, or a single operand if scalar is (1)
+// Input: scalar - (1) if b holds one value for every lane
+// Input: length - the number of lanes
+// Input: result - set to the sum of each lane, (0) where it overflowed
+// Input: status - set to (0) or EOVERFLOW (75) for each lane
+// Output: none
+//
+// Add four lanes at a time with AVX2
+// A sum overflows when its sign differs from the signs of both operands
+__attribute__((target("avx2"))) void
+vector_add_avx2(const int64_t *a, const int64_t *b, uint8_t scalar,
+                uint64_t length, int64_t *result, uint8_t *status) {
+  __m256i vb = _mm256_set1_epi64x(scalar && length > 0 ? b[0] : 0);
+  uint64_t i = 0;
+
+  for (; i + 4 <= length; i += 4) {
+    __m256i va = _mm256_loadu_si256((const __m256i *)(a + i));
+    if (!scalar) {
+      vb = _mm256_loadu_si256((const __m256i *)(b + i));
+    }
+    __m256i vr = _mm256_add_epi64(va, vb);
+    __m256i overflow = _mm256_and_si256(_mm256_xor_si256(va, vr),
+                                        _mm256_xor_si256(vb, vr));
+    overflow = _mm256_cmpgt_epi64(_mm256_setzero_si256(), overflow);
+    _mm256_storeu_si256((__m256i *)(result + i),
+                        _mm256_andnot_si256(overflow, vr));
+    int mask = _mm256_movemask_pd(_mm256_castsi256_pd(overflow));
+    for (uint8_t j = 0; j < 4; j++) {
+      status[i + j] = ((mask >> j) & 1) ? EOVERFLOW : 0;
+    }
+  }
+
+  vector_scalar<checked_add>(a + i, scalar ? b : b + i, scalar, length - i,
+                             result + i, status + i);
+  return;
+}
+
+// Input: a - the first operands
+// Input: b - the second operands, or a single operand if scalar is (1)
+// Input: scalar - (1) if b holds one value for every lane
+// Input: length - the number of lanes
+// Input: result - set to the difference of each lane, (0) where it overflowed
+// Input: status - set to (0) or EOVERFLOW (75) for each lane
+// Output: none
+//
+// Subtract four lanes at a time with AVX2
+// A difference overflows when the operands have different signs and the
+// result does not have the sign of the first
+__attribute__((target("avx2"))) void
+vector_sub_avx2(const int64_t *a, const int64_t *b, uint8_t scalar,
+                uint64_t length, int64_t *result, uint8_t *status) {
+  __m256i vb = _mm256_set1_epi64x(scalar && length > 0 ? b[0] : 0);
+  uint64_t i = 0;
+
+  for (; i + 4 <= length; i += 4) {
+    __m256i va = _mm256_loadu_si256((const __m256i *)(a + i));
+    if (!scalar) {
+      vb = _mm256_loadu_si256((const __m256i *)(b + i));
+    }
+    __m256i vr = _mm256_sub_epi64(va, vb);
+    __m256i overflow = _mm256_and_si256(_mm256_xor_si256(va, vb),
+                                        _mm256_xor_si256(va, vr));
+    overflow = _mm256_cmpgt_epi64(_mm256_setzero_si256(), overflow);
+    _mm256_storeu_si256((__m256i *)(result + i),
+                        _mm256_andnot_si256(overflow, vr));
+    int mask = _mm256_movemask_pd(_mm256_castsi256_pd(overflow));
+    for (uint8_t j = 0; j < 4; j++) {
+      status[i + j] = ((mask >> j) & 1) ? EOVERFLOW : 0;
+    }
+  }
+
+  vector_scalar<checked_sub>(a + i, scalar ? b : b + i, scalar, length - i,
+                             result + i, status + i);
+  return;
+}
+
+// Input: a - the first operands
+// Input: b - the second operands, or a single operand if scalar is (1)
+// Input: scalar - (1) if b holds one value for every lane
+// Input: length - the number of lanes
+// Input: result - set to the sum of each lane, (0) where it overflowed
+// Input: status - set to (0) or EOVERFLOW (75) for each lane
+// Output: none
+//
+// Add eight lanes at a time with AVX-512
+__attribute__((target("avx512f"))) void
+vector_add_avx512(const int64_t *a, const int64_t *b, uint8_t scalar,
+                  uint64_t length, int64_t *result, uint8_t *status) {
+  __m512i vb = _mm512_set1_epi64(scalar && length > 0 ? b[0] : 0);
+  uint64_t i = 0;
+
+  for (; i + 8 <= length; i += 8) {
+    __m512i va = _mm512_loadu_si512((const void *)(a + i));
+    if (!scalar) {
+      vb = _mm512_loadu_si512((const void *)(b + i));
+    }
+    __m512i vr = _mm512_add_epi64(va, vb);
+    __mmask8 overflow = _mm512_cmplt_epi64_mask(
+        _mm512_and_si512(_mm512_xor_si512(va, vr), _mm512_xor_si512(vb, vr)),
+        _mm512_setzero_si512());
+    _mm512_storeu_si512((void *)(result + i),
+                        _mm512_maskz_mov_epi64(~overflow, vr));
+    for (uint8_t j = 0; j < 8; j++) {
+      status[i + j] = ((overflow >> j) & 1) ? EOVERFLOW : 0;
+    }
+  }
+
+  vector_scalar<checked_add>(a + i, scalar ? b : b + i, scalar, length - i,
+                             result + i, status + i);
+  return;
+}
+
+// Input: a - the first operands
+// Input: b - the second operands, or a single operand if scalar is (1)
+// Input: scalar - (1) if b holds one value for every lane
+// Input: length - the number of lanes
+// Input: result - set to the difference of each lane, (0) where it overflowed
+// Input: status - set to (0) or EOVERFLOW (75) for each lane
+// Output: none
+//
+// Subtract eight lanes at a time with AVX-512
+__attribute__((target("avx512f"))) void
+vector_sub_avx512(const int64_t *a, const int64_t *b, uint8_t scalar,
+                  uint64_t length, int64_t *result, uint8_t *status) {
+  __m512i vb = _mm512_set1_epi64(scalar && length > 0 ? b[0] : 0);
+  uint64_t i = 0;
+
+  for (; i + 8 <= length; i += 8) {
+    __m512i va = _mm512_loadu_si512((const void *)(a + i));
+    if (!scalar) {
+      vb = _mm512_loadu_si512((const void *)(b + i));
+    }
+    __m512i vr = _mm512_sub_epi64(va, vb);
+    __mmask8 overflow = _mm512_cmplt_epi64_mask(
+        _mm512_and_si512(_mm512_xor_si512(va, vb), _mm512_xor_si512(va, vr)),
+        _mm512_setzero_si512());
+    _mm512_storeu_si512((void *)(result + i),
+                        _mm512_maskz_mov_epi64(~overflow, vr));
+    for (uint8_t j = 0; j < 8; j++) {
+      status[i + j] = ((overflow >> j) & 1) ? EOVERFLOW : 0;
+    }
+  }
+
+  vector_scalar<checked_sub>(a + i, scalar ? b : b + i, scalar, length - i,
+                             result + i, status + i);
+  return;
+}
+#endif
+
+// Pick the widest kernels the CPU supports
+void vector_init() {
+  vector_add_function = vector_scalar<checked_add>;
+  vector_sub_function = vector_scalar<checked_sub>;
+
+#if defined(__x86_64__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f")) {
+    vector_add_function = vector_add_avx512;
+    vector_sub_function = vector_sub_avx512;
+  } else if (__builtin_cpu_supports("avx2")) {
+    vector_add_function = vector_add_avx2;
+    vector_sub_function = vector_sub_avx2;
+  }
+#endif
+
+  return;
+}
+
+// Input: operation - VECTOR_ADD, VECTOR_SUB, VECTOR_MUL, VECTOR_DIVIDE or
+// VECTOR_MOD
+// Input: a - the first operands
+// Input: b - the second operands, or a single operand if scalar is (1)
+// Input: scalar - (1) if b holds one value for every lane
+// Input: length - the number of lanes
+// Input: result - set to the result of each lane, (0) where it failed
+// Input: status - set to (0) or the error of each lane, EOVERFLOW (75) or
+// EINVAL (22) for a division by zero
+// Output: (0) if the operation was applied, EINVAL (22) if the operation
+// does not exist
+//
+// Apply an arithmetic operation to every lane of two arrays
+// Multiplication and division have no vector instructions that detect
+// overflow, so they are applied one lane at a time
+uint8_t vector_arithmetic(uint8_t operation, const int64_t *a,
+                          const int64_t *b, uint8_t scalar, uint64_t length,
+                          int64_t *result, uint8_t *status) {
+  pthread_once(&vector_once, vector_init);
+
+  switch (operation) {
+  case VECTOR_ADD:
+    vector_add_function(a, b, scalar, length, result, status);
+    break;
+  case VECTOR_SUB:
+    vector_sub_function(a, b, scalar, length, result, status);
+    break;
+  case VECTOR_MUL:
+    vector_scalar<checked_mul>(a, b, scalar, length, result, status);
+    break;
+  case VECTOR_DIVIDE:
+    vector_scalar<checked_divide>(a, b, scalar, length, result, status);
+    break;
+  case VECTOR_MOD:
+    vector_scalar<checked_mod>(a, b, scalar, length, result, status);
+    break;
+  default:
+    return EINVAL;
+  }
+
+  return 0;
+}
@@ -0,0 +1,19 @@
+#ifndef __RPCVECTOR_H__
+#define __RPCVECTOR_H__
+
+#include <cstdint>
+
+#define VECTOR_ADD 0x01
+#define VECTOR_SUB 0x02
+#define VECTOR_MUL 0x03
+#define VECTOR_DIVIDE 0x04
+#define VECTOR_MOD 0x05
+
+#define VECTOR_SCALAR 0x01 // The second operand is one value for every lane
+#define VECTOR_FLAGS VECTOR_SCALAR
+
+#define MAX_VECTOR_LENGTH (1 << 20)
+
+uint8_t vector_arithmetic(uint8_t operation, const int64_t *a, const int64_t *b, uint8_t scalar, uint64_t length, int64_t *result, uint8_t *status);
+
+#endif
@@ -0,0 +1,510 @@
+#include "rpcwatch.h"
+#include "rpcconvert.h"
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+// The largest frame, a change event with a 31 byte variable name
+#define MAX_EVENT_SIZE 45
+
+typedef struct WatchObj *Watch;
+
+typedef struct WatchObj {
+  uint8_t key[32];
+  uint8_t length;
+  uint8_t flags;
+  struct WatchObj *next;
+} WatchObj;
+
+typedef struct EventObj {
+  uint8_t key[32];
+  uint64_t version;
+} EventObj;
+
+typedef struct SubscriberObj *Subscriber;
+
+typedef struct SubscriberObj {
+  int connfd;
+  uint32_t identifier;
+  Watch watches;
+  EventObj *events;
+  uint64_t num_events;
+  uint8_t overflow;
+  uint8_t closed;
+  uint8_t *out;
+  uint64_t out_start;
+  uint64_t out_end;
+  struct SubscriberObj *next;
+} SubscriberObj;
+
+typedef struct WatchTableObj {
+  uint64_t num_subscribers;
+  uint64_t max_events;
+  uint64_t num_overflows;
+  Subscriber subscribers;
+  uint8_t wake_pending;
+  int wakefd;
+  pthread_mutex_t mutex;
+} WatchTableObj;
+
+// Input: subscriber - the subscriber to delete
+// Output: none
+//
+// Close the connection of a subscriber and delete it
+void delete_subscriber(Subscriber subscriber) {
+  Watch watch = subscriber->watches;
+  while (watch != NULL) {
+    Watch next = watch->next;
+    free(watch);
+    watch = next;
+  }
+  close(subscriber->connfd);
+  free(subscriber->events);
+  free(subscriber->out);
+  free(subscriber);
+  return;
+}
+
+// Input: subscriber - the subscriber of a connection
+// Input: key - the name of a variable that changed
+// Output: (1) if one of the watches of the subscriber matches the variable
+//
+// Check if a subscriber watches a variable
+uint8_t subscriber_matches(Subscriber subscriber, uint8_t *key) {
+  for (Watch watch = subscriber->watches; watch != NULL; watch = watch->next) {
+    if (watch->flags & WATCH_ALL) {
+      return 1;
+    } else if (watch->flags & WATCH_PREFIX) {
+      if (strncmp((char *)key, (char *)watch->key, watch->length) == 0) {
+        return 1;
+      }
+    } else if (strcmp((char *)key, (char *)watch->key) == 0) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Input: subscriber - the subscriber whose waiting events to encode
+// Output: none
+//
+// Encode the waiting events of a subscriber into its output buffer once the
+// previous ones have been sent
+// A subscriber that fell too far behind gets a single EOVERFLOW frame instead
+// and has to read the variables it watches again
+void subscriber_encode(Subscriber subscriber) {
+  uint8_t *out = subscriber->out;
+  uint64_t end = 0;
+
+  if (subscriber->out_start < subscriber->out_end ||
+      (subscriber->num_events == 0 && !subscriber->overflow)) {
+    return;
+  }
+
+  if (subscriber->overflow) {
+    uint32_to_wire(out, 0, 3, subscriber->identifier);
+    uint8_to_wire(out, 4, EOVERFLOW);
+    end = 5;
+  } else {
+    for (uint64_t i = 0; i < subscriber->num_events; i++) {
+      EventObj *event = &(subscriber->events[i]);
+      uint8_t length = strlen((char *)event->key);
+      uint32_to_wire(out, end, end + 3, subscriber->identifier);
+      uint8_to_wire(out, end + 4, 0);
+      uint8_to_wire(out, end + 5, length);
+      memcpy(out + end + 6, event->key, length);
+      uint64_to_wire(out, end + 6 + length, end + 13 + length, event->version);
+      end += 14 + length;
+    }
+  }
+
+  subscriber->num_events = 0;
+  subscriber->overflow = 0;
+  subscriber->out_start = 0;
+  subscriber->out_end = end;
+  return;
+}
+
+// Input: subscriber - the subscriber whose output buffer to send
+// Output: none
+//
+// Send as much of the output buffer of a subscriber as the socket takes
+// without waiting
+void subscriber_flush(Subscriber subscriber) {
+  while (subscriber->out_start < subscriber->out_end) {
+    ssize_t sent = send(subscriber->connfd,
+                        subscriber->out + subscriber->out_start,
+                        subscriber->out_end - subscriber->out_start,
+                        MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (sent > 0) {
+      subscriber->out_start += sent;
+    } else if (sent == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      return;
+    } else if (sent == -1 && errno == EINTR) {
+      continue;
+    } else {
+      subscriber->closed = 1;
+      return;
+    }
+  }
+  return;
+}
+
+// Input: subscriber - the subscriber whose connection is readable
+// Output: none
+//
+// Read and drop whatever the client of a subscriber sends, which tells when
+// the client has gone away
+void subscriber_drain(Subscriber subscriber) {
+  uint8_t buffer[256];
+  while (true) {
+    ssize_t received =
+        recv(subscriber->connfd, buffer, sizeof(buffer), MSG_DONTWAIT);
+    if (received > 0) {
+      continue;
+    }
+    if (received == -1 && errno == EINTR) {
+      continue;
+    }
+    if (received == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+      subscriber->closed = 1;
+    }
+    return;
+  }
+}
+
+// Input: table - the watch table
+// Output: none
+//
+// Wake the watch thread unless it has already been woken
+// Must be called with the watch table mutex held
+void watch_table_wake(WatchTable table) {
+  uint64_t one = 1;
+  if (!table->wake_pending) {
+    table->wake_pending = 1;
+    if (write(table->wakefd, &one, sizeof(one)) == -1) {
+      table->wake_pending = 0;
+    }
+  }
+  return;
+}
+
+// Input: max_events - the number of changed variables each subscriber can
+// have waiting before it overflows
+// Output: the newly created watch table
+//
+// Create a watch table
+WatchTable create_watch_table(uint64_t max_events) {
+  WatchTable table = (WatchTableObj *)malloc(sizeof(WatchTableObj));
+  if (table != NULL) {
+    table->num_subscribers = 0;
+    // Frames are encoded with the wire helpers, which stay within a buffer
+    table->max_events = max_events > 0 ? max_events : 1;
+    if (table->max_events > BUFFER_SIZE / MAX_EVENT_SIZE) {
+      table->max_events = BUFFER_SIZE / MAX_EVENT_SIZE;
+    }
+    table->num_overflows = 0;
+    table->subscribers = NULL;
+    table->wake_pending = 0;
+    table->wakefd = eventfd(0, EFD_NONBLOCK);
+    pthread_mutex_init(&(table->mutex), NULL);
+    if (table->wakefd == -1) {
+      pthread_mutex_destroy(&(table->mutex));
+      free(table);
+      return NULL;
+    }
+  }
+  return table;
+}
+
+// Input: ptr - pointer to a watch table
+// Output: (0) if the table was deleted successfully, EINVAL (22) if the
+// pointer or contents of the table do not exist
+//
+// Delete a watch table whose thread is not running and close the connections
+// of its subscribers
+uint8_t delete_watch_table(WatchTable *ptr) {
+  if (ptr != NULL && *ptr != NULL) {
+    WatchTable table = *ptr;
+    Subscriber subscriber = table->subscribers;
+    while (subscriber != NULL) {
+      Subscriber next = subscriber->next;
+      delete_subscriber(subscriber);
+      subscriber = next;
+    }
+    close(table->wakefd);
+    pthread_mutex_destroy(&(table->mutex));
+    free(table);
+    *ptr = NULL;
+    return 0;
+  } else {
+    return EINVAL;
+  }
+}
+
+// Input: table - the watch table
+// Input: connfd - the connection to push change events to
+// Input: identifier - the identifier of the watch request, sent with every
+// event
+// Input: keys - the names of the variables to watch, NULL for WATCH_ALL
+// Input: flags - the flags of each watch
+// Input: num_keys - the number of watches
+// Output: (0) if the connection was subscribed, EINVAL (22) if a watch is
+// invalid or ENOMEM (12) if the subscriber could not be created
+//
+// Subscribe a connection to changes of variables
+// The watch table owns the connection from then on. The reply to the watch
+// request is the first frame the watch thread sends, so that no event can
+// overtake it.
+uint8_t watch_table_subscribe(WatchTable table, int connfd,
+                              uint32_t identifier, uint8_t **keys,
+                              uint8_t *flags, uint8_t num_keys) {
+  if (table == NULL || num_keys == 0) {
+    return EINVAL;
+  }
+
+  for (uint8_t i = 0; i < num_keys; i++) {
+    if ((flags[i] & ~WATCH_FLAGS) != 0 ||
+        (keys[i] == NULL) != ((flags[i] & WATCH_ALL) != 0)) {
+      return EINVAL;
+    }
+  }
+
+  Subscriber subscriber = (SubscriberObj *)calloc(1, sizeof(SubscriberObj));
+  if (subscriber == NULL) {
+    return ENOMEM;
+  }
+
+  subscriber->connfd = connfd;
+  subscriber->identifier = identifier;
+  subscriber->events =
+      (EventObj *)malloc(table->max_events * sizeof(EventObj));
+  subscriber->out = (uint8_t *)malloc(table->max_events * MAX_EVENT_SIZE);
+
+  for (uint8_t i = 0; i < num_keys && subscriber->events != NULL &&
+                      subscriber->out != NULL;
+       i++) {
+    Watch watch = (WatchObj *)calloc(1, sizeof(WatchObj));
+    if (watch == NULL) {
+      break;
+    }
+    if (keys[i] != NULL) {
+      strncpy((char *)watch->key, (char *)keys[i], 31);
+    }
+    watch->length = strlen((char *)watch->key);
+    watch->flags = flags[i];
+    watch->next = subscriber->watches;
+    subscriber->watches = watch;
+  }
+
+  if (subscriber->events == NULL || subscriber->out == NULL ||
+      subscriber->watches == NULL) {
+    free(subscriber->events);
+    free(subscriber->out);
+    while (subscriber->watches != NULL) {
+      Watch next = subscriber->watches->next;
+      free(subscriber->watches);
+      subscriber->watches = next;
+    }
+    free(subscriber);
+    return ENOMEM;
+  }
+
+  // The reply to the watch request carries the number of watches
+  uint32_to_wire(subscriber->out, 0, 3, identifier);
+  uint8_to_wire(subscriber->out, 4, 0);
+  uint8_to_wire(subscriber->out, 5, num_keys);
+  subscriber->out_end = 6;
+
+  pthread_mutex_lock(&(table->mutex)); // Lock the watch table mutex
+  // --------------------------------------------------------------------------
+  // Begin critical section
+
+  subscriber->next = table->subscribers;
+  table->subscribers = subscriber;
+  __atomic_add_fetch(&(table->num_subscribers), 1, __ATOMIC_RELEASE);
+  watch_table_wake(table);
+
+  // End critical section
+  // --------------------------------------------------------------------------
+  pthread_mutex_unlock(&(table->mutex)); // Unlock the watch table mutex
+
+  return 0;
+}
+
+// Input: arg - the watch table
+// Input: key - the name of the variable that changed
+// Input: version - the new version of the variable or (0) if it was deleted
+// Output: none
+//
+// Record a change of a variable for every subscriber that watches it
+// Changes of the same variable that have not been sent yet are coalesced into
+// the latest one, so a subscriber never has more than max_events waiting
+// however slowly it reads
+void watch_table_notify(void *arg, uint8_t *key, uint64_t version) {
+  WatchTable table = (WatchTable)arg;
+
+  // Changes cost nothing while nobody watches
+  if (table == NULL ||
+      __atomic_load_n(&(table->num_subscribers), __ATOMIC_ACQUIRE) == 0) {
+    return;
+  }
+
+  pthread_mutex_lock(&(table->mutex)); // Lock the watch table mutex
+  // --------------------------------------------------------------------------
+  // Begin critical section
+
+  for (Subscriber subscriber = table->subscribers; subscriber != NULL;
+       subscriber = subscriber->next) {
+    if (subscriber->overflow || !subscriber_matches(subscriber, key)) {
+      continue;
+    }
+
+    uint64_t i = 0;
+    while (i < subscriber->num_events &&
+           strcmp((char *)subscriber->events[i].key, (char *)key) != 0) {
+      i++;
+    }
+
+    if (i < subscriber->num_events) {
+      subscriber->events[i].version = version;
+    } else if (subscriber->num_events < table->max_events) {
+      strncpy((char *)subscriber->events[i].key, (char *)key, 31);
+      subscriber->events[i].key[31] = 0;
+      subscriber->events[i].version = version;
+      subscriber->num_events++;
+    } else {
+      subscriber->overflow = 1;
+      subscriber->num_events = 0;
+      table->num_overflows++;
+    }
+
+    watch_table_wake(table);
+  }
+
+  // End critical section
+  // --------------------------------------------------------------------------
+  pthread_mutex_unlock(&(table->mutex)); // Unlock the watch table mutex
+  return;
+}
+
+// Input: table - the watch table
+// Output: the number of connections that watch variables
+//
+// Get the number of subscribers of a watch table
+uint64_t watch_table_num_subscribers(WatchTable table) {
+  if (table == NULL) {
+    return 0;
+  }
+  return __atomic_load_n(&(table->num_subscribers), __ATOMIC_ACQUIRE);
+}
+
+// Input: table - the watch table
+// Output: the number of times a subscriber fell too far behind
+//
+// Get the number of overflows of a watch table
+uint64_t watch_table_num_overflows(WatchTable table) {
+  if (table == NULL) {
+    return 0;
+  }
+  pthread_mutex_lock(&(table->mutex));
+  uint64_t num_overflows = table->num_overflows;
+  pthread_mutex_unlock(&(table->mutex));
+  return num_overflows;
+}
+
+// Input: arg - the watch table
+// Output: none
+//
+// Watch thread loop
+// Sends the waiting events of every subscriber without ever blocking on one,
+// and closes the connections of clients that went away
+void *watch_table_start(void *arg) {
+  WatchTable table = (WatchTable)arg;
+  struct pollfd *fds = NULL;
+  Subscriber *polled = NULL;
+  uint64_t capacity = 0;
+  uint64_t num_fds;
+  uint64_t counter;
+
+  while (true) {
+    pthread_mutex_lock(&(table->mutex)); // Lock the watch table mutex
+    // ------------------------------------------------------------------------
+    // Begin critical section
+
+    if (capacity < table->num_subscribers + 1) {
+      capacity = 2 * (table->num_subscribers + 1);
+      fds = (struct pollfd *)realloc(fds, capacity * sizeof(struct pollfd));
+      polled = (Subscriber *)realloc(polled, capacity * sizeof(Subscriber));
+    }
+
+    fds[0].fd = table->wakefd;
+    fds[0].events = POLLIN;
+    num_fds = 1;
+
+    // Only the watch thread deletes subscribers, so they outlive the poll
+    for (Subscriber subscriber = table->subscribers; subscriber != NULL;
+         subscriber = subscriber->next) {
+      fds[num_fds].fd = subscriber->connfd;
+      fds[num_fds].events = POLLIN;
+      if (subscriber->out_start < subscriber->out_end) {
+        fds[num_fds].events |= POLLOUT;
+      }
+      polled[num_fds] = subscriber;
+      num_fds++;
+    }
+
+    // End critical section
+    // ------------------------------------------------------------------------
+    pthread_mutex_unlock(&(table->mutex)); // Unlock the watch table mutex
+
+    if (poll(fds, num_fds, -1) == -1 && errno != EINTR) {
+      continue;
+    }
+
+    pthread_mutex_lock(&(table->mutex)); // Lock the watch table mutex
+    // ------------------------------------------------------------------------
+    // Begin critical section
+
+    if (fds[0].revents & POLLIN) {
+      while (read(table->wakefd, &counter, sizeof(counter)) > 0) {
+      }
+      table->wake_pending = 0;
+    }
+
+    for (uint64_t i = 1; i < num_fds; i++) {
+      if (fds[i].revents & (POLLIN | POLLHUP | POLLERR)) {
+        subscriber_drain(polled[i]);
+      }
+    }
+
+    Subscriber *link = &(table->subscribers);
+    while (*link != NULL) {
+      Subscriber subscriber = *link;
+      if (!subscriber->closed) {
+        subscriber_flush(subscriber);
+        subscriber_encode(subscriber);
+        subscriber_flush(subscriber);
+      }
+      if (subscriber->closed) {
+        *link = subscriber->next;
+        __atomic_sub_fetch(&(table->num_subscribers), 1, __ATOMIC_RELEASE);
+        delete_subscriber(subscriber);
+      } else {
+        link = &(subscriber->next);
+      }
+    }
+
+    // End critical section
+    // ------------------------------------------------------------------------
+    pthread_mutex_unlock(&(table->mutex)); // Unlock the watch table mutex
+  }
+
+  return 0;
+}
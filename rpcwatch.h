@@ -0,0 +1,29 @@
+#ifndef __RPCWATCH_H__
+#define __RPCWATCH_H__
+
+#include <cstdint>
+
+#define WATCH_PREFIX 0x01 // Match every variable whose name starts with the key
+#define WATCH_ALL 0x02    // Match every variable, no key follows
+#define WATCH_FLAGS (WATCH_PREFIX | WATCH_ALL)
+
+// Changed variables each subscriber can have waiting before it overflows
+#define DEFAULT_WATCH_EVENTS 64
+
+typedef struct WatchTableObj *WatchTable;
+
+WatchTable create_watch_table(uint64_t max_events);
+
+uint8_t delete_watch_table(WatchTable *ptr);
+
+uint8_t watch_table_subscribe(WatchTable table, int connfd, uint32_t identifier, uint8_t **keys, uint8_t *flags, uint8_t num_keys);
+
+void watch_table_notify(void *arg, uint8_t *key, uint64_t version);
+
+uint64_t watch_table_num_subscribers(WatchTable table);
+
+uint64_t watch_table_num_overflows(WatchTable table);
+
+void * watch_table_start(void *arg);
+
+#endif